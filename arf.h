@@ -34,6 +34,50 @@
 # define CONFIG_LIBARF_EXTERNAL		2
 #endif
 
+#include <stddef.h>
+
+/*
+ * Where barf() sends its output.  Each backtrace is formatted in a buffer
+ * of the barf()ing thread first, then handed over in a single piece, so
+ * the backtraces of concurrent barf()s don't interleave.  By default it's
+ * written to stderr.  Choose the destination with arf_sink() by $type:
+ *
+ *   -- ARF_SINK_FD:       write() it to $fd
+ *   -- ARF_SINK_CALLBACK: call $fun with it and $data; the text is not
+ *                         NUL-terminated and is only valid during the call
+ *   -- ARF_SINK_RING:     copy it to $buf of $size bytes at $pos, wrapping
+ *                         around, so the most recent backtraces can be
+ *                         found in memory (or in a core dump); $pos is
+ *                         advanced
+ *
+ * Not used if libarf logs with glib.
+ */
+enum arf_sink_type
+{
+	ARF_SINK_FD,
+	ARF_SINK_CALLBACK,
+	ARF_SINK_RING,
+};
+
+struct arf_sink_st
+{
+	enum arf_sink_type type;
+	union
+	{
+		int fd;
+		struct
+		{
+			void (*fun)(char const *text, size_t size, void *data);
+			void *data;
+		} callback;
+		struct
+		{
+			char *buf;
+			size_t size, pos;
+		} ring;
+	};
+};
+
 /* The rest will just confuse things when compiling libarf.c. */
 #ifndef _LIBARF_C
 
@@ -50,14 +94,23 @@
  * if the program is linked with the library.  While this symbol
  * will be defined in all translation units #include:ing this header
  * the dynamic linker makes sure to merge those definitions.
+ * Likewise $the_real_arf_sink.
  */
 void (*the_real_barf)(char const *, ...)
 	__attribute__((format(printf, 1, 2)));
+void (*the_real_arf_sink)(struct arf_sink_st *);
 #else
 void barf(char const *, ...)
 	__attribute__((format(printf, 1, 2)));
+void arf_sink(struct arf_sink_st *);
 #endif
 
+/*
+ * arf_sink($sink) makes barf() send its output to $sink from now on,
+ * or to stderr if it's NULL.  $sink is not copied, so it must remain
+ * valid as long as it's in use.
+ */
+
 /*
  * Define the library user's barf(), your entry point to libarf.
  * It prints the backtrace on the selected output streams or
@@ -86,6 +139,8 @@ static void find_the_real_barf(void)
 		 * clearenv() made its presence. */
 		return;
 	sscanf(str, "%p", &the_real_barf);
+	if ((str = getenv("THE_REAL_ARF_SINK")) != NULL)
+		sscanf(str, "%p", &the_real_arf_sink);
 }
 
 #define barf(...)				\
@@ -96,6 +151,15 @@ do						\
 	if (the_real_barf)			\
 		the_real_barf(__VA_ARGS__);	\
 } while (0)
+
+#define arf_sink(sink)				\
+do						\
+{						\
+	if (!tried_to_find_the_real_barf)	\
+		find_the_real_barf();		\
+	if (the_real_arf_sink)			\
+		the_real_arf_sink(sink);	\
+} while (0)
 #elif CONFIG_LIBARF_EXTERNAL > 0
 /* libarf.so sets up $the_real_barf if/when initialized. */
 # define barf(...)				\
@@ -104,6 +168,13 @@ while (the_real_barf)				\
 	the_real_barf(__VA_ARGS__);		\
 	break;					\
 }
+
+# define arf_sink(sink)				\
+while (the_real_arf_sink)			\
+{						\
+	the_real_arf_sink(sink);		\
+	break;					\
+}
 #endif
 
 #ifndef __STRICT_ANSI__
@@ -0,0 +1,234 @@
+#ifndef _ERO_H
+#define _ERO_H
+
+/*
+ * ero.h -- libero's binary report format {{{
+ *
+ * With $LIBERO_FORMAT=binary libero appends its reports to
+ * <program>.<pid>.leaks.bin instead of printing them in text.
+ * That is much faster, because the addresses needn't be looked up
+ * in the debug information while the program is stopped.  erodump
+ * does it offline, and turns the reports into the usual text format.
+ * A report consists of:
+ *
+ *   -- struct erobin_header_st
+ *   -- $nstacks times struct erobin_stack_st and its $depth frames
+ *   -- $nrecords times struct erobin_record_st
+ *   -- $nsites times struct erobin_site_st, the top allocation sites
+ *      by the bytes in use, in descending order
+ *   -- $lmaps bytes: the contents of /proc/<pid>/maps
+ *   -- $lbuildids bytes: "<address> <build-id>" lines, where
+ *      <address> is somewhere in the mapping of the object
+ *      having the <build-id>
+ *
+ * It's all in the byte order of the profiled program, and everything
+ * is aligned to 8 bytes, so the reports can be mmap()ed and walked
+ * in place.  The next report starts $size bytes after the header.
+ *
+ * With $LIBERO_TRACE=1 libero doesn't keep records at all, but writes
+ * the allocation events to <program>.<pid>.events, from which erodump
+ * can reproduce the reports at any point in time.  It starts with
+ * struct eroevt_header_st, which is followed by struct eroevt_st:s,
+ * some of them followed by more data as told by their $type:
+ *
+ *   -- EROEVT_MALLOC: $ptr of $size bytes was allocated by $tid
+ *      in $stack
+ *   -- EROEVT_FREE: $ptr was freed
+ *   -- EROEVT_REALLOC_FROM: $tid started to realloc() $ptr
+ *   -- EROEVT_REALLOC_TO: and the new allocation is $ptr of $size
+ *      bytes; $stack is where it was made in case the original
+ *      allocation was not known
+ *   -- EROEVT_REALLOC_FAILED: or $tid's realloc() failed
+ *   -- EROEVT_REPORT: libero was signalled to report; $ptr and $size
+ *      are the wall clock time in seconds and microseconds
+ *   -- EROEVT_STACK: a struct erobin_stack_st, whose ID is $stack,
+ *      follows the event
+ *   -- EROEVT_MAPS: /proc/<pid>/maps and the build IDs have changed,
+ *      they follow the event in $ptr and $size bytes, in the same
+ *      format as in the reports, padded to 8 bytes
+ *
+ * The events of different threads are not in chronological order,
+ * they need to be sorted by $time, which is in nanoseconds.
+ * }}}
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <link.h>
+
+/* Standard definitions */
+/* All reports start with this. */
+#define EROBIN_MAGIC                "EROBIN1"
+
+/* For erobin_header_st::flags. */
+#define EROBIN_THREADED             (1 << 0)
+#define EROBIN_SUMMARY_ONLY         (1 << 1)
+
+/* For eroevt_st::type. */
+#define EROEVT_MALLOC               1
+#define EROEVT_FREE                 2
+#define EROEVT_REALLOC_FROM         3
+#define EROEVT_REALLOC_TO           4
+#define EROEVT_REALLOC_FAILED       5
+#define EROEVT_REPORT               6
+#define EROEVT_STACK                7
+#define EROEVT_MAPS                 8
+
+/* Event files start with this. */
+#define EROEVT_MAGIC                "EROEVT1"
+
+/* Longer build IDs are ignored. */
+#define EROBIN_MAX_BUILD_ID         64
+
+/* Type definitions */
+struct erobin_header_st
+{
+   /*
+    * -- magic:        EROBIN_MAGIC
+    * -- size:         the size of the report including this header
+    * -- nreport:      the serial number of the report, starting from 1
+    * -- pid:          the process which wrote it
+    * -- flags:        EROBIN_*
+    * -- karma_min_depth: $LIBERO_KARMA_DEPTH
+    * -- since, now:   when profiling started and when the report
+    *                  was made, in seconds and microseconds
+    * -- nallocations: the number of allocations in the period
+    * -- nmemories:    the number of allocations we have records of
+    * -- allocated, previous, peak: $Allocated now and at the time of
+    *                  the previous report, and $Peak in the period
+    * -- sample_bytes: $LIBERO_SAMPLE_BYTES
+    * -- nsampled:     how many of $nallocations were sampled
+    * -- nestimated:   how many allocations we estimate to be in use
+    *                  from the samples
+    * -- metadata_mapped, metadata_used: how many bytes libero has
+    *                  mmap()ed for its own bookkeeping, and how many
+    *                  of them are in use
+    */
+   char magic[8];
+   uint64_t size;
+   uint32_t nreport, pid;
+   uint32_t flags, karma_min_depth;
+   int64_t since_sec, since_usec;
+   int64_t now_sec, now_usec;
+   uint32_t nallocations, nmemories;
+   int64_t allocated, previous, peak;
+   uint64_t sample_bytes;
+   uint32_t nsampled, nestimated;
+   uint64_t metadata_mapped, metadata_used;
+
+   /* The size of the parts following the header. */
+   uint32_t nstacks, nrecords;
+   uint32_t nsites, unused;
+   uint64_t lmaps, lbuildids;
+};
+
+/* A backtrace in which allocations were made. */
+struct erobin_stack_st
+{
+   uint32_t depth, unused;
+   uint64_t addrs[0];
+};
+
+/* A record of an allocation. */
+struct erobin_record_st
+{
+   /*
+    * -- stack:  the index of the allocation's stack plus one,
+    *            or 0 if it doesn't have a backtrace
+    * -- karma:  how many reports has it been in before this one
+    */
+   uint64_t ptr, size;
+   uint32_t stack, karma;
+   uint32_t tid, unused;
+};
+
+/* The aggregates of an allocation site, see $LIBERO_TOP. */
+struct erobin_site_st
+{
+   /*
+    * -- stack:      the index of the site's stack plus one
+    * -- live_count: the number of allocations made there in use
+    * -- live_bytes, peak_bytes: their size, and the largest it's been
+    * -- allocated, freed: the number of bytes allocated and freed there
+    *                since profiling started
+    */
+   uint32_t stack, live_count;
+   uint64_t live_bytes, peak_bytes;
+   uint64_t allocated, freed;
+};
+
+/* The beginning of an event file. */
+struct eroevt_header_st
+{
+   /*
+    * -- magic:        EROEVT_MAGIC
+    * -- flags, karma_min_depth: like in erobin_header_st
+    * -- since:        when profiling started in wall clock time
+    *                  and in the time of the events
+    */
+   char magic[8];
+   uint32_t pid, flags;
+   uint32_t karma_min_depth, unused;
+   int64_t since_sec, since_usec;
+   uint64_t since_time;
+};
+
+/* An allocation event. */
+struct eroevt_st
+{
+   uint32_t type, stack;
+   uint32_t tid, unused;
+   uint64_t time;
+   uint64_t ptr, size;
+};
+
+/* Program code */
+/*
+ * Look for the GNU build ID among the $lnotes bytes of ELF $notes
+ * and print it in hexadecimal in $hex, which must have room for
+ * 2*EROBIN_MAX_BUILD_ID+1 characters.  Returns whether the build ID
+ * was found.
+ */
+static inline int erobin_build_id(char *hex,
+   void const *notes, size_t lnotes)
+{
+   char const *p, *end;
+
+   p = notes;
+   end = p + lnotes;
+   while (p + sizeof(ElfW(Nhdr)) <= end)
+   {
+      size_t lname, ldesc;
+      ElfW(Nhdr) const *nhdr;
+      unsigned char const *desc;
+
+      nhdr = (ElfW(Nhdr) const *)p;
+      lname = (nhdr->n_namesz + 3) & ~3;
+      ldesc = (nhdr->n_descsz + 3) & ~3;
+      desc = (unsigned char const *)&nhdr[1] + lname;
+      if ((char const *)desc + nhdr->n_descsz > end)
+         break;
+
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4
+          && !memcmp(&nhdr[1], "GNU", 4)
+          && nhdr->n_descsz <= EROBIN_MAX_BUILD_ID)
+      {
+         unsigned i;
+
+         for (i = 0; i < nhdr->n_descsz; i++)
+         {
+            hex[2*i+0] = "0123456789abcdef"[desc[i] >> 4];
+            hex[2*i+1] = "0123456789abcdef"[desc[i] & 0xf];
+         }
+         hex[2*i] = '\0';
+         return 1;
+      }
+
+      p = (char const *)desc + ldesc;
+   }
+
+   return 0;
+} /* erobin_build_id */
+
+/* vim: set et ts=3 sw=3: */
+#endif /* ! _ERO_H */
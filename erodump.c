@@ -0,0 +1,834 @@
+/*
+ * erodump.c -- turn libero's binary reports into text {{{
+ *
+ * Reads the <program>.<pid>.leaks.bin written by libero when run with
+ * $LIBERO_FORMAT=binary, looks up the backtraces in the debug information
+ * with libarf, as if the program had been symbolized in-process, and
+ * prints the reports on the standard output in the same text format as
+ * libero would, so you can feed it to spidero.pl for example.
+ *
+ * Usage: erodump <program>.<pid>.leaks.bin > <program>.<pid>.leaks
+ *
+ * It can also replay the <program>.<pid>.events written with
+ * $LIBERO_TRACE=1, and print a report wherever the program was signalled
+ * to make one, and at the given number of seconds after profiling started:
+ *
+ * Usage: erodump [-at=<seconds>]... <program>.<pid>.events
+ *
+ * The objects the program used need to be at the same path as they were
+ * when the report was written.  If they have been changed since, as told
+ * by their build ID, erodump warns about it, but carries on.
+ * }}}
+ */
+
+/* Configuration */
+#define _GNU_SOURCE
+
+/* Include files */
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "libarf.c"
+#include "ero.h"
+
+/* Type definitions */
+/* The objects we've seen in the /proc/<pid>/maps of the reports. */
+struct object_st
+{
+   /*
+    * -- path:     the object's path, which is shared by all mappings
+    *              of the object, even across reports, so getdso() can
+    *              tell it has seen it
+    * -- checked:  0 until we compared the build IDs, then 1 if they
+    *              match, -1 otherwise
+    */
+   char *path;
+   int checked;
+   struct object_st *next;
+};
+
+/* An allocation in use while replaying events. */
+struct live_st
+{
+   /*
+    * -- rec:   what report() needs to know about it, except that
+    *           $rec.karma is the number of reports made before it
+    * -- next:  the next allocation in the same bucket of $Live,
+    *           or in $Limbo
+    */
+   struct erobin_record_st rec;
+   struct live_st *next;
+};
+
+/* Private variables */
+/* Where to complain. */
+static FILE *Errors;
+
+/* All the object_st:s we have seen. */
+static struct object_st *Objects;
+
+/* The allocations in use while replaying, hashed by pointer
+ * in 1 << $Live_bits buckets. */
+static struct live_st **Live;
+static unsigned Live_bits, NLive;
+
+/* The allocations being realloc()ed, one per thread. */
+static struct live_st *Limbo;
+
+/* Program code */
+/* Returns the object of $path, creating it if necessary. */
+static struct object_st *object(char const *path)
+{
+   struct object_st *obj;
+
+   for (obj = Objects; obj; obj = obj->next)
+      if (!strcmp(obj->path, path))
+         return obj;
+
+   if (!(obj = malloc(sizeof(*obj))) || !(obj->path = strdup(path)))
+   {
+      fprintf(Errors, "erodump: %m\n");
+      exit(1);
+   }
+   obj->checked = 0;
+   obj->next = Objects;
+   Objects = obj;
+   return obj;
+} /* object */
+
+/* Parse the $lmaps bytes of $maps into $Mappings. */
+static void parse_maps(char const *maps, size_t lmaps)
+{
+   static struct bufhead_st bufs[2];
+   static unsigned cur;
+   struct bufhead_st *bh, *prev;
+   char const *end, *eol;
+   struct mapping_st *map;
+
+   /* Keep the previous $Mappings around to compare with. */
+   prev = &bufs[cur];
+   bh = &bufs[cur ^= 1];
+   bh->size1 = sizeof(*map);
+   bh->n = 0;
+   for (end = maps + lmaps; maps < end; maps = eol + 1)
+   {
+      unsigned long start, stop, offset;
+      char path[512];
+      int n, lpath;
+
+      if (!(eol = memchr(maps, '\n', end - maps)))
+         eol = end;
+
+      /* <start>-<end> <perms> <offset> <dev> <inode> <path> */
+      if (sscanf(maps, "%lx-%lx %*s %lx %*s %*s %n",
+                 &start, &stop, &offset, &n) < 3)
+         continue;
+      if (maps[n] != '/')
+         /* Anonymous mapping. */
+         continue;
+      lpath = eol - &maps[n];
+      if (lpath >= sizeof(path))
+         continue;
+      memcpy(path, &maps[n], lpath);
+      path[lpath] = '\0';
+
+      if (!(map = enlarge(bh, 1)))
+         break;
+      map->start  = (void const *)start;
+      map->end    = (void const *)stop;
+      map->offset = offset;
+      map->path   = object(path)->path;
+      bh->n++;
+   }
+
+   /* If anything has been loaded or unloaded since the previous
+    * report the addresses may belong to different objects. */
+   if (bh->n != prev->n
+       || (bh->n && memcmp(bh->buf, prev->buf, sizeof(*map) * bh->n)))
+      forget_callsites();
+
+   Mappings = (struct mapping_st const *)bh->buf;
+   NMappings = bh->n;
+} /* parse_maps */
+
+/* Compare the build IDs in the $lbuildids bytes of $buildids with
+ * those of the objects we'd use to symbolize and complain about
+ * the differences. */
+static void check_build_ids(char const *buildids, size_t lbuildids)
+{
+   char const *end, *eol;
+
+   for (end = buildids + lbuildids; buildids < end; buildids = eol + 1)
+   {
+      unsigned i;
+      void *addr;
+      char hex[2*EROBIN_MAX_BUILD_ID + 1];
+      char ours[2*EROBIN_MAX_BUILD_ID + 1];
+      struct object_st *obj;
+      Elf *elf;
+      Elf_Scn *scn;
+      int fd;
+
+      if (!(eol = memchr(buildids, '\n', end - buildids)))
+         eol = end;
+      if (sscanf(buildids, "%p %128s", &addr, hex) < 2)
+         continue;
+
+      /* Which object does $addr belong to? */
+      obj = NULL;
+      for (i = 0; i < NMappings; i++)
+         if (Mappings[i].start <= addr && addr < Mappings[i].end)
+         {
+            obj = object(Mappings[i].path);
+            break;
+         }
+      if (!obj || obj->checked)
+         continue;
+
+      /* Find our build ID in the SHT_NOTE sections of $obj. */
+      ours[0] = '\0';
+      if ((fd = open(obj->path, O_RDONLY)) >= 0)
+      {
+         elf_version(EV_CURRENT);
+         if ((elf = elf_begin(fd, ELF_C_READ, NULL)) != NULL)
+         {
+            for (scn = elf_getscn(elf, 0); scn;
+                 scn = elf_nextscn(elf, scn))
+            {
+               Elf_Shdr *shdr;
+               Elf_Data *data;
+
+               if (!(shdr = elf_getshdr(scn))
+                   || shdr->sh_type != SHT_NOTE)
+                  continue;
+               if ((data = elf_getdata(scn, NULL)) != NULL
+                   && erobin_build_id(ours, data->d_buf, data->d_size))
+                  break;
+            }
+            elf_end(elf);
+         }
+         close(fd);
+      }
+
+      /* Don't complain if we couldn't find ours, bt0() will
+       * not find anything in $obj either. */
+      obj->checked = ours[0] && strcmp(hex, ours) ? -1 : 1;
+      if (obj->checked < 0)
+         fprintf(Errors, "erodump: %s: build ID differs from that of "
+                 "the profiled program's, backtraces may be wrong\n",
+                 obj->path);
+   }
+} /* check_build_ids */
+
+/* How many allocations of $size bytes does a sample represent?
+ * The same as libero's sample_weight(). */
+static double sample_weight(struct erobin_header_st const *hdr, size_t size)
+{
+   double p;
+
+   p = -expm1(-(double)size / hdr->sample_bytes);
+   return p > 0 ? 1 / p : 1;
+} /* sample_weight */
+
+/* For qsort(): order by karma, most ancient first. */
+static int compare(void const *lhs, void const *rhs)
+{
+   struct erobin_record_st const *l = lhs, *r = rhs;
+
+   return l->karma < r->karma ? 1 : l->karma > r->karma ? -1 : 0;
+} /* compare */
+
+/* Print the $nrecs records of $recs, all allocated in $stack,
+ * and the $stack itself, like libero's dump(). */
+static void dump(struct erobin_header_st const *hdr,
+   struct erobin_stack_st const *stack,
+   struct erobin_record_st *recs, unsigned nrecs)
+{
+   unsigned karmas, i;
+
+   /* It makes little sense to sort without backtraces. */
+   if (stack)
+      qsort(recs, nrecs, sizeof(*recs), compare);
+
+   karmas = 0;
+   for (i = 0; i < nrecs; i++)
+   {
+      if (hdr->flags & EROBIN_THREADED)
+         printf("ptr=%p (tid=%u), ", (void *)(uintptr_t)recs[i].ptr,
+                recs[i].tid);
+      else
+         printf("ptr=%p, ", (void *)(uintptr_t)recs[i].ptr);
+      if (!hdr->sample_bytes)
+         printf("size=%zu, karma=%u\n",
+                (size_t)recs[i].size, recs[i].karma);
+      else
+         printf("size=%.0f, karma=%u, sampled=%zu\n",
+                recs[i].size * sample_weight(hdr, recs[i].size),
+                recs[i].karma, (size_t)recs[i].size);
+
+      if (!i || recs[i-1].karma != recs[i].karma)
+         karmas++;
+   }
+
+   /* Symbolize the backtrace. */
+   if (stack && karmas >= hdr->karma_min_depth)
+      for (i = 0; i < stack->depth; i++)
+         bt0(i+1, (void const *)(uintptr_t)stack->addrs[i], NULL);
+} /* dump */
+
+/* Print the report of $hdr about its $nrecords $recs, which are
+ * sorted by their stack, the index in $stacks plus one, and its
+ * $nsites top $sites. */
+static void report(struct erobin_header_st const *hdr,
+   struct erobin_stack_st const *const *stacks, unsigned nstacks,
+   struct erobin_record_st *recs, struct erobin_site_st const *sites)
+{
+   struct tm tm;
+   time_t t;
+   unsigned i, o, from;
+
+   if (hdr->nreport == 1)
+   {
+      t = hdr->since_sec;
+      localtime_r(&t, &tm);
+      printf("started profiling on:\t" "%.2u:%.2u:%.2u.%.6lu %.2u/%.2u/%.2u\n",
+             tm.tm_hour, tm.tm_min, tm.tm_sec,
+             (unsigned long)hdr->since_usec,
+             tm.tm_mday, 1+tm.tm_mon, tm.tm_year % 100);
+   }
+
+   t = hdr->now_sec;
+   localtime_r(&t, &tm);
+   printf("report %u created on:\t"  "%.2u:%.2u:%.2u.%.6lu %.2u/%.2u/%.2u\n",
+          hdr->nreport,
+          tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned long)hdr->now_usec,
+          tm.tm_mday, 1+tm.tm_mon, tm.tm_year % 100);
+   if (!hdr->sample_bytes)
+      printf("number of allocations:\t" "%u (currently %u)\n",
+             hdr->nallocations, hdr->nmemories);
+   else
+   {
+      printf("number of allocations:\t" "%u (currently %u)\n",
+             hdr->nallocations, hdr->nestimated);
+      printf("sampled allocations:\t"   "%u (currently %u, every %lu bytes)\n",
+             hdr->nsampled, hdr->nmemories,
+             (unsigned long)hdr->sample_bytes);
+   }
+   printf("current allocation:\t"    "%d (delta=%+d bytes)\n",
+          (int)hdr->allocated, (int)(hdr->allocated-hdr->previous));
+   printf("peak allocation:\t"       "%d (%d bytes since the start of period)\n",
+          (int)hdr->peak, (int)(hdr->peak-hdr->previous));
+   if (hdr->metadata_mapped)
+      printf("metadata footprint:\t"    "%lu (%lu bytes in use)\n",
+             (unsigned long)hdr->metadata_mapped,
+             (unsigned long)hdr->metadata_used);
+   printf("\n");
+
+   if (hdr->nsites)
+   {
+      printf("top %u allocation sites:\n", hdr->nsites);
+      for (i = 0; i < hdr->nsites; i++)
+      {
+         struct erobin_stack_st const *stack;
+
+         printf("site=%u, live=%zu (%u allocations), peak=%zu, "
+                "allocated=%zu, freed=%zu\n",
+                i+1, (size_t)sites[i].live_bytes, sites[i].live_count,
+                (size_t)sites[i].peak_bytes, (size_t)sites[i].allocated,
+                (size_t)sites[i].freed);
+         o = sites[i].stack;
+         if (!o || o > nstacks || !(stack = stacks[o-1]))
+            continue;
+         for (o = 0; o < stack->depth; o++)
+            bt0(o+1, (void const *)(uintptr_t)stack->addrs[o], NULL);
+      }
+      printf("\n");
+   }
+
+   if (hdr->flags & EROBIN_SUMMARY_ONLY)
+      goto done;
+
+   /* Find the boundaries of the stacks in $recs. */
+   for (from = i = 0; i <= hdr->nrecords; i++)
+   {
+      if (i < hdr->nrecords && recs[i].stack == recs[from].stack)
+         continue;
+      if (i > from)
+      {
+         o = recs[from].stack;
+         dump(hdr, o && o <= nstacks ? stacks[o-1] : NULL,
+              &recs[from], i - from);
+      }
+      from = i;
+   }
+
+done:
+   printf("-------------------------------------------------"
+          "--------------------------\n");
+} /* report */
+
+/* Print the binary report of $hdr. */
+static void report_binary(struct erobin_header_st const *hdr)
+{
+   char const *p;
+   unsigned i;
+   struct erobin_stack_st const **stacks;
+   struct erobin_record_st *recs;
+   struct erobin_site_st const *sites;
+
+   /* Index the stacks. */
+   if (!(stacks = malloc(sizeof(*stacks) * (hdr->nstacks + 1))))
+   {
+      fprintf(Errors, "erodump: %m\n");
+      exit(1);
+   }
+   p = (char const *)&hdr[1];
+   for (i = 0; i < hdr->nstacks; i++)
+   {
+      stacks[i] = (struct erobin_stack_st const *)p;
+      p += sizeof(*stacks[i]) + sizeof(stacks[i]->addrs[0])*stacks[i]->depth;
+   }
+
+   /* $recs are sorted by stack already.  They are in a private
+    * mapping, so dump() can sort them in place. */
+   recs = (struct erobin_record_st *)p;
+   p += sizeof(*recs) * hdr->nrecords;
+   sites = (struct erobin_site_st const *)p;
+   p += sizeof(*sites) * hdr->nsites;
+   parse_maps(p, hdr->lmaps);
+   check_build_ids(p + hdr->lmaps, hdr->lbuildids);
+
+   report(hdr, stacks, hdr->nstacks, recs, sites);
+   free(stacks);
+} /* report_binary */
+/* Returns the bucket of $ptr in $live of $bits. */
+static struct live_st **live_bucket(struct live_st **live, unsigned bits,
+   uint64_t ptr)
+{
+   return &live[((uintptr_t)ptr * GOLDEN_RATIO)
+      >> (sizeof(uintptr_t)*8 - bits)];
+} /* live_bucket */
+
+/* Add $mem to $Live. */
+static void add_live(struct live_st *mem)
+{
+   struct live_st **bucket;
+
+   /* Keep the chains short. */
+   if (!Live || NLive >= 1u << Live_bits)
+   {
+      unsigned newbits, i;
+      struct live_st *mem, **newlive;
+
+      newbits = Live ? Live_bits + 1 : 12;
+      if (!(newlive = calloc(1u << newbits, sizeof(*newlive))))
+      {
+         fprintf(Errors, "erodump: %m\n");
+         exit(1);
+      }
+      for (i = 0; Live && i < 1u << Live_bits; i++)
+         while ((mem = Live[i]) != NULL)
+         {
+            Live[i] = mem->next;
+            bucket = live_bucket(newlive, newbits, mem->rec.ptr);
+            mem->next = *bucket;
+            *bucket = mem;
+         }
+      free(Live);
+      Live = newlive;
+      Live_bits = newbits;
+   }
+
+   bucket = live_bucket(Live, Live_bits, mem->rec.ptr);
+   mem->next = *bucket;
+   *bucket = mem;
+   NLive++;
+} /* add_live */
+
+/* Take the allocation of $ptr out of $Live, if we know about it. */
+static struct live_st *take_live(uint64_t ptr)
+{
+   struct live_st *mem, **memp;
+
+   if (!Live)
+      return NULL;
+   for (memp = live_bucket(Live, Live_bits, ptr); (mem = *memp) != NULL;
+        memp = &mem->next)
+      if (mem->rec.ptr == ptr)
+      {
+         *memp = mem->next;
+         NLive--;
+         return mem;
+      }
+
+   return NULL;
+} /* take_live */
+
+/* Take the allocation $tid is realloc()ing out of $Limbo. */
+static struct live_st *take_limbo(uint32_t tid)
+{
+   struct live_st *mem, **memp;
+
+   for (memp = &Limbo; (mem = *memp) != NULL; memp = &mem->next)
+      if (mem->rec.tid == tid)
+      {
+         *memp = mem->next;
+         return mem;
+      }
+
+   return NULL;
+} /* take_limbo */
+
+/* Add a new allocation of $ev to $Live and the counters of $hdr. */
+static void replay_malloc(struct erobin_header_st *hdr,
+   struct eroevt_st const *ev)
+{
+   struct live_st *mem;
+
+   hdr->nallocations++;
+   hdr->allocated += ev->size;
+   if (hdr->peak < hdr->allocated)
+      hdr->peak = hdr->allocated;
+
+   if ((mem = take_live(ev->ptr)) != NULL)
+      /* We missed that it was freed, like libero's garbage(). */
+      hdr->allocated -= mem->rec.size;
+   else if (!(mem = malloc(sizeof(*mem))))
+   {
+      fprintf(Errors, "erodump: %m\n");
+      exit(1);
+   }
+
+   memset(&mem->rec, 0, sizeof(mem->rec));
+   mem->rec.ptr   = ev->ptr;
+   mem->rec.size  = ev->size;
+   mem->rec.stack = ev->stack;
+   mem->rec.tid   = ev->tid;
+   /* Born after this many reports. */
+   mem->rec.karma = hdr->nreport;
+   add_live(mem);
+} /* replay_malloc */
+
+/* For qsort(): order records by their stack. */
+static int compare_stack(void const *lhs, void const *rhs)
+{
+   struct erobin_record_st const *l = lhs, *r = rhs;
+
+   return l->stack < r->stack ? -1 : l->stack > r->stack ? 1 : 0;
+} /* compare_stack */
+
+/* Print the report of the $Live allocations at $sec.$usec
+ * and start a new period in $hdr. */
+static void replay_report(struct erobin_header_st *hdr,
+   struct erobin_stack_st const *const *stacks, unsigned nstacks,
+   int64_t sec, int64_t usec)
+{
+   static struct bufhead_st bh;
+   struct erobin_record_st *recs;
+   struct live_st *mem;
+   unsigned i;
+
+   hdr->nreport++;
+   hdr->now_sec = sec;
+   hdr->now_usec = usec;
+   hdr->nmemories = NLive;
+
+   bh.size1 = sizeof(*recs);
+   bh.n = 0;
+   for (i = 0; Live && i < 1u << Live_bits; i++)
+      for (mem = Live[i]; mem; mem = mem->next)
+      {
+         if (!(recs = enlarge(&bh, 1)))
+         {
+            fprintf(Errors, "erodump: %m\n");
+            exit(1);
+         }
+         *recs = mem->rec;
+         recs->karma = hdr->nreport-1 - mem->rec.karma;
+         bh.n++;
+      }
+   recs = (struct erobin_record_st *)bh.buf;
+   qsort(recs, bh.n, sizeof(*recs), compare_stack);
+   hdr->nrecords = bh.n;
+
+   report(hdr, stacks, nstacks, recs, NULL);
+
+   hdr->previous = hdr->peak = hdr->allocated;
+   hdr->nallocations = 0;
+} /* replay_report */
+
+/* Order of the events which happened in the same nanosecond. */
+static unsigned event_rank(struct eroevt_st const *ev)
+{
+   switch (ev->type)
+   {
+   case EROEVT_FREE:
+   case EROEVT_REALLOC_FROM:
+   case EROEVT_MAPS:
+      return 0;
+   case EROEVT_REPORT:
+      return 2;
+   default:
+      return 1;
+   }
+} /* event_rank */
+
+/* For qsort(): order events by time, otherwise keep the order
+ * they were written in. */
+static int compare_events(void const *lhs, void const *rhs)
+{
+   struct eroevt_st const *l = *(struct eroevt_st const **)lhs;
+   struct eroevt_st const *r = *(struct eroevt_st const **)rhs;
+
+   if (l->time != r->time)
+      return l->time < r->time ? -1 : 1;
+   if (event_rank(l) != event_rank(r))
+      return event_rank(l) < event_rank(r) ? -1 : 1;
+   return l < r ? -1 : l > r ? 1 : 0;
+} /* compare_events */
+
+/* For qsort(): order times. */
+static int compare_times(void const *lhs, void const *rhs)
+{
+   uint64_t l = *(uint64_t const *)lhs, r = *(uint64_t const *)rhs;
+
+   return l < r ? -1 : l > r ? 1 : 0;
+} /* compare_times */
+
+/* Replay the $lmap bytes of events in $map, which starts with $evhdr,
+ * and make a report whenever libero was asked to, and at the $nats
+ * $ats nanoseconds after profiling started. */
+static int replay(char const *fname,
+   struct eroevt_header_st const *evhdr, size_t lmap,
+   uint64_t *ats, unsigned nats)
+{
+   struct bufhead_st events, stacks;
+   struct erobin_header_st hdr;
+   struct eroevt_st const *ev;
+   struct live_st *mem, *stale;
+   char const *p, *end;
+   unsigned i, iat;
+
+   /* Collect the events and the stacks. */
+   memset(&events, 0, sizeof(events));
+   memset(&stacks, 0, sizeof(stacks));
+   events.size1 = sizeof(ev);
+   stacks.size1 = sizeof(struct erobin_stack_st const *);
+   end = (char const *)evhdr + lmap;
+   for (p = (char const *)&evhdr[1]; p + sizeof(*ev) <= end; )
+   {
+      ev = (struct eroevt_st const *)p;
+      p += sizeof(*ev);
+
+      if (ev->type == EROEVT_STACK)
+      {
+         struct erobin_stack_st const *st;
+
+         st = (struct erobin_stack_st const *)p;
+         if (p + sizeof(*st) > end
+             || (p += sizeof(*st) + sizeof(st->addrs[0])*st->depth) > end)
+            break;
+
+         /* Stack IDs are allocated sequentially from 1. */
+         if (ev->stack > stacks.n)
+         {
+            if (!enlarge(&stacks, ev->stack - stacks.n))
+               break;
+            memset(&stacks.buf[stacks.size1*stacks.n], 0,
+                   stacks.size1 * (ev->stack - stacks.n));
+            stacks.n = ev->stack;
+         }
+         ((struct erobin_stack_st const **)stacks.buf)[ev->stack-1] = st;
+         continue;
+      } else if (ev->type == EROEVT_MAPS)
+      {
+         if ((p += (ev->ptr + ev->size + 7) & ~7) > end)
+            break;
+      }
+
+      if (!enlarge(&events, 1))
+         break;
+      ((struct eroevt_st const **)events.buf)[events.n++] = ev;
+   }
+   if (p != end)
+      fprintf(Errors, "%s: truncated event at %zu\n",
+              fname, (size_t)(p - (char const *)evhdr));
+
+   /* The events of the threads were written in batches. */
+   qsort(events.buf, events.n, events.size1, compare_events);
+   qsort(ats, nats, sizeof(*ats), compare_times);
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.flags = evhdr->flags;
+   hdr.karma_min_depth = evhdr->karma_min_depth;
+   hdr.since_sec = evhdr->since_sec;
+   hdr.since_usec = evhdr->since_usec;
+
+   for (i = iat = 0; ; i++)
+   {
+      ev = i < events.n ? ((struct eroevt_st const **)events.buf)[i] : NULL;
+
+      /* Make the reports which were asked for before $ev. */
+      while (iat < nats && (!ev || evhdr->since_time + ats[iat] < ev->time))
+      {
+         int64_t usec;
+
+         usec = evhdr->since_usec + ats[iat++] / 1000;
+         replay_report(&hdr,
+                       (struct erobin_stack_st const **)stacks.buf, stacks.n,
+                       evhdr->since_sec + usec / 1000000, usec % 1000000);
+      }
+      if (!ev)
+         break;
+
+      switch (ev->type)
+      {
+      case EROEVT_MALLOC:
+         replay_malloc(&hdr, ev);
+         break;
+      case EROEVT_FREE:
+         if ((mem = take_live(ev->ptr)) != NULL)
+         {
+            hdr.allocated -= mem->rec.size;
+            free(mem);
+         }
+         break;
+      case EROEVT_REALLOC_FROM:
+         /* Until we know where it went. */
+         if ((mem = take_live(ev->ptr)) != NULL)
+         {
+            hdr.allocated -= mem->rec.size;
+            mem->next = Limbo;
+            Limbo = mem;
+         }
+         break;
+      case EROEVT_REALLOC_TO:
+         if (!(mem = take_limbo(ev->tid)))
+         {  /* Haven't seen the original allocation. */
+            replay_malloc(&hdr, ev);
+            break;
+         }
+
+         /* Like libero's regarbage(). */
+         hdr.nallocations++;
+         hdr.allocated += ev->size;
+         if (hdr.peak < hdr.allocated)
+            hdr.peak = hdr.allocated;
+         mem->rec.ptr = ev->ptr;
+         mem->rec.size = ev->size;
+         if ((stale = take_live(mem->rec.ptr)) != NULL)
+         {
+            hdr.allocated -= stale->rec.size;
+            free(stale);
+         }
+         add_live(mem);
+         break;
+      case EROEVT_REALLOC_FAILED:
+         if ((mem = take_limbo(ev->tid)) != NULL)
+         {
+            hdr.allocated += mem->rec.size;
+            add_live(mem);
+         }
+         break;
+      case EROEVT_REPORT:
+         replay_report(&hdr,
+                       (struct erobin_stack_st const **)stacks.buf, stacks.n,
+                       ev->ptr, ev->size);
+         break;
+      case EROEVT_MAPS:
+         parse_maps((char const *)&ev[1], ev->ptr);
+         check_build_ids((char const *)&ev[1] + ev->ptr, ev->size);
+         break;
+      }
+   }
+
+   return 0;
+} /* replay */
+
+/* The main function */
+int main(int argc, char const *argv[])
+{
+   int fd;
+   char *map;
+   struct stat sbuf;
+   size_t at;
+   char const *fname;
+   uint64_t *ats;
+   unsigned nats;
+
+   /* Parse the command line. */
+   if (!(ats = malloc(sizeof(*ats) * argc)))
+      return 1;
+   nats = 0;
+   for (fname = NULL, argv++; *argv; argv++)
+      if (!strncmp(*argv, "-at=", 4))
+         ats[nats++] = strtod(&(*argv)[4], NULL) * 1000000000;
+      else if (!fname)
+         fname = *argv;
+      else
+         break;
+   if (!fname || *argv)
+   {
+      fprintf(stderr, "usage: erodump <program>.<pid>.leaks.bin\n"
+                      "       erodump [-at=<seconds>]... "
+                      "<program>.<pid>.events\n");
+      return 1;
+   }
+
+   if ((fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &sbuf) < 0)
+   {
+      fprintf(stderr, "%s: %m\n", fname);
+      return 1;
+   }
+   if (!sbuf.st_size)
+      return 0;
+   map = mmap(NULL, sbuf.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+   if (map == MAP_FAILED)
+   {
+      fprintf(stderr, "%s: %m\n", fname);
+      return 1;
+   }
+   close(fd);
+
+   /* bt0() logs onto stderr. */
+   Errors = stderr;
+   stderr = stdout;
+
+   /* Is it an event trace? */
+   if (sbuf.st_size >= sizeof(struct eroevt_header_st)
+       && !memcmp(map, EROEVT_MAGIC, sizeof(EROEVT_MAGIC)))
+      return replay(fname, (struct eroevt_header_st const *)map,
+                    sbuf.st_size, ats, nats);
+
+   for (at = 0; at + sizeof(struct erobin_header_st) <= sbuf.st_size; )
+   {
+      struct erobin_header_st const *hdr;
+
+      hdr = (struct erobin_header_st const *)&map[at];
+      if (memcmp(hdr->magic, EROBIN_MAGIC, sizeof(hdr->magic))
+          || hdr->size < sizeof(*hdr) || hdr->size > sbuf.st_size - at)
+      {
+         fprintf(Errors, "%s: corrupt report at %zu\n", fname, at);
+         return 1;
+      }
+
+      report_binary(hdr);
+      at += hdr->size;
+   }
+
+   return 0;
+} /* main */
+
+/* vim: set et ts=3 sw=3: */
+/* End of erodump.c */
@@ -183,6 +183,8 @@
  *   -- $ARF_MAXPATH=<positive>:   see ./arf -maxpath=<n>
  *   -- $ARF_MAXARRAY=<unsigned>:  see ./arf -maxary=<n>
  *   -- $ARF_MAXSTRING=<unsigned>: see ./arf -maxstr=<n>
+ *   -- $ARF_CACHE_DIR=<directory>: see ./arf -cache=<dir>
+ *   -- $ARF_ASYNC={0|1}:          see ./arf -async
  *
  * This case $ARF_MAXARRAY
  * and $ARF_MAXSTRING how many elements of an array and how many characters
@@ -211,6 +213,14 @@
  * -- CONFIG_FAST_UNWIND: Dig the stack manually, looking for frame pointers
  *			and link registers.  Faster, but may be less robust,
  *			and less reliable than backtrace() and libunwind.
+ *			On x86-64 and aarch64 the frames are only followed
+ *			as long as they have frame pointers, so compile
+ *			with -fno-omit-frame-pointer.
+ * -- CONFIG_CFI_UNWIND: Unwind with the call frame information in the
+ *			.eh_frame of the objects, like backtrace(), but keep
+ *			the rules we decoded in a cache, so the next time
+ *			they are just looked up.  Overrides dlclose() to
+ *			know when to forget them.  Only on x86-64 and aarch64.
  * -- CONFIG_PRINTVARS:	When printing a backtrace find the visible variables
  *			and print their current value.
  */
@@ -218,15 +228,35 @@
 //#define CONFIG_STDOUT
 //#define CONFIG_LIBUNWIND
 //#define CONFIG_FAST_UNWIND
+//#define CONFIG_CFI_UNWIND
 //#define CONFIG_PRINTVARS
 
-#if !defined(__arm__) && !defined(__i386__)
+#if !defined(__arm__) && !defined(__i386__) \
+	&& !defined(__x86_64__) && !defined(__aarch64__)
 # ifdef CONFIG_FAST_UNWIND
 #  warning "can't use fast unwinding on unknown architecture"
 # endif
 # undef CONFIG_FAST_UNWIND
 #endif
 
+#if !defined(__x86_64__) && !defined(__aarch64__)
+# ifdef CONFIG_CFI_UNWIND
+#  warning "can't use CFI unwinding on this architecture"
+# endif
+# undef CONFIG_CFI_UNWIND
+#endif
+
+/* The other unwinders take precedence. */
+#if defined(CONFIG_LIBUNWIND) || defined(CONFIG_FAST_UNWIND)
+# undef CONFIG_CFI_UNWIND
+#endif
+
+/* We don't know where aarch64 frames keep the variables. */
+#if defined(__aarch64__) && defined(CONFIG_PRINTVARS)
+# warning "can't print variables on aarch64"
+# undef CONFIG_PRINTVARS
+#endif
+
 #ifndef CONFIG_FAST_UNWIND
 # ifdef CONFIG_PRINTVARS
 #  warning "can't print variables without fast unwinding"
@@ -239,21 +269,31 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <errno.h>
 #include <ctype.h>
 
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <link.h>
 #include <dlfcn.h>
-#if !defined(CONFIG_LIBUNWIND) && !defined(CONFIG_FAST_UNWIND)
+#if !defined(CONFIG_LIBUNWIND) && !defined(CONFIG_FAST_UNWIND) \
+	&& !defined(CONFIG_CFI_UNWIND)
 # include <execinfo.h>
 #endif
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <signal.h>
 
 #include <dwarf.h>
 #include <elfutils/libdw.h>
+#include <elfutils/libdwelf.h>
 
 #ifdef CONFIG_GLIB
 # include <glib.h>
@@ -274,6 +314,22 @@
  * in case they are not set in the environment. */
 #define DFLT_MAXARRAY		 8
 #define DFLT_MAXSTRING		64
+
+/* For line_st::file */
+#define NO_FILE			(~0u)
+
+/* The files in $ARF_CACHE_DIR start with this. */
+#define CACHE_MAGIC		"ARFIDX1"
+
+/* Objects with longer build IDs are not cached. */
+#define CACHE_MAX_BUILD_ID	64
+
+/* With $ARF_ASYNC barf() can have this many backtraces pending
+ * (must be a power of 2), each of at most ASYNC_DEPTH frames,
+ * and a headline of at most ASYNC_WHY - 1 characters. */
+#define ASYNC_SLOTS		64
+#define ASYNC_DEPTH		64
+#define ASYNC_WHY		256
 /* }}} */
 
 /* Macros {{{ */
@@ -294,12 +350,13 @@
 # define NL			"\n"
 # define WARNING(fmt, ...)	fprintf(stderr, "libarf: " fmt "\n",	\
 					##__VA_ARGS__)
-# define LOGIT(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+/* These are buffered between begin_output() and flush_output(). */
+# define LOGIT			output
 # define LOGITV(fmt, args)						\
 do									\
 {									\
-	vfprintf(stderr, fmt, args);					\
-	fputc('\n', stderr);						\
+	voutput(fmt, args);						\
+	output("\n");							\
 } while (0)
 #endif
 
@@ -312,6 +369,16 @@ do									\
 # define elf_getshdr		elf32_getshdr
 #endif
 
+/* The parts of the cached indexes are aligned to 8 bytes. */
+#define CACHE_ALIGN(n)		(((n) + 7) & ~(size_t)7)
+
+/* Multiplier for Fibonacci hashing (2^wordsize / golden ratio). */
+#if __LP64__
+# define GOLDEN_RATIO		0x9E3779B97F4A7C15UL
+#else
+# define GOLDEN_RATIO		0x9E3779B9UL
+#endif
+
 /* Debugging */
 #if 0
 # include <signal.h>
@@ -361,6 +428,25 @@ struct bufhead_st
 	size_t size1, capacity, n;
 };
 
+#ifdef CONFIG_FAST_UNWIND
+/* "Segment" means "mapped region" here.
+ * Each segment_st corresponds to a line in /proc/self/maps,
+ * or to the gap between two lines, or to a section of a DSO.
+ * The segment $type is determined by heuristics.  UNMAPPED is
+ * only used internally by addr_is(). */
+enum segment_type_t { CODE, STACK, HEAP, DATA, OTHER, UNMAPPED };
+struct segment_st
+{
+	/*
+	 * -- gen:	the $Maps_gen an UNMAPPED segment was found
+	 *		to be unmapped in
+	 */
+	void const *start, *end;
+	enum segment_type_t type;
+	unsigned gen;
+};
+#endif
+
 /* Linked list element describing a DSO as the run-time dynamic
  * linker knows it. */
 struct dso_st
@@ -374,14 +460,66 @@ struct dso_st
 	 * -- elf:	the libelf handle of this DSO; may be read
 	 *		from a different file than $dr if the debug
 	 *		info is detached
+	 * -- fd:	the file $elf is read from
+	 * -- loaded:	whether load_debug() has been called, after which
+	 *		$dr and the index are set if they could be found
+	 * -- sections:	the allocated sections of $elf, relocated
+	 *		and sorted by address, for addr_is()
+	 * -- funcs, lines, files, strings: the index of $dr built by
+	 *		index_dso() or mmap()ed by load_index():
+	 *		struct func_st:s and struct line_st:s sorted by
+	 *		address, the offsets of the source files the $lines
+	 *		refer to in $strings, and the strings themselves
 	 */
 	Elf *elf;
 	Dwarf *dr;
+	int fd, loaded;
 	char const *id, *fname;
 	void *base;
+	struct bufhead_st funcs, lines, files, strings;
+#ifdef CONFIG_FAST_UNWIND
+	struct bufhead_st sections;
+#endif
 	struct dso_st *next;
 };
 
+/*
+ * A file mapped in the address space of a process whose addresses we are
+ * to decode, as described by its /proc/<pid>/maps.  When $Mappings is set
+ * getdso() looks up the addresses in them instead of asking the dynamic
+ * linker, so a program can symbolize addresses of another process, which
+ * has possibly exited since.
+ */
+struct mapping_st
+{
+	/*
+	 * -- start, end: the address range of the mapping in the process
+	 * -- offset:	where the mapping starts in the file
+	 * -- path:	the mapped file; mappings of the same file
+	 *		must share the same $path
+	 */
+	void const *start, *end;
+	size_t offset;
+	char const *path;
+};
+
+/* A segment of an object in our address space, as the dynamic linker
+ * reported it.  getdso() finds the $dso of an address through these. */
+struct loaded_st
+{
+	/*
+	 * -- start, end: where the segment is mapped
+	 * -- id:	the path of the object, the same as dladdr() would
+	 *		return as .dli_fname
+	 * -- base:	the relocation base of the object
+	 * -- dso:	the object's $Dsos entry if getdso() has found it
+	 */
+	void const *start, *end;
+	char const *id;
+	void *base;
+	struct dso_st *dso;
+};
+
 /* Describes a call site in a DSO. */
 struct callsite_st
 {
@@ -400,6 +538,68 @@ struct callsite_st
 	char const *location;
 	char const *cls, *funame;
 };
+
+/* A function in dso_st::funcs. */
+struct func_st
+{
+	/*
+	 * -- lo, hi:	the address range of the function, unrelocated
+	 * -- funame, cls, cufile: like in callsite_st, but as offsets
+	 *		in dso_st::strings, 0 if NULL
+	 */
+	Dwarf_Addr lo, hi;
+	uint32_t funame, cls;
+	uint32_t cufile, unused;
+};
+
+/* A row of the line number tables in dso_st::lines. */
+struct line_st
+{
+	/*
+	 * -- file:	the index of the source file in dso_st::files,
+	 *		or NO_FILE if it's the end of a sequence
+	 */
+	Dwarf_Addr addr;
+	unsigned file;
+	int lineno;
+};
+
+/*
+ * The index of a DSO is saved in $ARF_CACHE_DIR in a file starting with
+ * this header, followed by dso_st::funcs, ::lines, ::files and ::strings,
+ * each padded to CACHE_ALIGN().  There are no pointers in them, so the
+ * file can be mmap()ed and used as is.
+ */
+struct cached_index_st
+{
+	char magic[8];
+	uint32_t nfuncs, nlines;
+	uint32_t nfiles, lstrings;
+};
+
+/* A callsite_st bt1() made of $pc, without the scopes. */
+struct cached_callsite_st
+{
+	void const *pc;
+	struct callsite_st cs;
+	struct cached_callsite_st *next;
+};
+
+/* A backtrace barf() has captured for async_barfer() to print. */
+struct async_barf_st
+{
+	/*
+	 * -- seq:	the slot is free for the barf() at position $seq
+	 *		of $Async, and ready for async_barfer() if $seq
+	 *		is one more than that
+	 * -- why:	the formatted headline
+	 * -- depth, addrs: the return addresses from barf()'s caller
+	 */
+	unsigned long seq;
+	char why[ASYNC_WHY];
+	unsigned depth;
+	void const *addrs[ASYNC_DEPTH];
+};
 /* Type definitions }}} */
 
 /* Private variables {{{ */
@@ -408,11 +608,104 @@ struct callsite_st
  * how many characters of a string to print. */
 static unsigned Max_array, Max_string;
 #endif
+
+/* The DSOs getdso() has opened so far. */
+static struct dso_st *Dsos;
+
+/* If set, getdso() decodes addresses according to these $NMappings
+ * mappings of a foreign process, sorted by their start address. */
+static struct mapping_st const *Mappings;
+static unsigned NMappings;
+
+/*
+ * The segments of the objects we have loaded, sorted by their start
+ * address, so getdso() can binary search them without asking the
+ * dynamic linker, which takes a lock.  They're reloaded if $Loaded_stale,
+ * which check_dl_subs() sets if anything has been dlopen()ed or
+ * dlclose()d since we last checked $Dl_adds and $Dl_subs.
+ */
+static struct bufhead_st Loaded;
+static int Loaded_stale = 1;
+static unsigned long long Dl_adds;
+
+#ifdef CONFIG_FAST_UNWIND
+/*
+ * What addr_is() knows about /proc/self/maps: the mappings and the gaps
+ * between them, sorted by address, covering the whole address space.
+ * An address found in a mapping is believed, but if it falls in a gap
+ * that hasn't been checked since $Maps_gen changed the maps are reread.
+ * $Maps_gen is advanced for every new backtrace by arf, but libero only
+ * advances it for a thread's first one and for reports.  The [stack]
+ * starting at $Main_stack can grow into the gap below it meanwhile, so
+ * the maps are also reread when that gap is hit, but only once for each
+ * $Main_stack, which is remembered in $Grown_stack.
+ */
+static struct bufhead_st Maps = { .size1 = sizeof(struct segment_st) };
+static unsigned Maps_gen;
+static void const *Main_stack, *Grown_stack;
+#endif
+
+/*
+ * The callsites looked up by bt1_cached() in a hash table of
+ * 1 << $Callsites_bits buckets, keyed by the PC.  $Dl_subs is the
+ * number of objects the dynamic linker has unloaded when we last
+ * checked, because then the PCs may belong to some other code.
+ */
+static struct cached_callsite_st **Callsites;
+static unsigned Callsites_bits, NCallsites;
+static unsigned long long Dl_subs;
+
+/*
+ * With $ARF_ASYNC barf() only captures the return addresses into the
+ * $Async ring of ASYNC_SLOTS, and async_barfer() symbolizes and prints
+ * them in its own thread.  $Async_head is the next position the thread
+ * will print, $Async_tail is where the next barf() will go, and they
+ * only ever increase.  $Async_ready is posted for every backtrace
+ * captured, and $Async_dropped counts the ones lost because the ring
+ * was full.  async_init() sets it all up under $Async_once.
+ */
+static struct async_barf_st *Async;
+static unsigned long Async_head, Async_tail;
+static unsigned Async_dropped;
+static sem_t Async_ready;
+static pthread_once_t Async_once = PTHREAD_ONCE_INIT;
+
+/*
+ * $Lock protects the state above shared by the threads: the $Dsos and
+ * their indexes, $Loaded, $Maps and $Callsites.  Looking up what's there
+ * only takes it for reading, so barf()s of different threads can proceed
+ * in parallel, and only what changes the state takes it for writing.
+ * It's also held for writing while using libdw, which is not thread-safe.
+ * $Locked tells whether this thread holds it for writing, so rdlock()
+ * and wrlock() can be nested under wrlock().
+ */
+static pthread_rwlock_t Lock = PTHREAD_RWLOCK_INITIALIZER;
+static __thread int Locked;
+
+/* Where set_location() and bt1_cached() keep the location they return,
+ * so it stays valid until the thread's next call, whatever the other
+ * threads do to $Callsites. */
+static __thread struct bufhead_st Location;
+
+#ifndef CONFIG_GLIB
+/*
+ * While $Buffering LOGIT() appends to the $Output of the thread,
+ * and flush_output() hands it to $Sink, or writes it to stderr if
+ * it's NULL.  $Output_key frees $Output when the thread exits.
+ * $Ring_lock serializes the writers of an ARF_SINK_RING.
+ */
+static __thread struct bufhead_st Output;
+static __thread int Buffering;
+static struct arf_sink_st *Sink;
+static pthread_key_t Output_key;
+static pthread_once_t Output_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t Ring_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 /* }}} */
 
 /* Program code */
 /* Private functions */
-/* Utilities: trim() {{{ */
+/* Utilities: trim(), write_all(), rdlock() {{{ */
 /* Return the last components of $path.  By default only the last
  * component is kept but the $ARF_MAXPATH environment variable
  * can override it. */
@@ -460,9 +753,68 @@ static char const *trim(char const *path)
 
 	return &path[at];
 } /* trim */
+
+/* write() all $n bytes of $buf to $fd.  Returns whether it could. */
+static int write_all(int fd, void const *buf, size_t n)
+{
+	char const *p;
+	ssize_t ret;
+
+	for (p = buf; n > 0; p += ret, n -= ret)
+		if ((ret = write(fd, p, n)) < 0)
+		{
+			if (errno != EINTR)
+				return 0;
+			ret = 0;
+		}
+
+	return 1;
+} /* write_all */
+
+/* Take $Lock for reading unless this thread holds it for writing.
+ * Returns what to pass to unlock(). */
+static int rdlock(void)
+{
+	if (Locked)
+		return 0;
+	pthread_rwlock_rdlock(&Lock);
+	return 1;
+} /* rdlock */
+
+/* Take $Lock for writing unless this thread holds it already.
+ * Returns what to pass to unlock(). */
+static int wrlock(void)
+{
+	if (Locked)
+		return 0;
+	pthread_rwlock_wrlock(&Lock);
+	Locked = 1;
+	return 1;
+} /* wrlock */
+
+/* Release $Lock if $locked by rdlock() or wrlock(). */
+static void unlock(int locked)
+{
+	if (!locked)
+		return;
+	Locked = 0;
+	pthread_rwlock_unlock(&Lock);
+} /* unlock */
+
+/* pthread_atfork() handlers, so the child isn't born with $Lock
+ * held by a thread which doesn't exist there. */
+static void lock_for_fork(void)
+{
+	pthread_rwlock_wrlock(&Lock);
+} /* lock_for_fork */
+
+static void unlock_after_fork(void)
+{
+	pthread_rwlock_unlock(&Lock);
+} /* unlock_after_fork */
 /* Utilities }}} */
 
-/* Persistent buffer management: enlarge(), addfmt() {{{ */
+/* Persistent buffer management: enlarge(), addfmt(), output() {{{ */
 /* Ensure that $bh can store $need more elements. */
 static void *enlarge(struct bufhead_st *bh, size_t need)
 {
@@ -530,14 +882,13 @@ static int insstr(struct bufhead_st *bh, char const *str)
 /* Adds a formatted string to at $bh->buf[bh->n], enlarging the buffer
  * as necessary.  If the string cannot be stored nothing is changed
  * and 0 is returned. */
-static int __attribute__((format(printf, 2, 3)))
-addfmt(struct bufhead_st *bh, char const *fmt, ...)
+static int __attribute__((format(printf, 2, 0)))
+vaddfmt(struct bufhead_st *bh, char const *fmt, va_list printf_args)
 {
 	size_t has, len;
-	va_list printf_args, args;
+	va_list args;
 
 	/* printf(bh, fmt) until it succeeds or cannot be enlarge()d */
-	va_start(printf_args, fmt);
 	for (;;)
 	{
 		va_copy(args, printf_args);
@@ -556,1315 +907,3681 @@ addfmt(struct bufhead_st *bh, char const *fmt, ...)
 			break;
 		}
 	} /* until $bh is large enough */
-	va_end(printf_args);
 
 	return len < has;
+} /* vaddfmt */
+
+/* Like vaddfmt(). */
+static int __attribute__((format(printf, 2, 3)))
+addfmt(struct bufhead_st *bh, char const *fmt, ...)
+{
+	int ret;
+	va_list printf_args;
+
+	va_start(printf_args, fmt);
+	ret = vaddfmt(bh, fmt, printf_args);
+	va_end(printf_args);
+
+	return ret;
 } /* addfmt */
-/* Buffers }}} */
 
-/* getdso() {{{ */
-/* Construct the path to a detached debug file and open it. */
-static Dwarf *opendbg(struct stat const *that,
-	char const *prefix, char const *dir, size_t ldir,
-	char const *postfix, char const *fname)
+#ifndef CONFIG_GLIB
+/* Print $fmt on stderr, or append it to $Output while $Buffering. */
+static void __attribute__((format(printf, 1, 0)))
+voutput(char const *fmt, va_list printf_args)
 {
-	int fd;
-	Dwarf *dr;
-	char path[256];
-	struct stat this;
+	if (Buffering)
+	{
+		int ok;
+		va_list args;
 
-	/* Construct and open $path. */
-	if (prefix)
-		snprintf(path, sizeof(path), "%s/%.*s/%s/%s",
-			prefix, (int)ldir, dir, postfix, fname);
-	else
-		snprintf(path, sizeof(path), "%.*s/%s/%s",
-			(int)ldir, dir, postfix, fname);
-	if ((fd = open(path, O_RDONLY)) < 0)
-		return NULL;
+		va_copy(args, printf_args);
+		ok = vaddfmt(&Output, fmt, args);
+		va_end(args);
+		if (ok)
+			return;
+		/* Out of memory, print what we can. */
+	}
 
-	/* Don't waste time on $this if it's $that. */
-	if (fstat(fd, &this) < 0)
-		goto out;
-	if (this.st_rdev == that->st_rdev && this.st_ino == that->st_ino)
-		goto out;
-	/* It would be nice to verify the checksum, but it feels
-	 * inappropriate in a critical path.  We're not a full-blown
-	 * debugger after all. */
+	vfprintf(stderr, fmt, printf_args);
+} /* voutput */
 
-	/* Did we win cigar? */
-	if ((dr = dwarf_begin(fd, DWARF_C_READ)) != NULL)
-		return dr;
+/* Like voutput(). */
+static void __attribute__((format(printf, 1, 2)))
+output(char const *fmt, ...)
+{
+	va_list printf_args;
 
-out:
-	close(fd);
-	return NULL;
-} /* opendbg */
+	va_start(printf_args, fmt);
+	voutput(fmt, printf_args);
+	va_end(printf_args);
+} /* output */
 
-/* Find the detached debug information of a shared object. */
-static Dwarf *finddbg(int fd, char const *dir, size_t ldir)
+/* pthread_key_create() destructor of $Output. */
+static void free_output(void *bh)
 {
-	struct stat sbuf;
-	Elf *elf;
-	Elf_Ehdr *ehdr;
-	Elf_Scn *scn;
-	Elf_Shdr *shdr;
-	Dwarf *dr;
+	free(((struct bufhead_st *)bh)->buf);
+	memset(bh, 0, sizeof(struct bufhead_st));
+} /* free_output */
 
-	/* Get the inode of $fd so we won't try to find
-	 * the debug informations at the same place. */
-	if (fstat(fd, &sbuf) < 0)
-		return NULL;
+static void make_output_key(void)
+{
+	pthread_key_create(&Output_key, free_output);
+} /* make_output_key */
 
-	/* Iterate over the sections until we find .gnu_debuglink. */
-	dr = NULL;
-	elf = elf_begin(fd, ELF_C_READ_MMAP, NULL);
-	ehdr = elf_getehdr(elf);
-	for (scn = elf_getscn(elf, 0); scn; scn = elf_nextscn(elf, scn))
-	{
-		char const *fname;
+/* Start buffering the output of this thread. */
+static void begin_output(void)
+{
+	if (!Output.buf)
+	{	/* Let the buffer be freed with the thread. */
+		pthread_once(&Output_once, make_output_key);
+		pthread_setspecific(Output_key, &Output);
+	}
 
-		shdr = elf_getshdr(scn);
-		if (!shdr)
-			/* Can be 32/64-bit incompatibility. */
-			continue;
-		if (shdr->sh_type != SHT_PROGBITS)
-			continue;
-		if (strcmp(elf_strptr(elf, ehdr->e_shstrndx, shdr->sh_name),
-				".gnu_debuglink"))
-			continue;
+	Output.n = 0;
+	Buffering = 1;
+} /* begin_output */
 
-		/* .gnu_debuglink is usually just a basename.
-		 * Find it in the file system.  Search in the
-		 * same locations as gdb does. */
-		fname = (char const *)ehdr + shdr->sh_offset;
-		if ((dr = opendbg(&sbuf, NULL,
-				dir, ldir, "", fname)) != NULL)
-			break;
-		if ((dr = opendbg(&sbuf, NULL,
-				dir, ldir, ".debug", fname)) != NULL)
-			break;
-		if ((dr = opendbg(&sbuf, "/usr/lib/debug",
-				dir, ldir, "", fname)) != NULL)
-			break;
-		if ((dr = opendbg(&sbuf, "/usr/local/lib/debug",
-				dir, ldir, "", fname)) != NULL)
-			/* gdb only looks here if its prefix is /usr/local */
-			break;
-		break;
-	} /* for */
+/* Copy $text of $size bytes to the $ring, wrapping around. */
+static void add_to_ring(struct arf_sink_st *ring,
+	char const *text, size_t size)
+{
+	if (!ring->ring.size)
+		return;
 
-	elf_end(elf);
-	return dr;
-} /* finddbg */
+	pthread_mutex_lock(&Ring_lock);
+	if (size > ring->ring.size)
+	{	/* Only the end would remain anyway. */
+		text += size - ring->ring.size;
+		size  = ring->ring.size;
+	}
+	if (ring->ring.pos >= ring->ring.size)
+		ring->ring.pos = 0;
+	while (size > 0)
+	{
+		size_t n;
+
+		n = ring->ring.size - ring->ring.pos;
+		if (n > size)
+			n = size;
+		memcpy(&ring->ring.buf[ring->ring.pos], text, n);
+		if ((ring->ring.pos += n) >= ring->ring.size)
+			ring->ring.pos = 0;
+		text += n;
+		size -= n;
+	}
+	pthread_mutex_unlock(&Ring_lock);
+} /* add_to_ring */
 
-/* Get a $dso which contains $addr. */
-static struct dso_st const *getdso(void const *addr)
+/* Stop buffering and write what's been buffered onto $fd. */
+static void write_output(int fd)
 {
-	static struct dso_st *seen;
-	struct dso_st *dso;
-	int fd;
-	Dl_info info;
-	struct link_map *lm;
-	size_t ldir;
-	char const *dir;
+	Buffering = 0;
+	write_all(fd, Output.buf, Output.n);
+	Output.n = 0;
+} /* write_output */
 
-	/* Get which library has the code. */
-	if (!dladdr1(addr, &info, (void*)&lm, RTLD_DL_LINKMAP)
-		       	|| !info.dli_fname)
-		return NULL;
+/* Stop buffering and pass what's been buffered to the $Sink. */
+static void flush_output(void)
+{
+	struct arf_sink_st *sink;
 
-	/* Have we seen it? */
-	for (dso = seen; dso; dso = dso->next)
-		if (dso->id == info.dli_fname)
-			return dso;
+	Buffering = 0;
+	if (!Output.n)
+		return;
 
-	/* No, create new $dso. */
-	if ((fd = open(info.dli_fname, O_RDONLY)) < 0)
-	{
-		/*
-		 * If $addr belongs to an executable we couldn't find
-		 * let's try to go direct (on linux).  .dli_fname seems
-		 * to be the same as argv[0], which may not be the full
-		 * path to the executable.
-		 */
-		if (errno != ENOENT)
-			return NULL;
-		if (lm->l_name[0])
-			return NULL;
-		if ((fd = open("/proc/self/exe", O_RDONLY)) < 0)
-			return NULL;
-	}
-	if (!(dso = malloc(sizeof(*dso))))
+	sink = __atomic_load_n(&Sink, __ATOMIC_ACQUIRE);
+	if (!sink)
+	{	/* Let what the program has printed go first. */
+		fflush(stderr);
+		write_output(fileno(stderr));
+	} else if (sink->type == ARF_SINK_FD)
+		write_output(sink->fd);
+	else if (sink->type == ARF_SINK_CALLBACK)
+		sink->callback.fun(Output.buf, Output.n,
+			sink->callback.data);
+	else if (sink->type == ARF_SINK_RING)
+		add_to_ring(sink, Output.buf, Output.n);
+	Output.n = 0;
+} /* flush_output */
+#else /* CONFIG_GLIB */
+/* glib logs line by line. */
+# define begin_output()		/* NOP */
+# define flush_output()		/* NOP */
+# define write_output(fd)	/* NOP */
+#endif /* CONFIG_GLIB */
+/* Buffers }}} */
+
+/* DSO index: index_dso() {{{ */
+/* Return whether $ARF_MANGLED is set. */
+static int leave_mangled(void)
+{
+	static int leave_mangled = -1;
+
+	if (leave_mangled < 0)
 	{
-		close(fd);
-		return NULL;
+		char const *env;
+
+		env = getenv("ARF_MANGLED");
+		leave_mangled = env && atoi(env) > 0;
 	}
 
-	/* Let $dir denote the container directory of dso->fname.
-	 * Needed when the debug information is in a separate file. */
-	dso->id = info.dli_fname;
-	if ((dso->fname = strrchr(dso->id, '/')) != NULL)
+	return leave_mangled;
+} /* leave_mangled */
+
+/* Find out the name of the function of a subprogram $die, or the class
+ * too if it's a method.  With $ARF_MANGLED the mangled name of methods
+ * is returned in *$clsp and *$funamep is left alone. */
+static void subprogram_name(Dwarf_Die *die,
+	char const **funamep, char const **clsp)
+{
+	Dwarf_Attribute attr;
+	Dwarf_Die spec;
+
+	if (dwarf_attr(die, DW_AT_name, &attr))
 	{
-		dir = dso->id;
-		ldir = dso->fname - dso->id;
-		dso->fname++;
-	} else
+		*funamep = dwarf_formstring(&attr);
+		return;
+	} else if (dwarf_attr(die, DW_AT_abstract_origin, &attr))
+	{	/* An out-of-line instance of an inline function. */
+		if (dwarf_formref_die(&attr, &spec))
+			subprogram_name(&spec, funamep, clsp);
+		return;
+	} else if (!dwarf_attr(die, DW_AT_specification, &attr))
+		return;
+
+	/* Looks like it's an object method.
+	 * Find out the class name too. */
+	if (!dwarf_formref_die(&attr, &spec))
+		return;
+	if (dwarf_tag(&spec) != DW_TAG_subprogram)
+		return;
+
+	/* Print the mangled identifier? */
+	if (leave_mangled() && dwarf_attr(&spec,
+		DW_AT_MIPS_linkage_name, &attr))
+	{	/* Leave *$funamep empty to indicate
+		 * mangled name to bt(). */
+		*clsp = dwarf_formstring(&attr);
+	} else if (dwarf_attr(&spec, DW_AT_name, &attr))
 	{
-		dir = ".";
-		ldir = 1;
-		dso->fname = dso->id;
+		Dwarf_Die *dies;
+
+		/* Look up the class, which should be
+		 * in the specification's parent die. */
+		dies = NULL;
+		*funamep = dwarf_formstring(&attr);
+		if (dwarf_getscopes_die(&spec, &dies) > 1
+				&& dwarf_attr(&dies[1], DW_AT_name, &attr))
+			*clsp = dwarf_formstring(&attr);
+		free(dies);
 	}
+} /* subprogram_name */
 
-	/* Initialize libelf and libdwarf.  The $dso is useful to some
-	 * extent even if it fails. */
-	elf_version(EV_CURRENT);
-	if (!(dso->elf = elf_begin(fd, ELF_C_READ_MMAP, NULL)))
-		close(fd);
-	else if (!(dso->dr = dwarf_begin_elf(dso->elf, DWARF_C_READ, NULL)))
-		dso->dr = finddbg(fd, dir, ldir);
-
-	/* Is this symbol defined in the executable?
-	 * Then don't subtract the base address. */ 
-	dso->base = lm->l_name[0] ? info.dli_fbase : 0;
+/* Add $str to $dso->strings and return its offset, or 0 if it's NULL
+ * or we're out of memory. */
+static uint32_t add_string(struct dso_st *dso, char const *str)
+{
+	char *p;
+	size_t lstr;
+	uint32_t off;
 
-	dso->next = seen;
-	seen      = dso;
+	if (!str)
+		return 0;
 
-	return dso;
-} /* getdso */
-/* }}} */
+	lstr = strlen(str);
+	if (!(p = enlarge(&dso->strings, lstr)))
+		return 0;
+	memcpy(p, str, lstr+1);
+	off = dso->strings.n;
+	dso->strings.n += lstr+1;
+	return off;
+} /* add_string */
 
-#ifdef CONFIG_FAST_UNWIND
-/* addr_is() {{{ */
-/* "Segment" means "mapped region" here.
- * Each segment_st corresponds to a line in /proc/self/maps.
- * The segment $type is determined by heuristics. */
-enum segment_type_t { CODE, STACK, HEAP, DATA, OTHER };
-struct segment_st
+/* Return the string at $off in $dso->strings. */
+static char const *get_string(struct dso_st const *dso, uint32_t off)
 {
-		void const *start, *end;
-		enum segment_type_t type;
-};
+	return off ? &dso->strings.buf[off] : NULL;
+} /* get_string */
 
-/* Comparator function for bsearch() to tell whether an $addr
- * is in a $segment. */
-static int find_segment(void const *addr, struct segment_st const *segment)
+/* Add the functions defined in $parent to $dso->funcs. */
+static void index_funcs(struct dso_st *dso, Dwarf_Die *parent,
+	uint32_t cufile)
 {
-	if (addr < segment->start)
-		return -1;
-	if (addr >= segment->end)
-		return +1;
-	else
-		return 0;
-} /* find_segment */
+	Dwarf_Die child;
 
-/*
- * Try to tell what $addr points to: some CODE, somewhere in the STACK,
- * HEAP or to some DATA.  Returns OTHER if no idea.  If you supply $dso
- * its ELF section headers are searches first.  If that fails addr_is()
- * goes to see /proc/self/maps and tries to guess what $addr points to
- * by looking at the containing memory map entry's file backing and
- * write/execute bits.
- */
-static enum segment_type_t addr_is(struct dso_st const *dso,
-	void const *addr, void const **segp)
-{
-	int found;
-	FILE *maps;
-	char line[128];
-	struct segment_st *segment;
-	static struct bufhead_st segments = { .size1 = sizeof(*segment) };
+	if (dwarf_child(parent, &child) != 0)
+		return;
 
-	if (addr < (void *)4096)
+	do
 	{
-		/* Must be an error somewhere, nothing is supposed to be
-		 * mapped at such a low address. */
-		FAIL("LOW ADDR %p", addr);
-		return OTHER;
-	}
+		ptrdiff_t off;
+		int named;
+		uint32_t funame, cls;
+		Dwarf_Addr base, lo, hi;
 
-	if (dso)
-	{	/* Search the ELF section headers. */
-		Elf_Scn *scn;
-		Elf_Shdr *shdr;
-		Elf_Ehdr *ehdr;
-
-		/* As though they appear so the ELF specs don't mandate
-		 * that the SHT is ordered by address, so it's safer not
-		 * to take a shortcut. */
-		ehdr = elf_getehdr(dso->elf);
-		for (scn = elf_getscn(dso->elf, 0); scn;
-			scn = elf_nextscn(dso->elf, scn))
+		switch (dwarf_tag(&child))
+		{
+		case DW_TAG_subprogram:
+			break;
+		case DW_TAG_namespace:
+		case DW_TAG_class_type:
+		case DW_TAG_structure_type:
+		case DW_TAG_lexical_block:
+			index_funcs(dso, &child, cufile);
+			/* Fall through */
+		default:
+			continue;
+		}
+
+		/* Add all of the function's address ranges.
+		 * Declarations have none, don't bother naming them. */
+		named = 0;
+		funame = cls = 0;
+		for (off = 0; (off = dwarf_ranges(&child, off,
+				&base, &lo, &hi)) > 0; )
 		{
-			shdr = elf_getshdr(scn);
+			struct func_st *func;
 
-			/* Is $addr in $scn?
-			 * (What about overlapping sections?) */
-			if (!(dso->base+shdr->sh_addr <= addr))
-				continue;
-			if (!(addr < dso->base+shdr->sh_addr+shdr->sh_size))
+			/* Skip the functions the linker discarded. */
+			if (!lo || lo >= hi)
 				continue;
 
-			/* Do we understand $scn?
-			 * If not resort to /proc/self/maps. */
-			if (!(shdr->sh_type == SHT_PROGBITS
-					|| shdr->sh_type == SHT_NOBITS))
-				break;
-			if (!(shdr->sh_flags & SHF_ALLOC))
-				break;
+			if (!named)
+			{
+				char const *funame_str, *cls_str;
 
-			/* Okay now we have enough confidence to say
-			 * anything about $scn. */
-			if (segp != NULL)
-				*segp = dso->base+shdr->sh_addr+shdr->sh_size;
-			return (shdr->sh_flags & SHF_EXECINSTR)
-				? CODE : DATA;
-		} /* for all sections */
-	} /* if we know $dso */
+				funame_str = cls_str = NULL;
+				subprogram_name(&child, &funame_str, &cls_str);
+				funame = add_string(dso, funame_str);
+				cls = add_string(dso, cls_str);
+				named = 1;
+			}
 
-	/* Search the cache for $addr first. */
-	segment = bsearch(addr,
-		segments.buf, segments.n, sizeof(*segment),
-		(int (*)(void const *, void const *))find_segment);
-	if (segment)
-	{
-		if (segp != NULL)
-			*segp = segment->end;
-		return segment->type;
-	}
+			if (!(func = enlarge(&dso->funcs, 1)))
+				return;
+			func->lo     = lo;
+			func->hi     = hi;
+			func->funame = funame;
+			func->cls    = cls;
+			func->cufile = cufile;
+			func->unused = 0;
+			dso->funcs.n++;
+		}
 
-	/* Reload $segments and recheck $addr.
-	 * Assume that $maps is sorted by address. */
-	if (segments.n)
-		FAIL("RELOAD %p", addr);
-	found = OTHER;
-	segments.n = 0;
-	maps = fopen("/proc/self/maps", "r");
-	while (fgets(line, sizeof(line), maps))
+		/* Nested functions have their own ranges. */
+		index_funcs(dso, &child, cufile);
+	} while (dwarf_siblingof(&child, &child) == 0);
+} /* index_funcs */
+
+/* Add the line number table of $cu to $dso->lines and its source
+ * files to $dso->files. */
+static void index_lines(struct dso_st *dso, Dwarf_Die *cu)
+{
+	static struct bufhead_st srcs = { .size1 = sizeof(char const *) };
+	size_t i, nlines, first_file, first_row;
+	char const *prev_src;
+	Dwarf_Lines *lines;
+	unsigned file;
+
+	if (dwarf_getsrclines(cu, &lines, &nlines) != 0)
+		return;
+
+	/* The files and rows of this CU start from these.  $srcs are
+	 * the names of the files libdw returned, in the same order. */
+	first_file = dso->files.n;
+	first_row = dso->lines.n;
+	srcs.n = 0;
+	prev_src = NULL;
+	file = 0;
+	for (i = 0; i < nlines; i++)
 	{
-		int n, nn;
-		unsigned inode;
+		int lineno;
+		bool endseq;
+		Dwarf_Addr addr;
+		Dwarf_Line *line;
+		struct line_st *row;
+		char const *src;
 
-		if (!(segment = enlarge(&segments, segments.n+1)))
-			break;
-		if (sscanf(line, "%p-%p %n", &segment->start, &segment->end,
-				&n) < 2)
+		line = dwarf_onesrcline(lines, i);
+		if (dwarf_lineaddr(line, &addr) != 0)
+			continue;
+		if (dwarf_lineendsequence(line, &endseq) != 0)
+			endseq = false;
+		if (endseq)
+			src = NULL;
+		else if (!(src = dwarf_linesrc(line, NULL, NULL)))
 			continue;
+		if (dwarf_lineno(line, &lineno) != 0)
+			lineno = 0;
 
-		/* Parse the $line. */
-		if (sscanf(&line[n], "rw%*c%*c %*x 00:00 %u %n",
-				&inode, &nn) > 0
-			&& !inode)
+		/* Rows of the same file follow each other, and a CU
+		 * only has a handful of files, so this is cheap. */
+		if (src && src != prev_src)
 		{
-			n += nn;
-			if (!line[n] || line[n] == '\n')
-				/* Anonymous page, but threads may
-				 * use them as stack. */
-				segment->type = STACK;
-			else if (!strcmp(&line[n], "[stack]\n"))
-				segment->type = STACK;
-			else if (!strcmp(&line[n], "[heap]\n"))
-				segment->type = HEAP;
-			else
-				segment->type = OTHER;
-		} else if (sscanf(&line[n], "%*c%*cx%*c %*x %*x:%*x %u %n",
-					&inode, &nn) > 0
-				&& (inode || !strcmp(&line[n+nn], "[vdso]\n")))
-			segment->type = CODE;
-		else
-			segment->type = OTHER;
+			char const **known;
+			uint32_t *name;
 
-		DEEPSHIT("%p-%p %d", segment->start, segment->end,
-			segment->type);
-		if (segment->start <= addr
-			&& addr < segment->end)
-		{
-			if (segp != NULL)
-				*segp = segment->end;
-			found = segment->type;
+			known = (char const **)srcs.buf;
+			for (file = 0; file < srcs.n; file++)
+				if (known[file] == src)
+					break;
+			if (file >= srcs.n)
+			{
+				if (!(known = enlarge(&srcs, 1)))
+					return;
+				if (!(name = enlarge(&dso->files, 1)))
+					return;
+				*known = src;
+				srcs.n++;
+				*name = add_string(dso, src);
+				dso->files.n++;
+			}
+			file += first_file;
+			prev_src = src;
 		}
-		segments.n++;
-	} /* for $maps lines */
-	fclose(maps);
 
-	return found;
-} /* addr_is */
-/* addr_is }}} */
-#endif /* CONFIG_FAST_UNWIND */
+		/* Of the rows of the same address the last one counts,
+		 * like in dwarf_getsrc_die(). */
+		row = (struct line_st *)dso->lines.buf;
+		if (dso->lines.n > first_row
+				&& row[dso->lines.n-1].addr == addr)
+			row = &row[dso->lines.n-1];
+		else if (!(row = enlarge(&dso->lines, 1)))
+			return;
+		else
+			dso->lines.n++;
 
-/* printvars() {{{ */
-#ifdef CONFIG_PRINTVARS
-/* Return whether it has seen $addr.  If not, remember it.
- * If $addr is NULL forget everything.  This is used to avoid
- * printing the same variable more than once during a backtrace. */
-static int seen(void const *addr)
+		row->addr   = addr;
+		row->file   = src ? file : NO_FILE;
+		row->lineno = lineno;
+	}
+} /* index_lines */
+
+/* qsort() comparator of struct func_st:s by their start address. */
+static int cmp_funcs(void const *lhs, void const *rhs)
 {
-	static struct bufhead_st bh = { .size1 = sizeof(addr) };
-	unsigned l, m, r;
-	void const **store;
+	struct func_st const *l = lhs, *r = rhs;
 
-	if (!addr)
-	{	/* Reset $store. */
-		bh.n = 0;
-		return 1;
-	} else if (!bh.n)
-	{	/* Insert the first element. */
-		m = 0;
-		goto insert;
-	}
+	if (l->lo < r->lo)
+		return -1;
+	else if (l->lo > r->lo)
+		return +1;
+	else
+		return 0;
+} /* cmp_funcs */
 
-	/* Try to find $addr in $store.  If not found set $m to the place
-	 * it should have been.  $addr is searched in $store[$l..$r],
-	 * and the interval is halfed in every iteration. */
-	l = 0;
-	r = bh.n - 1;
-	store = (void const **)bh.buf;
-	for (;;)
-	{
-		/* Examine the boundaries of the interval. */
-		/* l, ..., r */
-		if (addr == store[l] || addr == store[r])
-			return 1;
-		else if (addr < store[l])
-		{	/* addr, l, ..., r */
-			m = l;
-			break;
-		} else if (addr > store[r])
-		{	/* l, ..., r, addr */
-			m = r+1;
-			break;
-		} else if (r-l == 1)
-		{	/* l, addr, r */
-			m = r;
-			break;
-		}
+/* qsort() comparator of struct line_st:s by their address.  If the end
+ * of a sequence is where another one starts it must come first. */
+static int cmp_lines(void const *lhs, void const *rhs)
+{
+	struct line_st const *l = lhs, *r = rhs;
 
-		/* Halve the interval and decide where $addr is. */
-		m = l+(r-l)/2;
-		if (addr == store[m])
-		{	/* l, ..., addr, ..., r */
-			return 1;
-		} else if (addr < store[m])
-		{	/* l, ..., addr, ..., m */
-			l++;
-			if (m == l)
-				break;
-			r = m-1;
-		} else /* addr > store[m] */
-		{	/* m, ..., addr, .., r */
-			m++;
-			if (r == m)
-				break;
-			l = m;
-			r--;
-		}
-	} /* for */
+	if (l->addr < r->addr)
+		return -1;
+	else if (l->addr > r->addr)
+		return +1;
+	else if (l->file == NO_FILE && r->file != NO_FILE)
+		return -1;
+	else if (l->file != NO_FILE && r->file == NO_FILE)
+		return +1;
+	else
+		return 0;
+} /* cmp_lines */
 
-insert:	/* $addr not found, insert at $store[$m]. */
-	if (enlarge(&bh, bh.n+1))
+/* Return the length of the build ID of $elf and point *$idp to it,
+ * and print it in $hex, or return 0 if it has no usable build ID. */
+static size_t build_id(Elf *elf, unsigned char const **idp,
+	char hex[2*CACHE_MAX_BUILD_ID+1])
+{
+	ssize_t lid, i;
+
+	lid = dwelf_elf_gnu_build_id(elf, (void const **)idp);
+	if (lid <= 0 || lid > CACHE_MAX_BUILD_ID)
+		return 0;
+	for (i = 0; i < lid; i++)
 	{
-		store = (void const **)bh.buf;
-		memmove(&store[m+1], &store[m],
-			sizeof(*store) * (bh.n-m));
-		store[m] = addr;
-		bh.n++;
+		hex[2*i+0] = "0123456789abcdef"[(*idp)[i] >> 4];
+		hex[2*i+1] = "0123456789abcdef"[(*idp)[i] & 0xf];
 	}
+	hex[2*i] = '\0';
 
-	return 0;
-} /* seen */
+	return lid;
+} /* build_id */
 
 /*
- * Depending on $encoding decode the  integer, float or character
- * found at $addr and append it to $line in textual representation.
- * Returns 0 if failed, either because out of memory or becase we
- * couldn't decode the data.
+ * Return the path of the cached index of $dso in $path of $size bytes,
+ * or an empty string if it can't be cached, because $ARF_CACHE_DIR is
+ * not set or the object has no build ID.  Mangled and demangled names
+ * are cached separately.
  */
-static int print_basic(struct bufhead_st *line, void const *addr,
-	Dwarf_Word encoding, Dwarf_Word size)
+static char const *cache_path(struct dso_st const *dso,
+	char *path, size_t size)
 {
-	switch (encoding)
-	{
-	case DW_ATE_float:
-		switch (size)
-		{
-		case sizeof(float):
-			return addfmt(line, "%f", *(float *)addr);
-		case sizeof(double):
-			return addfmt(line, "%f", *(double *)addr);
-#ifndef __arm__	/* Appears to be the same as double on ARMv7. */
-		case sizeof(long double):
-			return addfmt(line, "%Lf", *(long double *)addr);
-#endif
-		}
-		break;
-	case DW_ATE_address:
-		switch (size)
-		{
-		case sizeof(u_int8_t):
-			return addfmt(line, "0x%.8x", *(u_int8_t *)addr);
-		case sizeof(u_int16_t):
-			return addfmt(line, "0x%.8x", *(u_int16_t *)addr);
-		case sizeof(u_int32_t):
-			return addfmt(line, "0x%.8x", *(u_int32_t *)addr);
-		case sizeof(u_int64_t):
-			return addfmt(line, "0x%.16llx", *(u_int64_t *)addr);
-		}
-		break;
-	case DW_ATE_boolean:
-	{
-		int tf;
+	static char const *dir;
+	unsigned char const *id;
+	char hex[2*CACHE_MAX_BUILD_ID+1];
+
+	path[0] = '\0';
+	if (!dir)
+	{	/* Create the directory if it doesn't exist,
+		 * but not its parents. */
+		dir = getenv("ARF_CACHE_DIR") ? : "";
+		if (dir[0])
+			mkdir(dir, 0777);
+	}
+	if (!dir[0])
+		return path;
 
-		switch (size)
-		{
-		case sizeof(u_int8_t):
-			tf = *(int8_t *)addr != 0;
-			break;
-		case sizeof(u_int16_t):
-			tf = *(int16_t *)addr != 0;
-			break;
-		case sizeof(u_int32_t):
-			tf = *(int32_t *)addr != 0;
-			break;
-		case sizeof(u_int64_t):
-			tf = *(int64_t *)addr != 0;
-			break;
-		}
-		return addfmt(line, "%s", tf ? "true" : "false");
-	} /* boolean */
-	case DW_ATE_signed:
-		switch (size)
-		{
-		case sizeof(int8_t):
-			return addfmt(line, "%d", *(int8_t *)addr);
-		case sizeof(int16_t):
-			return addfmt(line, "%d", *(int16_t *)addr);
-		case sizeof(int32_t):
-			return addfmt(line, "%d", *(int32_t *)addr);
-		case sizeof(int64_t):
-			return addfmt(line, "%lld", *(int64_t *)addr);
-		}
-		break;
-	case DW_ATE_unsigned:
-		switch (size)
-		{
-		case sizeof(u_int8_t):
-			return addfmt(line, "%u", *(u_int8_t *)addr);
-		case sizeof(u_int16_t):
-			return addfmt(line, "%u", *(u_int16_t *)addr);
-		case sizeof(u_int32_t):
-			return addfmt(line, "%u", *(u_int32_t *)addr);
-		case sizeof(u_int64_t):
-			return addfmt(line, "%llu", *(u_int64_t *)addr);
-		}
-		break;
-	case DW_ATE_signed_char:
-		if (size == 1)
-			return addfmt(line, "'%c'", *(char *)addr);
-		break;
-	case DW_ATE_unsigned_char:
-		if (size == 1)
-			return addfmt(line, "0x%.2x", *(char *)addr);
-		break;
-	} /* switch basic type */
+	if (!build_id(dso->elf, &id, hex))
+		return path;
+
+	snprintf(path, size, "%s/%s%s.idx", dir, hex,
+		leave_mangled() ? ".mangled" : "");
+	return path;
+} /* cache_path */
+
+/* Set $bh to the $n elements of $size1 bytes at $*pp in an index file
+ * and advance $*pp past them.  $bh must not be enlarge()d anymore. */
+static void map_index_part(struct bufhead_st *bh, char const **pp,
+	size_t n, size_t size1)
+{
+	bh->buf = (char *)*pp;
+	bh->size1 = size1;
+	bh->capacity = bh->n = n;
+	*pp += CACHE_ALIGN(n * size1);
+} /* map_index_part */
+
+/* Return whether the string offsets and file indexes of a mapped
+ * index stay within it, so a corrupt cache can't make us read
+ * outside the map. */
+static int index_is_sane(struct bufhead_st const *funcs,
+	struct bufhead_st const *lines, struct bufhead_st const *files,
+	struct bufhead_st const *strings)
+{
+	size_t i;
+	uint32_t const *file;
+	struct line_st const *line;
+	struct func_st const *func;
+
+	for (i = 0, func = (void *)funcs->buf; i < funcs->n; i++, func++)
+		if (func->funame >= strings->n || func->cls >= strings->n
+				|| func->cufile >= strings->n)
+			return 0;
+	for (i = 0, line = (void *)lines->buf; i < lines->n; i++, line++)
+		if (line->file != NO_FILE && line->file >= files->n)
+			return 0;
+	for (i = 0, file = (void *)files->buf; i < files->n; i++, file++)
+		if (*file >= strings->n)
+			return 0;
+
+	return 1;
+} /* index_is_sane */
+
+/* Map the cached index of $dso from $path.  Returns whether it could. */
+static int load_index(struct dso_st *dso, char const *path)
+{
+	int fd;
+	size_t size;
+	void *map;
+	char const *p;
+	struct stat sbuf;
+	struct cached_index_st const *hdr;
+	struct bufhead_st funcs, lines, files, strings;
+
+	if (!path[0])
+		return 0;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	map = MAP_FAILED;
+	if (fstat(fd, &sbuf) == 0 && sbuf.st_size >= sizeof(*hdr))
+		map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
 
+	/* Is it what we expect? */
+	hdr = map;
+	size = sizeof(*hdr)
+		+ CACHE_ALIGN(hdr->nfuncs * sizeof(struct func_st))
+		+ CACHE_ALIGN(hdr->nlines * sizeof(struct line_st))
+		+ CACHE_ALIGN(hdr->nfiles * sizeof(uint32_t))
+		+ CACHE_ALIGN(hdr->lstrings);
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic))
+		|| size != sbuf.st_size || !hdr->lstrings)
+		goto out;
+
+	p = (char const *)&hdr[1];
+	map_index_part(&funcs, &p, hdr->nfuncs, sizeof(struct func_st));
+	map_index_part(&lines, &p, hdr->nlines, sizeof(struct line_st));
+	map_index_part(&files, &p, hdr->nfiles, sizeof(uint32_t));
+	map_index_part(&strings, &p, hdr->lstrings, 1);
+	if (strings.buf[strings.n-1] != '\0'
+			|| !index_is_sane(&funcs, &lines, &files, &strings))
+		goto out;
+
+	/* It's ours for the rest of our life. */
+	dso->funcs   = funcs;
+	dso->lines   = lines;
+	dso->files   = files;
+	dso->strings = strings;
+	return 1;
+
+out:
+	munmap(map, sbuf.st_size);
 	return 0;
-} /* print_basic */
+} /* load_index */
 
-/* Append the textual representation of a pointer
- * or an array of pointers to $line. */
-static int print_pointer(
-	struct bufhead_st *line, struct bufhead_st const *name,
-	void const *addr, int waspointer, int isarray, Dwarf_Word nelems)
+/* Write $n bytes of $buf to $fd padded with zeroes for CACHE_ALIGN().
+ * Returns whether it succeeded. */
+static int write_index_part(int fd, void const *buf, size_t n)
 {
-	unsigned i;
-	size_t checkpoint;
+	static char const zeroes[8];
 
-	checkpoint = line->n;
-	if (!addfmt(line, isarray ? "%s%s=%p={" : "%s%s=",
-			waspointer ? ", " : "", name->buf, addr))
+	if (!write_all(fd, buf, n))
 		return 0;
-	if (!addfmt(line, "%p", ((void **)addr)[0]))
+
+	n = CACHE_ALIGN(n) - n;
+	return !n || write(fd, zeroes, n) == n;
+} /* write_index_part */
+
+/* Save the index of $dso in $path atomically, so other processes
+ * won't see half-written files. */
+static void save_index(struct dso_st const *dso, char const *path)
+{
+	int fd, ok;
+	char tmp[PATH_MAX];
+	struct cached_index_st hdr;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%u", path, getpid())
+			>= sizeof(tmp))
+		return;
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL, 0666)) < 0)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.nfuncs   = dso->funcs.n;
+	hdr.nlines   = dso->lines.n;
+	hdr.nfiles   = dso->files.n;
+	hdr.lstrings = dso->strings.n;
+
+	ok = write_index_part(fd, &hdr, sizeof(hdr))
+		&& write_index_part(fd, dso->funcs.buf,
+			dso->funcs.n * dso->funcs.size1)
+		&& write_index_part(fd, dso->lines.buf,
+			dso->lines.n * dso->lines.size1)
+		&& write_index_part(fd, dso->files.buf,
+			dso->files.n * dso->files.size1)
+		&& write_index_part(fd, dso->strings.buf, dso->strings.n);
+	if (close(fd) < 0)
+		ok = 0;
+
+	if (!ok || rename(tmp, path) < 0)
+		unlink(tmp);
+} /* save_index */
+
+/* Build the index of $dso->dr, so bt1_indexed() can find the functions
+ * and the source lines of addresses without walking the DIEs, and save
+ * it in $path unless it's empty. */
+static void index_dso(struct dso_st *dso, char const *path)
+{
+	size_t hsize;
+	Dwarf_Off off, next;
+
+	dso->funcs.size1 = sizeof(struct func_st);
+	dso->lines.size1 = sizeof(struct line_st);
+	dso->files.size1 = sizeof(uint32_t);
+
+	/* Offset 0 is reserved for NULL. */
+	if (!enlarge(&dso->strings, 0))
+		return;
+	dso->strings.buf[0] = '\0';
+	dso->strings.n = 1;
+
+	for (off = 0; dwarf_nextcu(dso->dr, off, &next, &hsize,
+			NULL, NULL, NULL) == 0; off = next)
 	{
-		rollback(line, checkpoint);
-		return 0;
+		Dwarf_Die cu;
+
+		if (!dwarf_offdie(dso->dr, off + hsize, &cu))
+			continue;
+		index_funcs(dso, &cu, add_string(dso, dwarf_diename(&cu)));
+		index_lines(dso, &cu);
 	}
-	for (i = 1; i < nelems && i < Max_array; i++)
-		if (!addfmt(line, ", %p", ((void **)addr)[i]))
-			break;
-	return !isarray || addstr(line, i < nelems ? ", ...}" : "}");
-} /* print_pointer */
+
+	/* The CUs needn't be in address order. */
+	qsort(dso->funcs.buf, dso->funcs.n, dso->funcs.size1, cmp_funcs);
+	qsort(dso->lines.buf, dso->lines.n, dso->lines.size1, cmp_lines);
+
+	if (path[0])
+		save_index(dso, path);
+} /* index_dso */
+
+/* Return the innermost function of $dso->funcs containing $pc. */
+static struct func_st const *find_func(struct dso_st const *dso,
+	Dwarf_Addr pc)
+{
+	unsigned lo, hi, i;
+	struct func_st const *funcs;
+
+	/* Find the last function starting at or before $pc. */
+	funcs = (struct func_st const *)dso->funcs.buf;
+	lo = 0;
+	hi = dso->funcs.n;
+	while (lo < hi)
+	{
+		unsigned mid;
+
+		mid = lo + (hi-lo) / 2;
+		if (funcs[mid].lo <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* It may be a nested one which ends before $pc,
+	 * but the one containing it shouldn't be far. */
+	for (i = lo; i > 0 && lo - i < 8; i--)
+		if (pc < funcs[i-1].hi)
+			return &funcs[i-1];
+	return NULL;
+} /* find_func */
+
+/* Return the source file of $pc in $dso->lines and its line number
+ * in *$linenop, or NULL if it's not known. */
+static char const *find_line(struct dso_st const *dso, Dwarf_Addr pc,
+	int *linenop)
+{
+	unsigned lo, hi;
+	struct line_st const *lines, *row;
+
+	lines = (struct line_st const *)dso->lines.buf;
+	lo = 0;
+	hi = dso->lines.n;
+	while (lo < hi)
+	{
+		unsigned mid;
+
+		mid = lo + (hi-lo) / 2;
+		if (lines[mid].addr <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Is $pc between the sequences? */
+	if (!lo)
+		return NULL;
+	row = &lines[lo-1];
+	if (row->file == NO_FILE)
+		return NULL;
+
+	*linenop = row->lineno;
+	return get_string(dso, ((uint32_t const *)dso->files.buf)[row->file]);
+} /* find_line *//* }}} */
+
+/* getdso() {{{ */
+/* Return the CRC-32 of the $size bytes at $buf, which is what
+ * .gnu_debuglink records of the debug file. */
+static uint32_t crc32(void const *buf, size_t size)
+{
+	static uint32_t table[256];
+	unsigned char const *p;
+	uint32_t crc;
+
+	if (!table[1])
+	{
+		unsigned i, j;
+
+		for (i = 0; i < 256; i++)
+		{
+			crc = i;
+			for (j = 0; j < 8; j++)
+				crc = crc & 1 ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+			table[i] = crc;
+		}
+	}
+
+	crc = ~0;
+	for (p = buf; size > 0; p++, size--)
+		crc = table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+	return ~crc;
+} /* crc32 */
 
 /*
- * Desired output format: {{{
- * basic:
- *	int  akarmi
- *	     akarmi
- *  akarmi=10
- * array, basic:
- *	int  akarmi[5]
- *	     akarmi
- *  akarmi=0x1234={10,20,30}
- * array, array, basic:
- *	int  akarmi[5][5]
- *	     akarmi[0]
- *  akarmi[0]=0x1234={10,20,30}
- *
- * pointer, basic:		  !waspointer && !isarray
- *	int *akarmi
- *	    *akarmi
- *  akarmi=0x1234, *akarmi=10
- * pointer, array, basic:
- *	int (*akarmi)[5]
- *	     *akarmi
- *  akarmi=0x1234, *akarmi=0x4321={10,20,30}
- * pointer, array, array, basic:
- *	int (*akarmi)[5][5]
- *	    (*akarmi)[0]
- *  akarmi=0x1234, (*akarmi)[0]=0x4321={10,20,30}
- *
- * array, pointer, basic:	  !waspointer &&  isarray
- *	int *akarmi[5]
- *	    *akarmi[0]
- *  akarmi=0x1234, *akarmi[0]=10
- * array, pointer, array, basic:
- *      int (*akarmi[5])[5]
- *	     *akarmi[0]
- *  akarmi=0x1234, *akarmi[0]=0x4321={10,20,30}
- * array, pointer, array, array, basic:
- *      int (*akarmi[5])[5][5]
- *	    (*akarmi[0])[0]
- *  akarmi=0x1234, (*akarmi[0])[0]=0x4321={10,20,30}
- *
- * pointer, pointer, basic:	   waspointer && !isarray
- *	int **akarmi
- *	    **akarmi
- *  akarmi=0x1234, *akarmi=0x4321, **akarmi=10
- * pointer, pointer, array, basic:
- *	int (**akarmi)[5]
- *	     **akarmi
- *  akarmi=0x1234, *akarmi=0x4321, **akarmi=0x1441={10,20,30}
- * pointer, pointer, array, array, basic:
- *	int (**akarmi)[5][5]
- *	    (**akarmi)[0]
- *  akarmi=0x1234, *akarmi=0x4321, (**akarmi)[0]=0x1441={10,20,30}
- *
- * pointer, array, pointer, basic: waspointer &&  isarray
- *	int *(*akarmi)[5]
- *	    *(*akarmi)[0]
- *  akarmi=0x1234, *akarmi=0x4321, *(*akarmi)[0]=10
- * pointer, array, pointer, array, basic:
- *	int (*(*akarmi)[5])[5]
- *	     *(*akarmi)[0]
- *  akarmi=0x1234, *akarmi=0x4321, *(*akarmi)[0]=0x1441={10,20,30}
- * }}}
+ * Open the detached debug file at $path unless it's $that file itself.
+ * If $id is given it's the build ID of $lid bytes the debug file must
+ * have, otherwise $crc is the checksum of the whole file.  The file is
+ * mapped only once: the checksum is computed over libelf's mapping,
+ * which libdw reads too.
  */
-static char const *decodevar(Dwarf_Die *var, char const *id,
-	void const *addr, struct dso_st const *dso)
+static Dwarf *opendbg(struct stat const *that, char const *path,
+	unsigned char const *id, size_t lid, uint32_t crc)
 {
-	static struct bufhead_st name, line;
-	unsigned i;
-	Dwarf_Die type;
-	void const *seg;
-	size_t checkpoint;;
-	int waspointer, isarray;
-	Dwarf_Word encoding, size, nelems;
+	int fd;
+	Elf *elf;
+	Dwarf *dr;
+	size_t size;
+	struct stat this;
+	char const *raw;
+	char hex[2*CACHE_MAX_BUILD_ID+1];
+	unsigned char const *thisid;
 
-	/* Initialize $name and $line. */
-	name.n = line.n = 0;
-	if (!addstr(&name, id))
-		goto done;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
 
-	/* Dereference $addr until its $type is something basic we can
-	 * decode and print in `basic'. */
-	type = *var;
-	seg = NULL;
-	waspointer = isarray = 0;
-	nelems  = 1;
-	for (;;)
+	/* Don't waste time on $this if it's $that. */
+	elf = NULL;
+	if (fstat(fd, &this) < 0)
+		goto out;
+	if (this.st_rdev == that->st_rdev && this.st_ino == that->st_ino)
+		goto out;
+	if (!(elf = elf_begin(fd, ELF_C_READ_MMAP, NULL)))
+		goto out;
+
+	/* Is it really the debug file of our object? */
+	if (id)
 	{
-		Dwarf_Attribute attr;
+		if (build_id(elf, &thisid, hex) != lid
+				|| memcmp(thisid, id, lid))
+			goto out;
+	} else if (!(raw = elf_rawfile(elf, &size))
+			|| crc32(raw, size) != crc)
+		goto out;
 
-		/*
-		 * $addr is an address and it always points to data,
-		 * which can be a pointer, which will become $addr
-		 * in the next iteration.  See what kind of data
-		 * does $addr point to.
-		 */
-		if (!dwarf_attr(&type, DW_AT_type, &attr))
-			goto done;
-		if (dwarf_whatform(&attr) != DW_FORM_ref4)
-			goto done;
-		dwarf_formref_die(&attr, &type);
+	/* Did we win cigar? */
+	if ((dr = dwarf_begin_elf(elf, DWARF_C_READ, NULL)) != NULL)
+		return dr;
 
-		switch (dwarf_tag(&type))
-		{
-		case DW_TAG_typedef:
-		case DW_TAG_const_type:
-		case DW_TAG_volatile_type:
-			/* Simply ignore qualifiers and aliases. */
+out:
+	if (elf)
+		elf_end(elf);
+	close(fd);
+	return NULL;
+} /* opendbg */
+
+/*
+ * Find the detached debug information of $dso, which is in $dir of $ldir
+ * characters.  Look it up by the build ID first, as it can't be mistaken
+ * and it's just a single open(), then by .gnu_debuglink, searching in the
+ * same locations as gdb does.
+ */
+static Dwarf *finddbg(struct dso_st const *dso, char const *dir, size_t ldir)
+{
+	struct stat sbuf;
+	Elf_Ehdr *ehdr;
+	Elf_Scn *scn;
+	Elf_Shdr *shdr;
+	Dwarf *dr;
+	size_t lid;
+	unsigned char const *id;
+	char path[PATH_MAX], hex[2*CACHE_MAX_BUILD_ID+1];
+
+	/* Get the inode of $dso so we won't try to find
+	 * the debug informations at the same place. */
+	if (fstat(dso->fd, &sbuf) < 0)
+		return NULL;
+
+	if ((lid = build_id(dso->elf, &id, hex)) > 1)
+	{
+		snprintf(path, sizeof(path),
+			"/usr/lib/debug/.build-id/%.2s/%s.debug",
+			hex, &hex[2]);
+		if ((dr = opendbg(&sbuf, path, id, lid, 0)) != NULL)
+			return dr;
+	}
+
+	/* Iterate over the sections until we find .gnu_debuglink. */
+	dr = NULL;
+	ehdr = elf_getehdr(dso->elf);
+	for (scn = elf_getscn(dso->elf, 0); scn;
+		scn = elf_nextscn(dso->elf, scn))
+	{
+		char const *fname;
+		size_t lfname;
+		uint32_t crc;
+
+		shdr = elf_getshdr(scn);
+		if (!shdr)
+			/* Can be 32/64-bit incompatibility. */
 			continue;
-		default: /* Unrecognized. */
-			goto done;
+		if (shdr->sh_type != SHT_PROGBITS)
+			continue;
+		if (strcmp(elf_strptr(dso->elf, ehdr->e_shstrndx,
+					shdr->sh_name),
+				".gnu_debuglink"))
+			continue;
+
+		/* .gnu_debuglink is usually just a basename, followed
+		 * by the CRC aligned to 4 bytes.  Find it in the file
+		 * system. */
+		fname = (char const *)ehdr + shdr->sh_offset;
+		lfname = strnlen(fname, shdr->sh_size);
+		if (((lfname + 1 + 3) & ~3) + sizeof(crc) > shdr->sh_size)
+			break;
+		memcpy(&crc, &fname[(lfname + 1 + 3) & ~3], sizeof(crc));
+
+		snprintf(path, sizeof(path), "%.*s/%s",
+			(int)ldir, dir, fname);
+		if ((dr = opendbg(&sbuf, path, NULL, 0, crc)) != NULL)
+			break;
+		snprintf(path, sizeof(path), "%.*s/.debug/%s",
+			(int)ldir, dir, fname);
+		if ((dr = opendbg(&sbuf, path, NULL, 0, crc)) != NULL)
+			break;
+		snprintf(path, sizeof(path), "/usr/lib/debug/%.*s/%s",
+			(int)ldir, dir, fname);
+		if ((dr = opendbg(&sbuf, path, NULL, 0, crc)) != NULL)
+			break;
+		/* gdb only looks here if its prefix is /usr/local */
+		snprintf(path, sizeof(path), "/usr/local/lib/debug/%.*s/%s",
+			(int)ldir, dir, fname);
+		dr = opendbg(&sbuf, path, NULL, 0, crc);
+		break;
+	} /* for */
+
+	return dr;
+} /* finddbg */
+
+#ifdef CONFIG_FAST_UNWIND
+/* qsort() comparator of struct segment_st:s by their start address. */
+static int cmp_segments(void const *lhs, void const *rhs)
+{
+	struct segment_st const *l = lhs, *r = rhs;
+
+	if (l->start < r->start)
+		return -1;
+	else if (l->start > r->start)
+		return +1;
+	else
+		return 0;
+} /* cmp_segments */
+
+/* Build $dso->sections.  The caller must have set $dso->base. */
+static void index_sections(struct dso_st *dso)
+{
+	Elf_Scn *scn;
+	Elf_Shdr *shdr;
+	struct segment_st *section;
+
+	dso->sections.size1 = sizeof(*section);
+	if (!dso->elf)
+		return;
+
+	for (scn = elf_getscn(dso->elf, 0); scn;
+		scn = elf_nextscn(dso->elf, scn))
+	{
+		/* Only the allocated sections are in the memory.
+		 * .tbss takes up no space, it overlaps the next ones. */
+		if (!(shdr = elf_getshdr(scn)))
+			continue;
+		if (!(shdr->sh_flags & SHF_ALLOC) || !shdr->sh_size)
+			continue;
+		if (shdr->sh_type == SHT_NOBITS && (shdr->sh_flags & SHF_TLS))
+			continue;
+		if (!(section = enlarge(&dso->sections, 1)))
+			break;
+
+		/* Do we understand it?  If not addr_is() will
+		 * resort to /proc/self/maps. */
+		section->start = (char const *)dso->base + shdr->sh_addr;
+		section->end = (char const *)section->start + shdr->sh_size;
+		if (shdr->sh_type != SHT_PROGBITS
+				&& shdr->sh_type != SHT_NOBITS)
+			section->type = OTHER;
+		else if (shdr->sh_flags & SHF_EXECINSTR)
+			section->type = CODE;
+		else
+			section->type = DATA;
+		dso->sections.n++;
+	}
+
+	/* The ELF specs don't mandate that they're ordered. */
+	qsort(dso->sections.buf, dso->sections.n, dso->sections.size1,
+		cmp_segments);
+} /* index_sections */
+#endif /* CONFIG_FAST_UNWIND */
+
+/* Create a new $dso for the object $id opened as $fd, or close $fd
+ * and return NULL.  The caller needs to set $dso->base and add it
+ * to the list of $Dsos.  The debug information is not looked at
+ * until load_debug(). */
+static struct dso_st *newdso(int fd, char const *id)
+{
+	struct dso_st *dso;
+
+	if (!(dso = malloc(sizeof(*dso))))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	dso->id = id;
+	if ((dso->fname = strrchr(dso->id, '/')) != NULL)
+		dso->fname++;
+	else
+		dso->fname = dso->id;
+
+	/* Initialize libelf.  The $dso is useful to some extent
+	 * even if it fails. */
+	elf_version(EV_CURRENT);
+	dso->fd = fd;
+	dso->loaded = 0;
+	dso->dr = NULL;
+	memset(&dso->funcs, 0, sizeof(dso->funcs));
+	memset(&dso->lines, 0, sizeof(dso->lines));
+	memset(&dso->files, 0, sizeof(dso->files));
+	memset(&dso->strings, 0, sizeof(dso->strings));
+#ifdef CONFIG_FAST_UNWIND
+	memset(&dso->sections, 0, sizeof(dso->sections));
+#endif
+	if (!(dso->elf = elf_begin(fd, ELF_C_READ_MMAP, NULL)))
+	{
+		close(fd);
+		dso->fd = -1;
+	}
+
+	return dso;
+} /* newdso */
+
+/*
+ * Load the index of $dso from the cache or build it, the first time
+ * a frame in $dso needs to be looked up, so we don't spend time on
+ * the debug information of objects the backtraces don't go through.
+ * Unless we print variables we only need the debug information for
+ * the index, so if it's cached $dso->dr is not even opened.  The caller
+ * must hold $Lock for writing.
+ */
+static void load_debug(struct dso_st *dso)
+{
+	size_t ldir;
+	char const *dir;
+	char path[PATH_MAX];
+	int cached;
+
+	if (dso->loaded)
+		return;
+	dso->loaded = 1;
+	if (!dso->elf)
+		return;
+
+	cached = load_index(dso, cache_path(dso, path, sizeof(path)));
+#ifndef CONFIG_PRINTVARS
+	if (cached)
+		return;
+#endif
+
+	if (!(dso->dr = dwarf_begin_elf(dso->elf, DWARF_C_READ, NULL)))
+	{	/* Let $dir denote the container directory of $dso->fname.
+		 * Needed when the debug information is in a separate file. */
+		if (dso->fname > dso->id)
+		{
+			dir = dso->id;
+			ldir = dso->fname-1 - dso->id;
+		} else
+		{
+			dir = ".";
+			ldir = 1;
+		}
+		dso->dr = finddbg(dso, dir, ldir);
+	}
+	if (dso->dr && !cached)
+		index_dso(dso, path);
+} /* load_debug */
+
+/* Get the $dso of a foreign process' $Mappings which contains $addr. */
+static struct dso_st const *getmapped(void const *addr)
+{
+	struct mapping_st const *map;
+	struct dso_st *dso;
+	Elf_Ehdr *ehdr;
+	unsigned lo, hi;
+	void *base;
+	int fd;
+
+	/* Find the $map $addr is in. */
+	lo = 0;
+	hi = NMappings;
+	map = NULL;
+	while (lo < hi)
+	{
+		unsigned mid;
+
+		mid = lo + (hi-lo) / 2;
+		if (addr < Mappings[mid].start)
+			hi = mid;
+		else if (addr >= Mappings[mid].end)
+			lo = mid + 1;
+		else
+		{
+			map = &Mappings[mid];
+			break;
+		}
+	}
+	if (!map)
+		return NULL;
+
+	/* The relocation base, assuming the segments are mapped
+	 * at the same offsets as in the file, which they are
+	 * unless the linker got clever. */
+	base = (void *)((char const *)map->start - map->offset);
+
+	/* Have we seen it at the same $base? */
+	for (dso = Dsos; dso; dso = dso->next)
+		if (dso->id == map->path && dso->base == base)
+			return dso;
+	/* Remember it even if we can't open it, newdso()
+	 * just won't find any debug information then. */
+	fd = open(map->path, O_RDONLY);
+	if (!(dso = newdso(fd, map->path)))
+		return NULL;
+
+	/* Executables are not relocated, like in getdso(). */
+	ehdr = dso->elf ? elf_getehdr(dso->elf) : NULL;
+	dso->base = ehdr && ehdr->e_type == ET_EXEC ? NULL : base;
+#ifdef CONFIG_FAST_UNWIND
+	index_sections(dso);
+#endif
+
+	dso->next = Dsos;
+	Dsos      = dso;
+
+	return dso;
+} /* getmapped */
+
+/* dl_iterate_phdr() callback of load_segments() to add the PT_LOAD
+ * segments of an object to $Loaded.  *$firstp tells whether it's the
+ * first object, the executable. */
+static int add_loaded(struct dl_phdr_info *info, size_t size, void *firstp)
+{
+	int *first = firstp;
+	char const *id;
+	unsigned i;
+
+	/* The executable has no name, call it argv[0] like dladdr().
+	 * Old glibcs don't name the vdso either, we can't open it
+	 * anyway. */
+	if (*first)
+	{
+		*first = 0;
+		id = info->dlpi_name[0] ? info->dlpi_name
+			: program_invocation_name;
+	} else if (!info->dlpi_name[0])
+		return 0;
+	else
+		id = info->dlpi_name;
+
+	for (i = 0; i < info->dlpi_phnum; i++)
+	{
+		ElfW(Phdr) const *phdr = &info->dlpi_phdr[i];
+		struct loaded_st *seg;
+
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		if (!(seg = enlarge(&Loaded, 1)))
+			return 1;
+
+		seg->start = (char const *)info->dlpi_addr + phdr->p_vaddr;
+		seg->end   = (char const *)seg->start + phdr->p_memsz;
+		seg->id    = id;
+		seg->base  = (void *)info->dlpi_addr;
+		seg->dso   = NULL;
+		Loaded.n++;
+	}
+
+	return 0;
+} /* add_loaded */
+
+/* qsort() comparator of struct loaded_st:s by their start address. */
+static int cmp_loaded(void const *lhs, void const *rhs)
+{
+	struct loaded_st const *l = lhs, *r = rhs;
+
+	if (l->start < r->start)
+		return -1;
+	else if (l->start > r->start)
+		return +1;
+	else
+		return 0;
+} /* cmp_loaded */
+
+/* (Re)build $Loaded. */
+static void load_segments(void)
+{
+	int first;
+
+	Loaded.size1 = sizeof(struct loaded_st);
+	Loaded.n = 0;
+	first = 1;
+	dl_iterate_phdr(add_loaded, &first);
+	qsort(Loaded.buf, Loaded.n, Loaded.size1, cmp_loaded);
+	Loaded_stale = 0;
+} /* load_segments */
+
+/* Get a $dso which contains $addr.  The caller must hold $Lock
+ * for writing. */
+static struct dso_st const *getdso(void const *addr)
+{
+	struct loaded_st *segs, *seg;
+	struct dso_st *dso;
+	unsigned lo, hi;
+	int fd;
+
+	/* Are we decoding another process' addresses? */
+	if (Mappings)
+		return getmapped(addr);
+
+	/* Get which object has the code. */
+	if (Loaded_stale)
+		load_segments();
+	segs = (struct loaded_st *)Loaded.buf;
+	seg = NULL;
+	lo = 0;
+	hi = Loaded.n;
+	while (lo < hi)
+	{
+		unsigned mid;
+
+		mid = lo + (hi-lo) / 2;
+		if (addr < segs[mid].start)
+			hi = mid;
+		else if (addr >= segs[mid].end)
+			lo = mid + 1;
+		else
+		{
+			seg = &segs[mid];
+			break;
+		}
+	}
+	if (!seg)
+		return NULL;
+	else if (seg->dso)
+		return seg->dso;
+
+	/* Have we seen it?  Compare the base too in case it's been
+	 * reloaded elsewhere and its name happens to be in the same
+	 * place as before. */
+	for (dso = Dsos; dso; dso = dso->next)
+		if (dso->id == seg->id && dso->base == seg->base)
+			return seg->dso = dso;
+
+	/* No, create new $dso. */
+	if ((fd = open(seg->id, O_RDONLY)) < 0)
+	{
+		/*
+		 * If $addr belongs to an executable we couldn't find
+		 * let's try to go direct (on linux).  argv[0] may not
+		 * be the full path to the executable.
+		 */
+		if (errno != ENOENT)
+			return NULL;
+		if (seg->id != program_invocation_name)
+			return NULL;
+		if ((fd = open("/proc/self/exe", O_RDONLY)) < 0)
+			return NULL;
+	}
+	if (!(dso = newdso(fd, seg->id)))
+		return NULL;
+
+	/* The base is 0 for non-PIE executables. */
+	dso->base = seg->base;
+#ifdef CONFIG_FAST_UNWIND
+	index_sections(dso);
+#endif
+
+	dso->next = Dsos;
+	Dsos      = dso;
+
+	return seg->dso = dso;
+} /* getdso */
+/* }}} */
+
+#ifdef CONFIG_FAST_UNWIND
+/* addr_is() {{{ */
+/* Comparator function for bsearch() to tell whether an $addr
+ * is in a $segment. */
+static int find_segment(void const *addr, struct segment_st const *segment)
+{
+	if (addr < segment->start)
+		return -1;
+	if (addr >= segment->end)
+		return +1;
+	else
+		return 0;
+} /* find_segment */
+
+/* Return the segment of $Maps containing $addr, or NULL if there's
+ * none or it's a gap which hasn't been checked in this $Maps_gen. */
+static struct segment_st const *map_of(void const *addr)
+{
+	struct segment_st const *segment;
+
+	segment = bsearch(addr,
+		Maps.buf, Maps.n, sizeof(*segment),
+		(int (*)(void const *, void const *))find_segment);
+	if (segment && segment->type == UNMAPPED
+			&& segment->gen != __atomic_load_n(&Maps_gen,
+				__ATOMIC_RELAXED))
+		return NULL;
+	return segment;
+} /* map_of */
+
+/* Return whether $segment is the gap below the [stack], which may have
+ * grown into it since, and the maps haven't been reread for it. */
+static int stack_may_have_grown(struct segment_st const *segment)
+{
+	return segment->type == UNMAPPED
+		&& segment->end == Main_stack
+		&& Main_stack != Grown_stack;
+} /* stack_may_have_grown */
+
+/* Reread /proc/self/maps into $Maps, filling the gaps between the
+ * mappings with UNMAPPED segments checked in the current $Maps_gen. */
+static void load_maps(void)
+{
+	FILE *maps;
+	unsigned gen;
+	char line[128];
+	void const *prev;
+	struct segment_st *segment;
+
+	FAIL("RELOAD %u", Maps_gen);
+	Maps.n = 0;
+	prev = NULL;
+	gen = __atomic_load_n(&Maps_gen, __ATOMIC_RELAXED);
+	if (!(maps = fopen("/proc/self/maps", "r")))
+		return;
+
+	/* Assume that $maps is sorted by address. */
+	while (fgets(line, sizeof(line), maps))
+	{
+		int n, nn;
+		unsigned inode;
+		void const *start, *end;
+
+		if (sscanf(line, "%p-%p %n", &start, &end, &n) < 2)
+			continue;
+		if (start < prev)
+			continue;
+
+		if (start > prev)
+		{	/* Remember the gap too. */
+			if (!(segment = enlarge(&Maps, 1)))
+				break;
+			segment->start = prev;
+			segment->end = start;
+			segment->type = UNMAPPED;
+			segment->gen = gen;
+			Maps.n++;
+		}
+
+		if (!(segment = enlarge(&Maps, 1)))
+			break;
+		segment->start = start;
+		segment->end = prev = end;
+
+		/* Parse the $line. */
+		if (sscanf(&line[n], "rw%*c%*c %*x 00:00 %u %n",
+				&inode, &nn) > 0
+			&& !inode)
+		{
+			n += nn;
+			if (!line[n] || line[n] == '\n')
+				/* Anonymous page, but threads may
+				 * use them as stack. */
+				segment->type = STACK;
+			else if (!strcmp(&line[n], "[stack]\n"))
+			{
+				segment->type = STACK;
+				Main_stack = start;
+			}
+			else if (!strcmp(&line[n], "[heap]\n"))
+				segment->type = HEAP;
+			else
+				segment->type = OTHER;
+		} else if (sscanf(&line[n], "%*c%*cx%*c %*x %*x:%*x %u %n",
+					&inode, &nn) > 0
+				&& (inode || !strcmp(&line[n+nn], "[vdso]\n")))
+			segment->type = CODE;
+		else
+			segment->type = OTHER;
+
+		DEEPSHIT("%p-%p %d", segment->start, segment->end,
+			segment->type);
+		Maps.n++;
+	} /* for $maps lines */
+	fclose(maps);
+
+	/* The rest of the address space. */
+	if ((segment = enlarge(&Maps, 1)) != NULL)
+	{
+		segment->start = prev;
+		segment->end = (void const *)~(uintptr_t)0;
+		segment->type = UNMAPPED;
+		segment->gen = gen;
+		Maps.n++;
+	}
+} /* load_maps */
+
+/*
+ * Try to tell what $addr points to: some CODE, somewhere in the STACK,
+ * HEAP or to some DATA.  Returns OTHER if no idea.  If you supply $dso
+ * its ELF sections are searched first.  If that fails addr_is() looks
+ * at what it knows about /proc/self/maps, and guesses what $addr points
+ * to by the containing memory map entry's file backing and write/execute
+ * bits.  If $addr is where nothing was mapped the last time we looked,
+ * the maps are reread, but only once per $Maps_gen.
+ */
+static enum segment_type_t addr_is(struct dso_st const *dso,
+	void const *addr, void const **segp)
+{
+	int locked;
+	enum segment_type_t type;
+	struct segment_st const *segment;
+
+	if (addr < (void *)4096)
+	{
+		/* Must be an error somewhere, nothing is supposed to be
+		 * mapped at such a low address. */
+		FAIL("LOW ADDR %p", addr);
+		return OTHER;
+	}
+
+	if (dso)
+	{	/* Search the ELF sections.  If we don't understand
+		 * the one $addr is in resort to /proc/self/maps. */
+		segment = bsearch(addr,
+			dso->sections.buf, dso->sections.n,
+			sizeof(*segment),
+			(int (*)(void const *, void const *))find_segment);
+		if (segment && segment->type != OTHER)
+		{
+			if (segp != NULL)
+				*segp = segment->end;
+			return segment->type;
+		}
+	} /* if we know $dso */
+
+	/* Search the maps for $addr, and reload them if $addr
+	 * wasn't mapped before, unless another thread has just
+	 * done so while we were waiting for the lock. */
+	locked = rdlock();
+	if (!(segment = map_of(addr)) || stack_may_have_grown(segment))
+	{
+		if (!Locked)
+		{
+			unlock(locked);
+			locked = wrlock();
+			segment = map_of(addr);
+		}
+		if (!segment || stack_may_have_grown(segment))
+		{
+			if (segment)
+				Grown_stack = Main_stack;
+			load_maps();
+			segment = map_of(addr);
+		}
+	}
+
+	if (!segment || segment->type == UNMAPPED)
+		type = OTHER;
+	else
+	{
+		if (segp != NULL)
+			*segp = segment->end;
+		type = segment->type;
+	}
+	unlock(locked);
+
+	return type;
+} /* addr_is */
+/* addr_is }}} */
+#endif /* CONFIG_FAST_UNWIND */
+
+/* printvars() {{{ */
+#ifdef CONFIG_PRINTVARS
+/* Return whether it has seen $addr.  If not, remember it.
+ * If $addr is NULL forget everything.  This is used to avoid
+ * printing the same variable more than once during a backtrace. */
+static int seen(void const *addr)
+{
+	static __thread struct bufhead_st bh = { .size1 = sizeof(addr) };
+	unsigned l, m, r;
+	void const **store;
+
+	if (!addr)
+	{	/* Reset $store. */
+		bh.n = 0;
+		return 1;
+	} else if (!bh.n)
+	{	/* Insert the first element. */
+		m = 0;
+		goto insert;
+	}
+
+	/* Try to find $addr in $store.  If not found set $m to the place
+	 * it should have been.  $addr is searched in $store[$l..$r],
+	 * and the interval is halfed in every iteration. */
+	l = 0;
+	r = bh.n - 1;
+	store = (void const **)bh.buf;
+	for (;;)
+	{
+		/* Examine the boundaries of the interval. */
+		/* l, ..., r */
+		if (addr == store[l] || addr == store[r])
+			return 1;
+		else if (addr < store[l])
+		{	/* addr, l, ..., r */
+			m = l;
+			break;
+		} else if (addr > store[r])
+		{	/* l, ..., r, addr */
+			m = r+1;
+			break;
+		} else if (r-l == 1)
+		{	/* l, addr, r */
+			m = r;
+			break;
+		}
+
+		/* Halve the interval and decide where $addr is. */
+		m = l+(r-l)/2;
+		if (addr == store[m])
+		{	/* l, ..., addr, ..., r */
+			return 1;
+		} else if (addr < store[m])
+		{	/* l, ..., addr, ..., m */
+			l++;
+			if (m == l)
+				break;
+			r = m-1;
+		} else /* addr > store[m] */
+		{	/* m, ..., addr, .., r */
+			m++;
+			if (r == m)
+				break;
+			l = m;
+			r--;
+		}
+	} /* for */
+
+insert:	/* $addr not found, insert at $store[$m]. */
+	if (enlarge(&bh, bh.n+1))
+	{
+		store = (void const **)bh.buf;
+		memmove(&store[m+1], &store[m],
+			sizeof(*store) * (bh.n-m));
+		store[m] = addr;
+		bh.n++;
+	}
+
+	return 0;
+} /* seen */
+
+/*
+ * Depending on $encoding decode the  integer, float or character
+ * found at $addr and append it to $line in textual representation.
+ * Returns 0 if failed, either because out of memory or becase we
+ * couldn't decode the data.
+ */
+static int print_basic(struct bufhead_st *line, void const *addr,
+	Dwarf_Word encoding, Dwarf_Word size)
+{
+	switch (encoding)
+	{
+	case DW_ATE_float:
+		switch (size)
+		{
+		case sizeof(float):
+			return addfmt(line, "%f", *(float *)addr);
+		case sizeof(double):
+			return addfmt(line, "%f", *(double *)addr);
+#ifndef __arm__	/* Appears to be the same as double on ARMv7. */
+		case sizeof(long double):
+			return addfmt(line, "%Lf", *(long double *)addr);
+#endif
+		}
+		break;
+	case DW_ATE_address:
+		switch (size)
+		{
+		case sizeof(u_int8_t):
+			return addfmt(line, "0x%.8x", *(u_int8_t *)addr);
+		case sizeof(u_int16_t):
+			return addfmt(line, "0x%.8x", *(u_int16_t *)addr);
+		case sizeof(u_int32_t):
+			return addfmt(line, "0x%.8x", *(u_int32_t *)addr);
+		case sizeof(u_int64_t):
+			return addfmt(line, "0x%.16llx", *(u_int64_t *)addr);
+		}
+		break;
+	case DW_ATE_boolean:
+	{
+		int tf;
+
+		switch (size)
+		{
+		case sizeof(u_int8_t):
+			tf = *(int8_t *)addr != 0;
+			break;
+		case sizeof(u_int16_t):
+			tf = *(int16_t *)addr != 0;
+			break;
+		case sizeof(u_int32_t):
+			tf = *(int32_t *)addr != 0;
+			break;
+		case sizeof(u_int64_t):
+			tf = *(int64_t *)addr != 0;
+			break;
+		}
+		return addfmt(line, "%s", tf ? "true" : "false");
+	} /* boolean */
+	case DW_ATE_signed:
+		switch (size)
+		{
+		case sizeof(int8_t):
+			return addfmt(line, "%d", *(int8_t *)addr);
+		case sizeof(int16_t):
+			return addfmt(line, "%d", *(int16_t *)addr);
+		case sizeof(int32_t):
+			return addfmt(line, "%d", *(int32_t *)addr);
+		case sizeof(int64_t):
+			return addfmt(line, "%lld", *(int64_t *)addr);
+		}
+		break;
+	case DW_ATE_unsigned:
+		switch (size)
+		{
+		case sizeof(u_int8_t):
+			return addfmt(line, "%u", *(u_int8_t *)addr);
+		case sizeof(u_int16_t):
+			return addfmt(line, "%u", *(u_int16_t *)addr);
+		case sizeof(u_int32_t):
+			return addfmt(line, "%u", *(u_int32_t *)addr);
+		case sizeof(u_int64_t):
+			return addfmt(line, "%llu", *(u_int64_t *)addr);
+		}
+		break;
+	case DW_ATE_signed_char:
+		if (size == 1)
+			return addfmt(line, "'%c'", *(char *)addr);
+		break;
+	case DW_ATE_unsigned_char:
+		if (size == 1)
+			return addfmt(line, "0x%.2x", *(char *)addr);
+		break;
+	} /* switch basic type */
+
+	return 0;
+} /* print_basic */
+
+/* Append the textual representation of a pointer
+ * or an array of pointers to $line. */
+static int print_pointer(
+	struct bufhead_st *line, struct bufhead_st const *name,
+	void const *addr, int waspointer, int isarray, Dwarf_Word nelems)
+{
+	unsigned i;
+	size_t checkpoint;
+
+	checkpoint = line->n;
+	if (!addfmt(line, isarray ? "%s%s=%p={" : "%s%s=",
+			waspointer ? ", " : "", name->buf, addr))
+		return 0;
+	if (!addfmt(line, "%p", ((void **)addr)[0]))
+	{
+		rollback(line, checkpoint);
+		return 0;
+	}
+	for (i = 1; i < nelems && i < Max_array; i++)
+		if (!addfmt(line, ", %p", ((void **)addr)[i]))
+			break;
+	return !isarray || addstr(line, i < nelems ? ", ...}" : "}");
+} /* print_pointer */
+
+/*
+ * Desired output format: {{{
+ * basic:
+ *	int  akarmi
+ *	     akarmi
+ *  akarmi=10
+ * array, basic:
+ *	int  akarmi[5]
+ *	     akarmi
+ *  akarmi=0x1234={10,20,30}
+ * array, array, basic:
+ *	int  akarmi[5][5]
+ *	     akarmi[0]
+ *  akarmi[0]=0x1234={10,20,30}
+ *
+ * pointer, basic:		  !waspointer && !isarray
+ *	int *akarmi
+ *	    *akarmi
+ *  akarmi=0x1234, *akarmi=10
+ * pointer, array, basic:
+ *	int (*akarmi)[5]
+ *	     *akarmi
+ *  akarmi=0x1234, *akarmi=0x4321={10,20,30}
+ * pointer, array, array, basic:
+ *	int (*akarmi)[5][5]
+ *	    (*akarmi)[0]
+ *  akarmi=0x1234, (*akarmi)[0]=0x4321={10,20,30}
+ *
+ * array, pointer, basic:	  !waspointer &&  isarray
+ *	int *akarmi[5]
+ *	    *akarmi[0]
+ *  akarmi=0x1234, *akarmi[0]=10
+ * array, pointer, array, basic:
+ *      int (*akarmi[5])[5]
+ *	     *akarmi[0]
+ *  akarmi=0x1234, *akarmi[0]=0x4321={10,20,30}
+ * array, pointer, array, array, basic:
+ *      int (*akarmi[5])[5][5]
+ *	    (*akarmi[0])[0]
+ *  akarmi=0x1234, (*akarmi[0])[0]=0x4321={10,20,30}
+ *
+ * pointer, pointer, basic:	   waspointer && !isarray
+ *	int **akarmi
+ *	    **akarmi
+ *  akarmi=0x1234, *akarmi=0x4321, **akarmi=10
+ * pointer, pointer, array, basic:
+ *	int (**akarmi)[5]
+ *	     **akarmi
+ *  akarmi=0x1234, *akarmi=0x4321, **akarmi=0x1441={10,20,30}
+ * pointer, pointer, array, array, basic:
+ *	int (**akarmi)[5][5]
+ *	    (**akarmi)[0]
+ *  akarmi=0x1234, *akarmi=0x4321, (**akarmi)[0]=0x1441={10,20,30}
+ *
+ * pointer, array, pointer, basic: waspointer &&  isarray
+ *	int *(*akarmi)[5]
+ *	    *(*akarmi)[0]
+ *  akarmi=0x1234, *akarmi=0x4321, *(*akarmi)[0]=10
+ * pointer, array, pointer, array, basic:
+ *	int (*(*akarmi)[5])[5]
+ *	     *(*akarmi)[0]
+ *  akarmi=0x1234, *akarmi=0x4321, *(*akarmi)[0]=0x1441={10,20,30}
+ * }}}
+ */
+static char const *decodevar(Dwarf_Die *var, char const *id,
+	void const *addr, struct dso_st const *dso)
+{
+	static __thread struct bufhead_st name, line;
+	unsigned i;
+	Dwarf_Die type;
+	void const *seg;
+	size_t checkpoint;;
+	int waspointer, isarray;
+	Dwarf_Word encoding, size, nelems;
+
+	/* Initialize $name and $line. */
+	name.n = line.n = 0;
+	if (!addstr(&name, id))
+		goto done;
+
+	/* Dereference $addr until its $type is something basic we can
+	 * decode and print in `basic'. */
+	type = *var;
+	seg = NULL;
+	waspointer = isarray = 0;
+	nelems  = 1;
+	for (;;)
+	{
+		Dwarf_Attribute attr;
+
+		/*
+		 * $addr is an address and it always points to data,
+		 * which can be a pointer, which will become $addr
+		 * in the next iteration.  See what kind of data
+		 * does $addr point to.
+		 */
+		if (!dwarf_attr(&type, DW_AT_type, &attr))
+			goto done;
+		if (dwarf_whatform(&attr) != DW_FORM_ref4)
+			goto done;
+		dwarf_formref_die(&attr, &type);
+
+		switch (dwarf_tag(&type))
+		{
+		case DW_TAG_typedef:
+		case DW_TAG_const_type:
+		case DW_TAG_volatile_type:
+			/* Simply ignore qualifiers and aliases. */
+			continue;
+		default: /* Unrecognized. */
+			goto done;
+
+		/* These are the only data type we're concerned with. */
+		case DW_TAG_array_type:
+		{	/* $addr points to an array of somethings. */
+			Dwarf_Die range;
+
+			/* If we have an array of array of somethings
+			 * denote that we will only print the first
+			 * element of the preceeding array. */
+			if (isarray)
+			{
+				if (waspointer)
+				{	// *akarmi => (*akarmi)[0]
+					if (!insstr(&name, "("))
+						goto done;
+					if (!addstr(&name, ")"))
+						goto done;
+				} // else   akarmi =>   akarmi[0]
+				if (!addstr(&name, "[0]"))
+					goto done;
+			}
+
+			/* Figure out the number of elements in the array. */
+			isarray = 1;
+			nelems  = 1;
+			if (dwarf_child(&type, &range) != 0)
+				continue;
+			if (dwarf_tag(&range) != DW_TAG_subrange_type)
+				continue;
+			if (!dwarf_attr(&range, DW_AT_upper_bound, &attr))
+				continue;
+			dwarf_formudata(&attr, &nelems);
+			nelems++;
+			continue;
+		} /* $addr points to an array */
+
+		case DW_TAG_pointer_type:
+		case DW_TAG_base_type:
+			/* $addr points to a pointer or basic type data */
+			if (!dwarf_attr(&type, DW_AT_byte_size, &attr))
+				goto done;
+			dwarf_formudata(&attr, &size);
+			break;
+		} /* switch data type */
+
+		/* Validate $addr if it was derived from a pointer.
+		 * Otherwise we can assume the compiler placed the
+		 * data in some allocated area. */
+		if (waspointer)
+		{
+			switch (addr_is(dso, addr, &seg))
+			{
+			case STACK:
+			case HEAP:
+			case DATA:
+				if (addr + size*nelems < seg)
+					break;
+				/* $nelems may be too large,
+				 * try to reduce it. */
+				if ((nelems = (seg - addr) / size) > 0)
+					break;
+				/* Not even 1 $nelems of this $size
+				 * can fit in $seg. */
+			default:
+				goto done;
+			}
+		} /* if $addr was a pointer or array */
+
+		/* See what to do about $addr. */
+		switch (dwarf_tag(&type))
+		{
+		case DW_TAG_base_type:
+			/* Decode and print what $addr points to. */
+			dwarf_attr(&type, DW_AT_encoding, &attr);
+			dwarf_formudata(&attr, &encoding);
+			goto basic;
+		case DW_TAG_pointer_type:
+			if (size != sizeof(void *))
+			{	/* Non-word-size pointer. */
+				encoding = DW_ATE_address;
+				goto basic;
+			}
+
+			/* Print the pointer(s). */
+			if (!print_pointer(&line, &name, addr,
+					waspointer, isarray, nelems))
+				goto done;
+
+			/* Transform $name such that it can be used
+			 * for basic type data. */
+			if (!isarray || !waspointer)
+			{
+				if (!insstr(&name, "*"))
+					goto done;
+				if (isarray && !addstr(&name, "[0]"))
+					goto done;
+			} else	/* isarray && waspointer */
+			{	// *akarmi => *(*akarmi)[0]
+				if (!insstr(&name, "*("))
+					goto done;
+				if (!addstr(&name, ")[0]"))
+					goto done;
+			}
+
+			addr = *(void **)addr;
+			waspointer = 1;
+			isarray = 0;
+			nelems  = 1;
+			break;
+		} /* switch */
+	} /* for indirection levels */
+
+basic:	/* Decode and print what $addr points to. */
+	checkpoint = line.n;
+	if ((encoding == DW_ATE_signed_char
+			|| encoding == DW_ATE_unsigned_char)
+		&& (waspointer || isarray))
+	{	/* String ("hihihi") or byte array (0x102030) */
+		int isbinary;
+		unsigned len;
+		char const *str;
+
+		if (!addfmt(&line, isarray ? "%s%s=%p=" : "%s%s=",
+				waspointer ? ", " : "", name.buf, addr))
+			goto done;
+
+		/* Determine $len. */
+		str = addr;
+		isbinary = 0;
+		for (len = 0; ; len++)
+		{
+			if (waspointer && &str[len] >= (char *)seg)
+				break;
+			if (isarray && len >= nelems)
+				break;
+			if (len >= Max_string || !str[len])
+				break;
+			if (!isprint(str[len]))
+			{
+				if (len >= Max_array)
+					/* Print as $len-length string. */
+					break;
+				isbinary = 1;
+				if (!isarray)
+					break;
+				len = nelems <= Max_array
+					? nelems : Max_array;
+				break;
+			}
+		} /* for characters of $str */
+
+		if (isbinary)
+		{
+			addstr(&line, "0x");
+			for (i = 0; i < len; i++)
+				addfmt(&line, "%.2x",
+					(unsigned char)str[i]);
+			if (isarray && nelems > len)
+				addstr(&line, "...");
+		} else if (isarray && nelems > len)
+			addfmt(&line, "\"%.*s\"...", len, str);
+		else
+			addfmt(&line, "\"%.*s\"",    len, str);
+	} else	/* (Arrays of) Integers or floats, */
+	{	/* or single characters or bytes.  */
+		if (!addfmt(&line, isarray ? "%s%s=%p={" : "%s%s=",
+				waspointer ? ", " : "", name.buf, addr))
+			goto done;
+		if (!print_basic(&line, addr, encoding, size))
+		{	/* Either we don't know how to print $encoding/$size
+			 * or we are out of memory. */
+			rollback(&line, checkpoint);
+			goto done;
+		}
+
+		for (i = 1; i < nelems && i < Max_array; i++, addr += size)
+		{
+			checkpoint = line.n;
+			if (!addstr(&line, ", "))
+				break;
+			if (!print_basic(&line, addr, encoding, size))
+			{
+				rollback(&line, checkpoint);
+				break;
+			}
+		} /* for nelems */
+		if (isarray)
+			addstr(&line, i < nelems ? ", ...}" : "}");
+	}
+done:	return line.n ? line.buf : NULL;
+} /* decodevar */
+
+/* Determine the address of $var, decode and print its value. */
+static void printvar(Dwarf_Die *var, struct dso_st const *dso,
+	void const *pc, void const *fp)
+{
+	size_t nloc;
+	Dwarf_Op *loc;
+	void const *addr;
+	Dwarf_Attribute attr;
+	char const *str;
+
+	/* Set $Max_array and $Max_string from the environment
+	 * if we haven't. */
+	if (!Max_array)
+	{
+		char const *env;
+
+		Max_array  = (env = getenv("ARF_MAXARRAY"))  != NULL
+			? atoi(env) : DFLT_MAXARRAY;
+		Max_string = (env = getenv("ARF_MAXSTRING")) != NULL
+			? atoi(env) : DFLT_MAXSTRING;
+	}
+
+	/* Determine the address of the variable. */
+	if (!dwarf_attr_integrate(var, DW_AT_location, &attr))
+		return;
+	if (dwarf_getlocation_addr(&attr, pc-dso->base, &loc, &nloc, 1) != 1)
+		return;
+	if (nloc != 1)
+		return;
+
+	/* 3 is the charm and 1 is the free giveaway. */
+#ifdef __i386__
+	fp += 8;
+#endif
+#ifdef __arm__
+	fp += 4;
+#endif
+#ifdef __x86_64__
+	fp += 16;
+#endif
+
+	if (loc->atom == DW_OP_fbreg)
+		addr = fp        + loc->number;
+	else if (loc->atom == DW_OP_addr)
+		addr = dso->base + loc->number;
+	else	/* We don't track registers. */
+		return;
+
+	/* Decode and print it unless we've seen it in this backtrace. */
+	if (seen(addr))
+		return;
+	if ((str = decodevar(var, dwarf_diename(var), addr, dso)) != NULL)
+		LOGIT("      %s" NL, str);
+} /* printvar */
+
+/* Find all variables visible in $fun at $pc and print them. */
+static void printvars(Dwarf_Die *fun, struct dso_st const *dso,
+	void const *pc, void const *fp)
+{
+	Dwarf_Die var;
+
+	if (dwarf_child(fun, &var) != 0)
+		return;
+	do
+	{
+		switch (dwarf_tag(&var))
+		{
+		case DW_TAG_variable:
+		case DW_TAG_formal_parameter:
+			printvar(&var, dso, pc, fp);
+			break;
+		case DW_TAG_lexical_block:
+			printvars(&var, dso, pc, fp);
+			break;
+		}
+	} while (dwarf_siblingof(&var, &var) == 0);
+} /* printvars */
+#endif /* CONFIG_PRINTVARS */
+/* printvars() }}} */
+
+/* The engine: getting debug information about stack frames {{{ */
+/* Set $cs->location from the $cufile of the call site and the $header
+ * file and $lineno of the call in it. */
+static void set_location(struct callsite_st *cs,
+	char const *cufile, char const *header, int lineno)
+{
+	char const *fmt;
+
+	if (cufile && header && !strcmp(cufile, header))
+		cufile = NULL;
+	if (!cufile && !header)
+		return;
+	if (!header || lineno <= 0)
+		lineno = 0;
+
+	/* Add $cufile and $header to $Location then return them
+	 * as $cs->location. */
+	if (cufile && header && lineno)
+		fmt = "%s %s:%u";
+	else if (cufile && header)
+		fmt = "%s %s";
+	else if (cufile)
+		fmt = "%s";
+	else if (header && lineno)
+		fmt = "%.0s%s:%u";
+	else /* header */
+		fmt = "%.0s%s";
+
+	Location.n = 0;
+	if (addfmt(&Location, fmt, cufile, header, lineno))
+		cs->location = Location.buf;
+} /* set_location */
+
+#ifdef CONFIG_PRINTVARS
+/* Only printvars() needs the scopes, otherwise bt1_indexed() finds
+ * the call sites faster. */
+
+/* Search $parent's children recursively for subroutines containing $pc.
+ * This may find subprograms dwarf_getscopes() wouldn't in case the
+ * subprogram is nested in another one by scope but not by pc range. */
+static int search_scopes(Dwarf_Die **scopesp, int *nscopesp,
+	Dwarf_Die *parent, Dwarf_Addr pc)
+{
+	unsigned depth;
+	Dwarf_Die child;
+
+	if (dwarf_child(parent, &child) != 0)
+		return 0;
+	depth = (*nscopesp)++;
+
+	do
+	{
+		Dwarf_Addr addr;
+		Dwarf_Attribute attr;
+
+		if (dwarf_tag(&child) != DW_TAG_subprogram)
+			continue;
+
+		if (search_scopes(scopesp, nscopesp, &child, pc))
+		{
+			if (*scopesp)
+				(*scopesp)[depth] = *parent;
+			return 1;
+		}
+
+		if (!dwarf_attr(&child, DW_AT_low_pc, &attr))
+			continue;
+		if (dwarf_formaddr(&attr, &addr) != 0)
+			continue;
+		if (pc < addr)
+			continue;
+
+		if (!dwarf_attr(&child, DW_AT_high_pc, &attr))
+			continue;
+		if (dwarf_formaddr(&attr, &addr) != 0)
+			continue;
+		if (pc > addr)
+			continue;
+
+		*scopesp = malloc(sizeof(**scopesp) * *nscopesp);
+		if (*scopesp)
+			(*scopesp)[depth] = child;
+		return 1;
+	} while (dwarf_siblingof(&child, &child) == 0);
+	(*nscopesp)--;
+
+	return 0;
+} /* search_scopes */
+
+/* Like dwarf_getscopes(), but if that fails try search_scopes(). */
+static int get_scopes(Dwarf_Die *die, Dwarf_Addr pc, Dwarf_Die **scopesp)
+{
+	int n;
+
+	/* Reset libdw's errno first, because getsopes() may fail
+	 * in case of earlier errors. */
+	dwarf_errno();
+	*scopesp = NULL;
+	if ((n = dwarf_getscopes(die, pc, scopesp)) > 0)
+		return n;
+	else if (search_scopes(scopesp, &n, die, pc) && *scopesp)
+		return n;
+	else
+		return 0;
+} /* get_scopes */
+
+/* Fill $cs for a $relpc relocated program counter.
+ * The caller must hold $Lock for writing. */
+static void bt1(struct callsite_st *cs, void const *relpc)
+{
+	int i, lineno;
+	Dwarf_Die die;
+	Dwarf_Addr pc;
+	Dwarf_Line *line;
+	char const *cufile, *header;
+
+	memset(cs, 0, sizeof(*cs));
+	if (!(cs->dso = getdso(relpc)))
+		return;
+	load_debug((struct dso_st *)cs->dso);
+	if (!cs->dso->dr)
+		return;
+
+	/* pc := relocation-free $relpc. */
+	pc = relpc-cs->dso->base;
+	if (!dwarf_addrdie(cs->dso->dr, pc, &die))
+		return;
+
+	/* Get the name of the caller function and the name of the
+	 * compilation unit (the C source file). */
+	cufile = NULL;
+	cs->nscopes = get_scopes(&die, pc, &cs->scopes);
+	for (i = 0; i < cs->nscopes; i++)
+	{
+		int tag;
+		Dwarf_Attribute attr;
+
+		tag = dwarf_tag(&cs->scopes[i]);
+		if (tag == DW_TAG_subprogram)
+			subprogram_name(&cs->scopes[i], &cs->funame, &cs->cls);
+		else if (tag == DW_TAG_compile_unit
+				&& dwarf_attr(&cs->scopes[i], DW_AT_name, &attr))
+			cufile = trim(dwarf_formstring(&attr));
+	}
+
+	/*
+	 * Get $header and $lineno (the file and line address which
+	 * actually made the call).  $header may be different from
+	 * $cufile if the call was actually made in a function
+	 * defined in a header.
+	 */
+	line = dwarf_getsrc_die(&die, pc-1);
+	header = trim(dwarf_linesrc(line, NULL, NULL));
+	if (!header || dwarf_lineno(line, &lineno) != 0)
+		lineno = 0;
+	set_location(cs, cufile, header, lineno);
+} /* bt1 */
+#endif /* CONFIG_PRINTVARS */
+
+/* Like bt1(), but look up $relpc in the index of its DSO,
+ * and don't return $cs->scopes.  Needs $Lock like bt1(). */
+static void bt1_indexed(struct callsite_st *cs, void const *relpc)
+{
+	int lineno;
+	Dwarf_Addr pc;
+	char const *cufile, *header;
+	struct func_st const *func;
+
+	memset(cs, 0, sizeof(*cs));
+	if (!(cs->dso = getdso(relpc)))
+		return;
+	load_debug((struct dso_st *)cs->dso);
+
+	/* Even if we don't know the function we may know the line. */
+	pc = relpc-cs->dso->base;
+	cufile = NULL;
+	if ((func = find_func(cs->dso, pc)) != NULL)
+	{
+		cs->funame = get_string(cs->dso, func->funame);
+		cs->cls    = get_string(cs->dso, func->cls);
+		cufile     = trim(get_string(cs->dso, func->cufile));
+	}
+
+	lineno = 0;
+	header = trim(find_line(cs->dso, pc-1, &lineno));
+	set_location(cs, cufile, header, lineno);
+} /* bt1_indexed */
+
+/* Drop all cached callsites. */
+static void forget_callsites(void)
+{
+	unsigned i;
+	struct cached_callsite_st *ccs, *next;
+
+	if (!Callsites)
+		return;
+
+	for (i = 0; i < 1u << Callsites_bits; i++)
+		for (ccs = Callsites[i]; ccs; ccs = next)
+		{
+			next = ccs->next;
+			free((char *)ccs->cs.location);
+			free(ccs);
+		}
+	free(Callsites);
+	Callsites = NULL;
+	Callsites_bits = NCallsites = 0;
+} /* forget_callsites */
+
+/* dl_iterate_phdr() callback of check_dl_subs() to get the number of
+ * objects loaded and unloaded so far in $counters[0] and [1], or leave
+ * them ~0 if the glibc is too old to tell. */
+static int get_dl_counters(struct dl_phdr_info *info, size_t size,
+	void *counters)
+{
+	/* dlpi_subs is only provided by newer glibcs. */
+	if (size >= offsetof(struct dl_phdr_info, dlpi_subs)
+			+ sizeof(info->dlpi_subs))
+	{
+		((unsigned long long *)counters)[0] = info->dlpi_adds;
+		((unsigned long long *)counters)[1] = info->dlpi_subs;
+	}
+
+	/* Every object has the same counters. */
+	return 1;
+} /* get_dl_counters */
+
+/* forget_callsites() if anything has been dlclose()d, and reload
+ * $Loaded if anything has changed.  The lock is only taken after
+ * dl_iterate_phdr(), because load_segments() calls it under the lock. */
+static void check_dl_subs(void)
+{
+	int locked, changed;
+	unsigned long long counters[2] = { ~0ull, ~0ull };
+
+	dl_iterate_phdr(get_dl_counters, counters);
+
+	locked = rdlock();
+	changed = counters[0] != Dl_adds || counters[1] != Dl_subs;
+	unlock(locked);
+	if (!changed)
+		return;
+
+	locked = wrlock();
+	if (counters[1] != Dl_subs)
+	{
+		forget_callsites();
+		Dl_subs = counters[1];
+		Loaded_stale = 1;
+#ifdef CONFIG_FAST_UNWIND
+		/* Code may have been unmapped, not only gaps filled. */
+		Maps.n = 0;
+#endif
+	}
+	if (counters[0] != Dl_adds)
+	{
+		Dl_adds = counters[0];
+		Loaded_stale = 1;
+	}
+	unlock(locked);
+} /* check_dl_subs */
+
+/* Return the bucket of $pc in $Callsites of $bits. */
+static struct cached_callsite_st **callsite_bucket(
+	struct cached_callsite_st **callsites, unsigned bits, void const *pc)
+{
+	return &callsites[((uintptr_t)pc * GOLDEN_RATIO)
+		>> (sizeof(uintptr_t)*8 - bits)];
+} /* callsite_bucket */
+
+/* Look up $pc in $Callsites and copy it to $cs if it's there.  The
+ * $cs->location is copied to $Location.  Returns whether it's found. */
+static int find_callsite(struct callsite_st *cs, void const *pc)
+{
+	struct cached_callsite_st const *ccs;
+
+	if (!Callsites)
+		return 0;
+	for (ccs = *callsite_bucket(Callsites, Callsites_bits, pc);
+		ccs; ccs = ccs->next)
+		if (ccs->pc == pc)
+		{
+			*cs = ccs->cs;
+			if (cs->location)
+			{
+				Location.n = 0;
+				cs->location = addfmt(&Location, "%s",
+					cs->location) ? Location.buf : NULL;
+			}
+			return 1;
+		}
+
+	return 0;
+} /* find_callsite */
+
+/* bt1_cached() for a $pc not in $Callsites yet, holding $Lock for writing:
+ * look it up and add it. */
+static void add_callsite(struct callsite_st *cs, void const *pc)
+{
+	struct cached_callsite_st *ccs, **bucket;
+
+	bt1_indexed(cs, pc);
+	cs->scopes = NULL;
+	cs->nscopes = 0;
+
+	/* Make room for more, keeping the chains short. */
+	if (!Callsites || NCallsites >= 1u << Callsites_bits)
+	{
+		unsigned newbits, i;
+		struct cached_callsite_st **newsites;
+
+		newbits = Callsites ? Callsites_bits + 1 : 10;
+		if (!(newsites = calloc(1u << newbits, sizeof(*newsites))))
+			return;
+		for (i = 0; Callsites && i < 1u << Callsites_bits; i++)
+			while ((ccs = Callsites[i]) != NULL)
+			{
+				Callsites[i] = ccs->next;
+				bucket = callsite_bucket(newsites, newbits,
+					ccs->pc);
+				ccs->next = *bucket;
+				*bucket = ccs;
+			}
+		free(Callsites);
+		Callsites = newsites;
+		Callsites_bits = newbits;
+	}
+
+	/* $cs->location is in $Location, which is reused. */
+	if (!(ccs = malloc(sizeof(*ccs))))
+		return;
+	ccs->pc = pc;
+	ccs->cs = *cs;
+	if (cs->location && !(ccs->cs.location = strdup(cs->location)))
+	{
+		free(ccs);
+		return;
+	}
+
+	bucket = callsite_bucket(Callsites, Callsites_bits, pc);
+	ccs->next = *bucket;
+	*bucket = ccs;
+	NCallsites++;
+} /* add_callsite */
+
+/* Like bt1() but look up $pc in $Callsites first and remember what we
+ * find.  Doesn't return $cs->scopes. */
+static void bt1_cached(struct callsite_st *cs, void const *pc)
+{
+	int locked;
+
+	/* Most of the time it's there. */
+	locked = rdlock();
+	if (find_callsite(cs, pc))
+	{
+		unlock(locked);
+		return;
+	}
+
+	/* Maybe some other thread has added it by the time
+	 * we have the lock for writing. */
+	if (!Locked)
+	{
+		unlock(locked);
+		locked = wrlock();
+		if (find_callsite(cs, pc))
+		{
+			unlock(locked);
+			return;
+		}
+	}
+
+	add_callsite(cs, pc);
+	unlock(locked);
+} /* bt1_cached */
+
+/* Print information about the i:th frame, which is executing $pc. */
+static void bt0(unsigned i, void const *pc, void const *fp)
+{
+	static __thread unsigned wcol1, wcol2;
+	char const *fmt;
+	struct callsite_st cs;
+	int st1, ed1, st2, ed2, len;
+#ifdef CONFIG_PRINTVARS
+	static int wantsvars = -1;
+	char const *env;
+	int locked = 0;
+#endif
+
+	if (i < 1)
+		return;
+	if (i == 1)
+		/* New backtrace, has anything been unloaded since the last? */
+		check_dl_subs();
+
+	/*
+	 * Align cs.dso->fname, .location and .funame in columns.
+	 * The olumns are $wcol[12] chararacter wide.  If the columns
+	 * are wider than that update them so the subsequent lines
+	 * will be aligned at least.
+	 */
+#ifdef CONFIG_PRINTVARS
+	/* printvars() needs the scopes, which are not cached. */
+	if (wantsvars < 0)
+		wantsvars = (env = getenv("ARF_PRINTVARS"))
+			&& atoi(env) > 0;
+	if (wantsvars && fp != NULL)
+	{	/* Keep libdw to ourselves until we're done with $cs. */
+		locked = wrlock();
+		bt1(&cs, pc);
+	} else
+#endif
+		bt1_cached(&cs, pc);
+	if (!cs.funame && !cs.cls)
+		fmt = "%4d. %n%*s%n %n%*s%n [%.0s%.0s%p]" NL;
+	else if (cs.funame && !cs.cls)
+		fmt = "%4d. %n%*s%n %n%*s%n %.0s%s()"     NL;
+	else if (!cs.funame && cs.cls)
+		/* c++filt adds "()" itself */
+		fmt = "%4d. %n%*s%n %n%*s%n %s"           NL;
+	else
+		fmt = "%4d. %n%*s%n %n%*s%n %s::%s()"     NL;
+	LOGIT(fmt, i,
+		&st1, -wcol1, cs.dso && cs.dso->fname
+			? cs.dso->fname : "", &ed1,
+		&st2, -wcol2, cs.location ? : "", &ed2,
+		cs.cls, cs.funame, pc);
+	if (wcol1 < (len = ed1 - st1))
+		wcol1 = len;
+	if (wcol2 < (len = ed2 - st2))
+		wcol2 = len;
+
+	if (cs.nscopes > 0)
+	{
+#ifdef CONFIG_PRINTVARS
+		if (wantsvars && fp != NULL)
+			for (i = 0; i < cs.nscopes; i++)
+				printvars(&cs.scopes[i], cs.dso, pc, fp);
+#endif /* CONFIG_PRINTVARS */
+		free(cs.scopes);
+	}
+#ifdef CONFIG_PRINTVARS
+	unlock(locked);
+#endif
+} /* bt0 */
+/* Engine }}} */
+
+/* The driver: getting the return addresses {{{ */
+#if (defined(CONFIG_FAST_UNWIND) \
+		&& (defined(__x86_64__) || defined(__aarch64__))) \
+	|| defined(CONFIG_CFI_UNWIND)
+/* Return the boundaries of the calling thread's stack in $lop and $hip.
+ * They are looked up only once per thread, so it's much cheaper than
+ * asking addr_is() about every frame.  Returns whether it could. */
+static int stack_bounds(void const **lop, void const **hip)
+{
+	static __thread void const *lo, *hi;
+
+	if (!hi)
+	{
+		void *addr;
+		size_t size;
+		pthread_attr_t attr;
+
+		if (pthread_getattr_np(pthread_self(), &attr) != 0)
+			return 0;
+		if (pthread_attr_getstack(&attr, &addr, &size) != 0)
+			size = 0;
+		pthread_attr_destroy(&attr);
+		if (!size)
+			return 0;
+
+		lo = addr;
+		hi = (char const *)addr + size;
+	}
+
+	*lop = lo;
+	*hip = hi;
+	return 1;
+} /* stack_bounds */
+#endif
+
+#ifdef CONFIG_FAST_UNWIND /* {{{ */
+/* Unwind the stack by examining the frame manually. */
+
+#ifdef __arm__
+/* These are used by getlr() to examine instructions. */
+# undef R12
+# define PUSH			0xE92D0000
+# define FP			(1 << 11)
+# define R12			(1 << 12)
+# define SP			(1 << 13)
+# define LR			(1 << 14)
+# define PC			(1 << 15)
+#endif
+
+/* Extract the return address from the frame pointed to by $fp.
+ * $prev_ssegp is used for state recording during unwinding and
+ * should point to NULL on the first invocation. */
+static void const *const *getlr(void const *const *fp, void const **lrp,
+	void const **prev_ssegp)
+{
+	void const *sseg;
+	void const *const *next;
+
+	DEEPSHIT("FP=%p", fp);
+	if (fp == NULL)
+	{	/* Caller should have stopped unwinding. */
+		FAIL("%p: NULL", fp);
+		return NULL;
+	}
+
+#if defined(__arm__) /* {{{ */
+	if (addr_is(NULL, fp[0], NULL) != CODE)
+	{	/* *fp must be either lr or pc, we're probably in
+		 * a noreturn function like _dl_signal_error(). */
+		FAIL("%p: NOT CODE: %p", fp, fp[0]);
+		return NULL;
+	}
+
+	switch (addr_is(NULL, fp[-1], &sseg))
+	{
+	case STACK:
+	{	/* fp|sp, lr */
+		/* Verify that fp|sp is in the same segment as before.
+		 * This is used to detect clone() boundaries. */
+		if (!*prev_ssegp)
+			*prev_ssegp = sseg;
+		else if (*prev_ssegp != sseg)
+		{
+			FAIL("%p: DIFFERENT SSEG", fp);
+			return NULL;
+		}
+
+		*lrp = fp[0];
+		if (fp[-1] != fp+1)
+			/* fp,     lr */
+			next = fp[-1];
+		else	/* fp, sp, lr */
+			next = fp[-2];
+		break;
+	}
+
+	case CODE:
+	{	/* fp, [r12, sp], lr, pc */
+		unsigned insn, i;
+
+		*lrp = fp[-1];
+
+		/*
+		 * *fp points to pc.  If the registers were push:ed
+		 * *$pc must be a PUSH instruction.  Examine it to see
+		 * what registers were PUSH:ed to determine where the
+		 * $next fp is.
+		 */
+		insn = *(unsigned *)(fp[0]-8);
+		if ((insn & 0xFFFF0000) != PUSH)
+		{	/* $insn is not a PUSH instruction. */
+			FAIL("%p: NOT PUSH: *%p=0x%x", fp, fp[0]-8, insn);
+			return NULL;
+		} else if ((insn & (FP|LR|PC)) != (FP|LR|PC))
+		{	/* Either fp, lr or pc wasn't pushed. */
+			FAIL("%p: NOT EXPECTED PUSH: *%p=0x%x",
+				fp, fp[0]-8, insn);
+			return NULL;
+		}
+
+		i = -2;
+		if (insn & SP)
+			i--;
+		if (insn & R12)
+			i--;
+		next = fp[i];
+		break;
+	}
+
+	default:
+		if (fp[-1] != NULL)
+			FAIL("%p: OTHER: %p", fp, fp[-1]);
+		return NULL;
+	} /* switch what fp[-1] is */
+	/* }}} */
+#elif defined(__i386__) /* {{{ */
+	/* Assume ip, prev_bp (<- bp). */
+	if (!fp[0])
+	{	/* Reached the bottom. */
+		return NULL;
+	} else if (addr_is(NULL, fp[0], &sseg) != STACK)
+	{
+		FAIL("%p: NOT STACK: %p", fp, fp[0]);
+		return NULL;
+	} else if (!*prev_ssegp)
+	{
+		*prev_ssegp = sseg;
+	} else if (*prev_ssegp != sseg)
+	{
+		FAIL("%p: DIFFERENT SSEG: %p != %p", fp, sseg, *prev_ssegp);
+		return NULL;
+	}
+
+	if (addr_is(NULL, fp[1], NULL) != CODE)
+	{
+		FAIL("%p: NOT CODE: %p", fp, fp[1]);
+		return NULL;
+	} else
+	{
+		next = fp[0];
+		*lrp = fp[1];
+	}
+	/* }}} */
+#elif defined(__x86_64__) || defined(__aarch64__) /* {{{ */
+	void const *lo, *hi;
+
+	/* Assume prev_fp, lr (<- fp), which is the frame record
+	 * of both architectures. */
+	if (!stack_bounds(&lo, &hi))
+	{	/* Find out the hard way. */
+		if (!fp[0])
+			return NULL;
+		if (addr_is(NULL, fp[0], &sseg) != STACK)
+		{
+			FAIL("%p: NOT STACK: %p", fp, fp[0]);
+			return NULL;
+		} else if (!*prev_ssegp)
+		{
+			*prev_ssegp = sseg;
+		} else if (*prev_ssegp != sseg)
+		{
+			FAIL("%p: DIFFERENT SSEG: %p != %p",
+				fp, sseg, *prev_ssegp);
+			return NULL;
+		}
+	} else if (!fp[0])
+	{	/* Reached the bottom. */
+		return NULL;
+	} else if (fp[0] < lo || (void const *)((char const *)fp[0]
+			+ 2*sizeof(*fp)) > hi
+		|| (uintptr_t)fp[0] % sizeof(*fp))
+	{	/* Not a frame pointer, the caller was compiled
+		 * without them, or we crossed a signal stack. */
+		FAIL("%p: NOT STACK: %p", fp, fp[0]);
+		return NULL;
+	}
+
+	if (!fp[1])
+	{
+		FAIL("%p: NULL LR", fp);
+		return NULL;
+	}
+
+	next = fp[0];
+	*lrp = fp[1];
+# ifdef __aarch64__
+	/* Strip the pointer authentication code. */
+	*lrp = (void const *)((uintptr_t)*lrp & 0x0000FFFFFFFFFFFFUL);
+# endif
+#endif /* __x86_64__ || __aarch64__ }}} */
+
+	/* Is $next valid after all? */
+	DEEPSHIT("NEXT=%p", next);
+	if (__builtin_expect(next == fp, 0))
+	{	/* Something fishy is going on. */
+		FAIL("%p: SAME FRAME", fp);
+		return NULL;
+	} else if (__builtin_expect(next < fp, 0))
+	{	/* The stack is supposed to _grow_ down. */
+		FAIL("%p: WRONG DIRECTION", fp);
+		return NULL;
+	} else
+		return next;
+} /* getlr */
+#endif /* CONFIG_FAST_UNWIND }}} */
+
+#ifdef CONFIG_CFI_UNWIND /* {{{ */
+/*
+ * Unwind the stack with the call frame information the compiler left
+ * in .eh_frame for exception handling, like backtrace() does, but the
+ * rule decoded for a PC is remembered in $Cfi_rules, so unwinding the
+ * same stack again only costs a lookup per frame.  Only the rules of
+ * the CFA, the return address and the frame pointer are tracked,
+ * because we don't need any other register to find the next frame.
+ */
 
-		/* These are the only data type we're concerned with. */
-		case DW_TAG_array_type:
-		{	/* $addr points to an array of somethings. */
-			Dwarf_Die range;
+/* DWARF register numbers */
+#ifdef __x86_64__
+# define CFI_FP			6	/* %rbp */
+# define CFI_SP			7	/* %rsp */
+#else /* __aarch64__ */
+# define CFI_FP			29	/* x29 */
+# define CFI_SP			31	/* sp */
+#endif
 
-			/* If we have an array of array of somethings
-			 * denote that we will only print the first
-			 * element of the preceeding array. */
-			if (isarray)
-			{
-				if (waspointer)
-				{	// *akarmi => (*akarmi)[0]
-					if (!insstr(&name, "("))
-						goto done;
-					if (!addstr(&name, ")"))
-						goto done;
-				} // else   akarmi =>   akarmi[0]
-				if (!addstr(&name, "[0]"))
-					goto done;
-			}
+/* $Cfi_rules has 1 << CFI_CACHE_BITS entries. */
+#define CFI_CACHE_BITS		12
 
-			/* Figure out the number of elements in the array. */
-			isarray = 1;
-			nelems  = 1;
-			if (dwarf_child(&type, &range) != 0)
-				continue;
-			if (dwarf_tag(&range) != DW_TAG_subrange_type)
-				continue;
-			if (!dwarf_attr(&range, DW_AT_upper_bound, &attr))
-				continue;
-			dwarf_formudata(&attr, &nelems);
-			nelems++;
-			continue;
-		} /* $addr points to an array */
+/* How deep DW_CFA_remember_state can nest. */
+#define CFI_STATE_DEPTH		8
 
-		case DW_TAG_pointer_type:
-		case DW_TAG_base_type:
-			/* $addr points to a pointer or basic type data */
-			if (!dwarf_attr(&type, DW_AT_byte_size, &attr))
-				goto done;
-			dwarf_formudata(&attr, &size);
-			break;
-		} /* switch data type */
+/* cached_cfi_st::pc while the rule is being written. */
+#define CFI_BUSY		((void const *)1)
 
-		/* Validate $addr if it was derived from a pointer.
-		 * Otherwise we can assume the compiler placed the
-		 * data in some allocated area. */
-		if (waspointer)
-		{
-			switch (addr_is(dso, addr, &seg))
-			{
-			case STACK:
-			case HEAP:
-			case DATA:
-				if (addr + size*nelems < seg)
-					break;
-				/* $nelems may be too large,
-				 * try to reduce it. */
-				if ((nelems = (seg - addr) / size) > 0)
-					break;
-				/* Not even 1 $nelems of this $size
-				 * can fit in $seg. */
-			default:
-				goto done;
-			}
-		} /* if $addr was a pointer or array */
+/* For cfi_rule_st::cfa */
+enum { CFI_STOP, CFI_CFA_SP, CFI_CFA_FP };
 
-		/* See what to do about $addr. */
-		switch (dwarf_tag(&type))
-		{
-		case DW_TAG_base_type:
-			/* Decode and print what $addr points to. */
-			dwarf_attr(&type, DW_AT_encoding, &attr);
-			dwarf_formudata(&attr, &encoding);
-			goto basic;
-		case DW_TAG_pointer_type:
-			if (size != sizeof(void *))
-			{	/* Non-word-size pointer. */
-				encoding = DW_ATE_address;
-				goto basic;
-			}
+/* How a register can be recovered. */
+enum { CFI_SAME, CFI_SAVED, CFI_LOST };
 
-			/* Print the pointer(s). */
-			if (!print_pointer(&line, &name, addr,
-					waspointer, isarray, nelems))
-				goto done;
+/* How to find the caller's frame from a PC. */
+struct cfi_rule_st
+{
+	/*
+	 * -- cfa:	whether the CFA is $cfa_off bytes from the stack
+	 *		or the frame pointer, or CFI_STOP if we can't or
+	 *		needn't unwind further
+	 * -- ra_off:	where the return address is saved from the CFA
+	 * -- fp:	whether the caller's frame pointer is the SAME,
+	 *		is SAVED at $fp_off from the CFA or is LOST
+	 */
+	int cfa, cfa_off;
+	int ra_off;
+	int fp, fp_off;
+};
 
-			/* Transform $name such that it can be used
-			 * for basic type data. */
-			if (!isarray || !waspointer)
-			{
-				if (!insstr(&name, "*"))
-					goto done;
-				if (isarray && !addstr(&name, "[0]"))
-					goto done;
-			} else	/* isarray && waspointer */
-			{	// *akarmi => *(*akarmi)[0]
-				if (!insstr(&name, "*("))
-					goto done;
-				if (!addstr(&name, ")[0]"))
-					goto done;
-			}
+/* An entry of $Cfi_rules. */
+struct cached_cfi_st
+{
+	void const *pc;
+	struct cfi_rule_st rule;
+};
 
-			addr = *(void **)addr;
-			waspointer = 1;
-			isarray = 0;
-			nelems  = 1;
-			break;
-		} /* switch */
-	} /* for indirection levels */
+/* What a CIE tells about its FDEs. */
+struct cfi_cie_st
+{
+	uintptr_t code_align;
+	intptr_t data_align;
+	unsigned ra_reg;
+};
 
-basic:	/* Decode and print what $addr points to. */
-	checkpoint = line.n;
-	if ((encoding == DW_ATE_signed_char
-			|| encoding == DW_ATE_unsigned_char)
-		&& (waspointer || isarray))
-	{	/* String ("hihihi") or byte array (0x102030) */
-		int isbinary;
-		unsigned len;
-		char const *str;
+/* The rules while running the CFA program.  $cfa_reg is -1 if the CFA
+ * is not a register plus offset, $ra and $fp are CFI_*, or -1 if the
+ * register is undefined. */
+struct cfi_state_st
+{
+	int cfa_reg, ra, fp;
+	intptr_t cfa_off, ra_off, fp_off;
+};
 
-		if (!addfmt(&line, isarray ? "%s%s=%p=" : "%s%s=",
-				waspointer ? ", " : "", name.buf, addr))
-			goto done;
+/* dl_iterate_phdr() callback state of find_eh_frame_hdr(). */
+struct cfi_find_st
+{
+	uintptr_t pc;
+	unsigned char const *hdr;
+};
 
-		/* Determine $len. */
-		str = addr;
-		isbinary = 0;
-		for (len = 0; ; len++)
-		{
-			if (waspointer && &str[len] >= (char *)seg)
-				break;
-			if (isarray && len >= nelems)
-				break;
-			if (len >= Max_string || !str[len])
-				break;
-			if (!isprint(str[len]))
-			{
-				if (len >= Max_array)
-					/* Print as $len-length string. */
-					break;
-				isbinary = 1;
-				if (!isarray)
-					break;
-				len = nelems <= Max_array
-					? nelems : Max_array;
-				break;
-			}
-		} /* for characters of $str */
+/*
+ * The rules cfi_rule() has decoded, in a direct-mapped cache keyed by
+ * the PC.  Lookups don't take locks: the $pc of an entry is only set
+ * after its rule has been written, and is CFI_BUSY in the meantime.
+ * The rules of unloaded objects could be taken for those of objects
+ * loaded at the same address later, so the cache is emptied when
+ * dlclose() has been called since $Cfi_dlcloses, checked for every
+ * backtrace, or on a miss if the dynamic linker has unloaded objects
+ * since $Cfi_subs.  $Dlcloses counts the dlclose()s.
+ */
+static struct cached_cfi_st Cfi_rules[1 << CFI_CACHE_BITS];
+static unsigned long long Cfi_subs;
+static unsigned Cfi_dlcloses, Dlcloses;
 
-		if (isbinary)
-		{
-			addstr(&line, "0x");
-			for (i = 0; i < len; i++)
-				addfmt(&line, "%.2x",
-					(unsigned char)str[i]);
-			if (isarray && nelems > len)
-				addstr(&line, "...");
-		} else if (isarray && nelems > len)
-			addfmt(&line, "\"%.*s\"...", len, str);
-		else
-			addfmt(&line, "\"%.*s\"",    len, str);
-	} else	/* (Arrays of) Integers or floats, */
-	{	/* or single characters or bytes.  */
-		if (!addfmt(&line, isarray ? "%s%s=%p={" : "%s%s=",
-				waspointer ? ", " : "", name.buf, addr))
-			goto done;
-		if (!print_basic(&line, addr, encoding, size))
-		{	/* Either we don't know how to print $encoding/$size
-			 * or we are out of memory. */
-			rollback(&line, checkpoint);
-			goto done;
-		}
+/* Read an unsigned LEB128 number at *$pp and advance it. */
+static uintptr_t uleb128(unsigned char const **pp)
+{
+	unsigned shift;
+	uintptr_t val;
+	unsigned char byte;
 
-		for (i = 1; i < nelems && i < Max_array; i++, addr += size)
-		{
-			checkpoint = line.n;
-			if (!addstr(&line, ", "))
-				break;
-			if (!print_basic(&line, addr, encoding, size))
-			{
-				rollback(&line, checkpoint);
-				break;
-			}
-		} /* for nelems */
-		if (isarray)
-			addstr(&line, i < nelems ? ", ...}" : "}");
-	}
-done:	return line.n ? line.buf : NULL;
-} /* decodevar */
+	val = shift = 0;
+	do
+	{
+		byte = *(*pp)++;
+		if (shift < 8*sizeof(val))
+			val |= (uintptr_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
 
-/* Determine the address of $var, decode and print its value. */
-static void printvar(Dwarf_Die *var, struct dso_st const *dso,
-	void const *pc, void const *fp)
+	return val;
+} /* uleb128 */
+
+/* Likewise for signed LEB128 numbers. */
+static intptr_t sleb128(unsigned char const **pp)
 {
-	size_t nloc;
-	Dwarf_Op *loc;
-	void const *addr;
-	Dwarf_Attribute attr;
-	char const *str;
+	unsigned shift;
+	uintptr_t val;
+	unsigned char byte;
 
-	/* Set $Max_array and $Max_string from the environment
-	 * if we haven't. */
-	if (!Max_array)
+	val = shift = 0;
+	do
 	{
-		char const *env;
+		byte = *(*pp)++;
+		if (shift < 8*sizeof(val))
+			val |= (uintptr_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	if (shift < 8*sizeof(val) && (byte & 0x40))
+		val |= -((uintptr_t)1 << shift);
+	return val;
+} /* sleb128 */
+
+/* Read a DW_EH_PE_* $enc:oded pointer at *$pp into *$valp and advance
+ * *$pp.  $datarel is the base of DW_EH_PE_datarel pointers.  Indirect
+ * pointers are not followed, the caller needs to do it if it wants.
+ * Returns whether the encoding was understood. */
+static int read_encoded(unsigned char const **pp, unsigned enc,
+	void const *datarel, uintptr_t *valp)
+{
+	uintptr_t val;
+	unsigned char const *p;
 
-		Max_array  = (env = getenv("ARF_MAXARRAY"))  != NULL
-			? atoi(env) : DFLT_MAXARRAY;
-		Max_string = (env = getenv("ARF_MAXSTRING")) != NULL
-			? atoi(env) : DFLT_MAXSTRING;
+	if (enc == DW_EH_PE_omit)
+		return 0;
+
+	p = *pp;
+	switch (enc & 0x0f)
+	{
+	case DW_EH_PE_absptr:
+		memcpy(&val, p, sizeof(val));
+		p += sizeof(val);
+		break;
+	case DW_EH_PE_uleb128:
+		val = uleb128(&p);
+		break;
+	case DW_EH_PE_sleb128:
+		val = sleb128(&p);
+		break;
+	case DW_EH_PE_udata2:
+	{
+		uint16_t u16;
+
+		memcpy(&u16, p, sizeof(u16));
+		p += sizeof(u16);
+		val = u16;
+		break;
+	}
+	case DW_EH_PE_sdata2:
+	{
+		int16_t s16;
+
+		memcpy(&s16, p, sizeof(s16));
+		p += sizeof(s16);
+		val = s16;
+		break;
 	}
+	case DW_EH_PE_udata4:
+	{
+		uint32_t u32;
 
-	/* Determine the address of the variable. */
-	if (!dwarf_attr_integrate(var, DW_AT_location, &attr))
-		return;
-	if (dwarf_getlocation_addr(&attr, pc-dso->base, &loc, &nloc, 1) != 1)
-		return;
-	if (nloc != 1)
-		return;
+		memcpy(&u32, p, sizeof(u32));
+		p += sizeof(u32);
+		val = u32;
+		break;
+	}
+	case DW_EH_PE_sdata4:
+	{
+		int32_t s32;
+
+		memcpy(&s32, p, sizeof(s32));
+		p += sizeof(s32);
+		val = s32;
+		break;
+	}
+	case DW_EH_PE_udata8:
+	case DW_EH_PE_sdata8:
+	{
+		uint64_t u64;
+
+		memcpy(&u64, p, sizeof(u64));
+		p += sizeof(u64);
+		val = u64;
+		break;
+	}
+	default:
+		FAIL("unknown pointer encoding 0x%x", enc);
+		return 0;
+	}
+
+	switch (enc & 0x70)
+	{
+	case DW_EH_PE_absptr:
+		break;
+	case DW_EH_PE_pcrel:
+		val += (uintptr_t)*pp;
+		break;
+	case DW_EH_PE_datarel:
+		val += (uintptr_t)datarel;
+		break;
+	default:
+		FAIL("unknown pointer base 0x%x", enc);
+		return 0;
+	}
 
-	/* 3 is the charm and 1 is the free giveaway. */
-#ifdef __i386__
-	fp += 8;
-#endif
-#ifdef __arm__
-	fp += 4;
-#endif
+	*pp = p;
+	*valp = val;
+	return 1;
+} /* read_encoded */
 
-	if (loc->atom == DW_OP_fbreg)
-		addr = fp        + loc->number;
-	else if (loc->atom == DW_OP_addr)
-		addr = dso->base + loc->number;
-	else	/* We don't track registers. */
-		return;
+/* Empty $Cfi_rules. */
+static void forget_cfi_rules(void)
+{
+	unsigned i;
 
-	/* Decode and print it unless we've seen it in this backtrace. */
-	if (seen(addr))
-		return;
-	if ((str = decodevar(var, dwarf_diename(var), addr, dso)) != NULL)
-		LOGIT("      %s" NL, str);
-} /* printvar */
+	for (i = 0; i < 1 << CFI_CACHE_BITS; i++)
+		__atomic_store_n(&Cfi_rules[i].pc, NULL, __ATOMIC_RELAXED);
+} /* forget_cfi_rules */
 
-/* Find all variables visible in $fun at $pc and print them. */
-static void printvars(Dwarf_Die *fun, struct dso_st const *dso,
-	void const *pc, void const *fp)
+/* forget_cfi_rules() if dlclose() has been called since we last
+ * checked.  Looking at dlpi_subs each time would cost about as much
+ * as the backtrace itself. */
+static void check_cfi_dlcloses(void)
 {
-	Dwarf_Die var;
+	unsigned n;
 
-	if (dwarf_child(fun, &var) != 0)
-		return;
-	do
+	n = __atomic_load_n(&Dlcloses, __ATOMIC_RELAXED);
+	if (n != __atomic_load_n(&Cfi_dlcloses, __ATOMIC_RELAXED))
 	{
-		switch (dwarf_tag(&var))
-		{
-		case DW_TAG_variable:
-		case DW_TAG_formal_parameter:
-			printvar(&var, dso, pc, fp);
-			break;
-		case DW_TAG_lexical_block:
-			printvars(&var, dso, pc, fp);
-			break;
-		}
-	} while (dwarf_siblingof(&var, &var) == 0);
-} /* printvars */
-#endif /* CONFIG_PRINTVARS */
-/* printvars() }}} */
+		__atomic_store_n(&Cfi_dlcloses, n, __ATOMIC_RELAXED);
+		forget_cfi_rules();
+	}
+} /* check_cfi_dlcloses */
 
-/* The engine: getting debug information about stack frames {{{ */
-/* Search $parent's children recursively for subroutines containing $pc.
- * This may find subprograms dwarf_getscopes() wouldn't in case the
- * subprogram is nested in another one by scope but not by pc range. */
-static int search_scopes(Dwarf_Die **scopesp, int *nscopesp,
-	Dwarf_Die *parent, Dwarf_Addr pc)
+/* Count the dlclose()s for check_cfi_dlcloses(). */
+int dlclose(void *handle)
 {
-	unsigned depth;
-	Dwarf_Die child;
+	int ret;
+	static int (*real_dlclose)(void *);
 
-	if (dwarf_child(parent, &child) != 0)
-		return 0;
-	depth = (*nscopesp)++;
+	if (!real_dlclose && !(real_dlclose = dlsym(RTLD_NEXT, "dlclose")))
+		return -1;
+	ret = real_dlclose(handle);
+	__atomic_add_fetch(&Dlcloses, 1, __ATOMIC_RELAXED);
+	return ret;
+} /* dlclose */
+
+/* Return the .eh_frame_hdr of the object containing $find->pc in
+ * $find->hdr, and stop the iteration when it's found. */
+static int find_eh_frame_hdr(struct dl_phdr_info *info, size_t size,
+	void *data)
+{
+	int found;
+	unsigned i;
+	struct cfi_find_st *find = data;
+	ElfW(Phdr) const *eh_frame_hdr;
 
-	do
+	/* Catch what dlclose() hasn't told, like the libc's own. */
+	if (size >= offsetof(struct dl_phdr_info, dlpi_subs)
+			+ sizeof(info->dlpi_subs)
+		&& info->dlpi_subs != Cfi_subs)
 	{
-		Dwarf_Addr addr;
-		Dwarf_Attribute attr;
+		Cfi_subs = info->dlpi_subs;
+		forget_cfi_rules();
+	}
 
-		if (dwarf_tag(&child) != DW_TAG_subprogram)
-			continue;
+	found = 0;
+	eh_frame_hdr = NULL;
+	for (i = 0; i < info->dlpi_phnum; i++)
+	{
+		ElfW(Phdr) const *phdr = &info->dlpi_phdr[i];
 
-		if (search_scopes(scopesp, nscopesp, &child, pc))
+		if (phdr->p_type == PT_LOAD)
 		{
-			if (*scopesp)
-				(*scopesp)[depth] = *parent;
-			return 1;
-		}
+			uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
 
-		if (!dwarf_attr(&child, DW_AT_low_pc, &attr))
-			continue;
-		if (dwarf_formaddr(&attr, &addr) != 0)
-			continue;
-		if (pc < addr)
-			continue;
+			if (start <= find->pc
+					&& find->pc < start + phdr->p_memsz)
+				found = 1;
+		} else if (phdr->p_type == PT_GNU_EH_FRAME)
+			eh_frame_hdr = phdr;
+	}
 
-		if (!dwarf_attr(&child, DW_AT_high_pc, &attr))
-			continue;
-		if (dwarf_formaddr(&attr, &addr) != 0)
-			continue;
-		if (pc > addr)
-			continue;
+	if (!found)
+		return 0;
+	if (eh_frame_hdr)
+		find->hdr = (unsigned char const *)info->dlpi_addr
+			+ eh_frame_hdr->p_vaddr;
+	return 1;
+} /* find_eh_frame_hdr */
 
-		*scopesp = malloc(sizeof(**scopesp) * *nscopesp);
-		if (*scopesp)
-			(*scopesp)[depth] = child;
-		return 1;
-	} while (dwarf_siblingof(&child, &child) == 0);
-	(*nscopesp)--;
+/* Look up the FDE covering $pc in the binary search table of $hdr,
+ * an .eh_frame_hdr.  Returns NULL if there's none. */
+static unsigned char const *find_fde(unsigned char const *hdr,
+	uintptr_t pc)
+{
+	int32_t entry[2];
+	size_t lo, hi, mid;
+	uintptr_t eh_frame, count;
+	unsigned char const *p, *table;
 
-	return 0;
-} /* search_scopes */
+	/* version, eh_frame_ptr_enc, fde_count_enc, table_enc */
+	if (hdr[0] != 1)
+		return NULL;
+	p = &hdr[4];
+	if (!read_encoded(&p, hdr[1], hdr, &eh_frame)
+			|| !read_encoded(&p, hdr[2], hdr, &count))
+		return NULL;
 
-/* Like dwarf_getscopes(), but if that fails try search_scopes(). */
-static int get_scopes(Dwarf_Die *die, Dwarf_Addr pc, Dwarf_Die **scopesp)
-{
-	int n;
+	/* That's what everyone uses. */
+	if (hdr[3] != (DW_EH_PE_datarel | DW_EH_PE_sdata4))
+	{
+		FAIL("%p: unsupported table encoding 0x%x", hdr, hdr[3]);
+		return NULL;
+	}
 
-	/* Reset libdw's errno first, because getsopes() may fail
-	 * in case of earlier errors. */
-	dwarf_errno();
-	*scopesp = NULL;
-	if ((n = dwarf_getscopes(die, pc, scopesp)) > 0)
-		return n;
-	else if (search_scopes(scopesp, &n, die, pc) && *scopesp)
-		return n;
-	else
-		return 0;
-} /* get_scopes */
+	/* Find the last entry whose initial location is <= $pc. */
+	table = p;
+	lo = 0;
+	hi = count;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		memcpy(entry, &table[mid * sizeof(entry)], sizeof(entry));
+		if ((uintptr_t)hdr + entry[0] <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-/* Fill $cs for a $relpc relocated program counter. */
-static void bt1(struct callsite_st *cs, void const *relpc)
+	if (!lo)
+		return NULL;
+	memcpy(entry, &table[(lo-1) * sizeof(entry)], sizeof(entry));
+	return hdr + entry[1];
+} /* find_fde */
+
+/* Set the rule of $reg in $state if it's one we're interested in. */
+static void cfi_set(struct cfi_state_st *state, struct cfi_cie_st const *cie,
+	uintptr_t reg, int how, intptr_t off)
 {
-	static struct bufhead_st bh;
-	int i, lineno;
-	Dwarf_Die die;
-	Dwarf_Addr pc;
-	Dwarf_Line *line;
-	char const *fmt, *cufile, *header;
+	if (reg == cie->ra_reg)
+	{
+		state->ra = how;
+		state->ra_off = off;
+	} else if (reg == CFI_FP)
+	{
+		state->fp = how;
+		state->fp_off = off;
+	}
+} /* cfi_set */
 
-	memset(cs, 0, sizeof(*cs));
-	if (!(cs->dso = getdso(relpc)))
-		return;
-	if (!cs->dso->dr)
-		return;
+/* Set the rule of $reg in $state to what it was in $initial. */
+static void cfi_restore(struct cfi_state_st *state,
+	struct cfi_state_st const *initial, struct cfi_cie_st const *cie,
+	uintptr_t reg)
+{
+	if (reg == cie->ra_reg)
+	{
+		state->ra = initial->ra;
+		state->ra_off = initial->ra_off;
+	} else if (reg == CFI_FP)
+	{
+		state->fp = initial->fp;
+		state->fp_off = initial->fp_off;
+	}
+} /* cfi_restore */
 
-	/* pc := relocation-free $relpc. */
-	pc = relpc-cs->dso->base;
-	if (!dwarf_addrdie(cs->dso->dr, pc, &die))
-		return;
+/*
+ * Execute the CFA program between $p and $end on $state until the
+ * location, which starts from $loc, gets past $pc.  $initial is the
+ * state after the CIE's initial instructions, or NULL if we're running
+ * them.  Returns whether all instructions were understood.
+ */
+static int cfi_run(unsigned char const *p, unsigned char const *end,
+	struct cfi_cie_st const *cie, uintptr_t loc, uintptr_t pc,
+	struct cfi_state_st *state, struct cfi_state_st const *initial)
+{
+	unsigned depth;
+	struct cfi_state_st stack[CFI_STATE_DEPTH];
 
-	/* Get the name of the caller function and the name of the
-	 * compilation unit (the C source file). */
-	cufile = NULL;
-	cs->nscopes = get_scopes(&die, pc, &cs->scopes);
-	for (i = 0; i < cs->nscopes; i++)
+	depth = 0;
+	while (p < end)
 	{
-		int tag;
-		char const *str;
-		Dwarf_Attribute attr;
-		Dwarf_Die spec;
-
+		unsigned op;
+		uintptr_t reg, len;
 
-		tag = dwarf_tag(&cs->scopes[i]);
-		if (tag != DW_TAG_subprogram && tag != DW_TAG_compile_unit)
-			continue;
-		if (dwarf_attr(&cs->scopes[i], DW_AT_name, &attr))
-			str = dwarf_formstring(&attr);
-		else if (tag == DW_TAG_subprogram
-			&& dwarf_attr(&cs->scopes[i],
-				DW_AT_specification, &attr))
+		op = *p++;
+		switch (op & 0xc0)
 		{
-			static int leave_mangled = -1;
-
-			/* Looks like it's an object method.
-			 * Find out the class name too. */
-			if (!dwarf_formref_die(&attr, &spec))
-				continue;
-			if (dwarf_tag(&spec) != DW_TAG_subprogram)
-				continue;
+		case DW_CFA_advance_loc:
+			loc += (op & 0x3f) * cie->code_align;
+			if (loc > pc)
+				return 1;
+			continue;
+		case DW_CFA_offset:
+			cfi_set(state, cie, op & 0x3f, CFI_SAVED,
+				uleb128(&p) * cie->data_align);
+			continue;
+		case DW_CFA_restore:
+			if (!initial)
+				return 0;
+			cfi_restore(state, initial, cie, op & 0x3f);
+			continue;
+		}
 
-			/* Print the mangled identifier? */
-			if (leave_mangled < 0)
-			{
-				char const *env;
+		switch (op)
+		{
+		case DW_CFA_nop:
+		case DW_CFA_GNU_window_save:
+			/* aarch64's DW_CFA_AARCH64_negate_ra_state,
+			 * the return address is stripped anyway */
+			break;
 
-				env = getenv("ARF_MANGLED");
-				leave_mangled = env && atoi(env) > 0;
-			}
+		case DW_CFA_advance_loc1:
+			loc += *p++ * cie->code_align;
+			if (loc > pc)
+				return 1;
+			break;
+		case DW_CFA_advance_loc2:
+		{
+			uint16_t delta;
 
-			if (leave_mangled && dwarf_attr(&spec,
-				DW_AT_MIPS_linkage_name, &attr))
-			{	/* Leave cs->funame empty to indicate
-				 * mangled name to bt(). */
-				cs->cls = dwarf_formstring(&attr);
-				continue;
-			} else if (dwarf_attr(&spec, DW_AT_name, &attr))
-			{
-				Dwarf_Die *dies;
-
-				/* Look up the class, which should be
-				 * in the specification's parent die. */
-				dies = NULL;
-				str = dwarf_formstring(&attr);
-				if (dwarf_getscopes_die(&spec, &dies) > 1
-						&& dwarf_attr(&dies[1],
-							DW_AT_name, &attr))
-					cs->cls = dwarf_formstring(&attr);
-				free(dies);
-			}
+			memcpy(&delta, p, sizeof(delta));
+			p += sizeof(delta);
+			loc += delta * cie->code_align;
+			if (loc > pc)
+				return 1;
+			break;
 		}
+		case DW_CFA_advance_loc4:
+		{
+			uint32_t delta;
 
-		if (tag == DW_TAG_subprogram)
-			cs->funame = str;
-		else
-			cufile = trim(str);
-	}
-
-	/*
-	 * Get $header and $lineno (the file and line address which
-	 * actually made the call).  $header may be different from
-	 * $cufile if the call was actually made in a function
-	 * defined in a header.
-	 */
-	line = dwarf_getsrc_die(&die, pc-1);
-	header = trim(dwarf_linesrc(line, NULL, NULL));
-	if (cufile && header && !strcmp(cufile, header))
-		cufile = NULL;
-	if (!cufile && !header)
-		return;
-	if (!header || dwarf_lineno(line, &lineno) != 0 || lineno <= 0)
-		lineno = 0;
+			memcpy(&delta, p, sizeof(delta));
+			p += sizeof(delta);
+			loc += delta * cie->code_align;
+			if (loc > pc)
+				return 1;
+			break;
+		}
 
-	/* Add $cufile and $header to $bh->buf then return them
-	 * as $cs->location. */
-	if (cufile && header && lineno)
-		fmt = "%s %s:%u";
-	else if (cufile && header)
-		fmt = "%s %s";
-	else if (cufile)
-		fmt = "%s";
-	else if (header && lineno)
-		fmt = "%.0s%s:%u";
-	else /* header */
-		fmt = "%.0s%s";
+		case DW_CFA_offset_extended:
+			reg = uleb128(&p);
+			cfi_set(state, cie, reg, CFI_SAVED,
+				uleb128(&p) * cie->data_align);
+			break;
+		case DW_CFA_offset_extended_sf:
+			reg = uleb128(&p);
+			cfi_set(state, cie, reg, CFI_SAVED,
+				sleb128(&p) * cie->data_align);
+			break;
+		case DW_CFA_GNU_negative_offset_extended:
+			reg = uleb128(&p);
+			cfi_set(state, cie, reg, CFI_SAVED,
+				-(intptr_t)uleb128(&p) * cie->data_align);
+			break;
+		case DW_CFA_restore_extended:
+			if (!initial)
+				return 0;
+			cfi_restore(state, initial, cie, uleb128(&p));
+			break;
+		case DW_CFA_undefined:
+			cfi_set(state, cie, uleb128(&p), -1, 0);
+			break;
+		case DW_CFA_same_value:
+			cfi_set(state, cie, uleb128(&p), CFI_SAME, 0);
+			break;
+		case DW_CFA_register:
+			reg = uleb128(&p);
+			uleb128(&p);
+			cfi_set(state, cie, reg, CFI_LOST, 0);
+			break;
+		case DW_CFA_val_offset:
+		case DW_CFA_val_offset_sf:
+			/* We could, but nobody does it to these registers. */
+			reg = uleb128(&p);
+			uleb128(&p);
+			cfi_set(state, cie, reg, CFI_LOST, 0);
+			break;
+		case DW_CFA_expression:
+		case DW_CFA_val_expression:
+			reg = uleb128(&p);
+			len = uleb128(&p);
+			p += len;
+			cfi_set(state, cie, reg, CFI_LOST, 0);
+			break;
 
-	bh.n = 0;
-	addfmt(&bh, fmt, cufile, header, lineno);
-	cs->location = bh.buf;
-} /* bt1 */
+		case DW_CFA_remember_state:
+			if (depth >= CFI_STATE_DEPTH)
+				return 0;
+			stack[depth++] = *state;
+			break;
+		case DW_CFA_restore_state:
+			if (!depth)
+				return 0;
+			*state = stack[--depth];
+			break;
 
-/* Print information about the i:th frame, which is executing $pc. */
-static void bt0(unsigned i, void const *pc, void const *fp)
-{
-	static unsigned wcol1, wcol2;
-	char const *fmt;
-	struct callsite_st cs;
-	int st1, ed1, st2, ed2, len;
+		case DW_CFA_def_cfa:
+			state->cfa_reg = uleb128(&p);
+			state->cfa_off = uleb128(&p);
+			break;
+		case DW_CFA_def_cfa_sf:
+			state->cfa_reg = uleb128(&p);
+			state->cfa_off = sleb128(&p) * cie->data_align;
+			break;
+		case DW_CFA_def_cfa_register:
+			state->cfa_reg = uleb128(&p);
+			break;
+		case DW_CFA_def_cfa_offset:
+			state->cfa_off = uleb128(&p);
+			break;
+		case DW_CFA_def_cfa_offset_sf:
+			state->cfa_off = sleb128(&p) * cie->data_align;
+			break;
+		case DW_CFA_def_cfa_expression:
+			len = uleb128(&p);
+			p += len;
+			state->cfa_reg = -1;
+			break;
 
-	if (i < 1)
-		return;
+		case DW_CFA_GNU_args_size:
+			uleb128(&p);
+			break;
 
-	/*
-	 * Align cs.dso->fname, .location and .funame in columns.
-	 * The olumns are $wcol[12] chararacter wide.  If the columns
-	 * are wider than that update them so the subsequent lines
-	 * will be aligned at least.
-	 */
-	bt1(&cs, pc);
-	if (!cs.funame && !cs.cls)
-		fmt = "%4d. %n%*s%n %n%*s%n [%.0s%.0s%p]" NL;
-	else if (cs.funame && !cs.cls)
-		fmt = "%4d. %n%*s%n %n%*s%n %.0s%s()"     NL;
-	else if (!cs.funame && cs.cls)
-		/* c++filt adds "()" itself */
-		fmt = "%4d. %n%*s%n %n%*s%n %s"           NL;
-	else
-		fmt = "%4d. %n%*s%n %n%*s%n %s::%s()"     NL;
-	LOGIT(fmt, i,
-		&st1, -wcol1, cs.dso && cs.dso->fname
-			? cs.dso->fname : "", &ed1,
-		&st2, -wcol2, cs.location ? : "", &ed2,
-		cs.cls, cs.funame, pc);
-	if (wcol1 < (len = ed1 - st1))
-		wcol1 = len;
-	if (wcol2 < (len = ed2 - st2))
-		wcol2 = len;
+		default:
+			/* Including DW_CFA_set_loc, which no one uses. */
+			FAIL("%p: unknown CFA instruction 0x%x", p-1, op);
+			return 0;
+		}
+	}
 
-	if (cs.nscopes > 0)
+	return 1;
+} /* cfi_run */
+
+/* Work out the $rule at $pc from its $fde.  Returns whether it could. */
+static int cfi_decode(unsigned char const *fde, uintptr_t pc,
+	struct cfi_rule_st *rule)
+{
+	char const *aug;
+	uint32_t len, id;
+	uintptr_t start, range;
+	struct cfi_cie_st cie;
+	unsigned fde_enc, version;
+	struct cfi_state_st initial, state;
+	unsigned char const *p, *end, *cie_p, *cie_end, *insns;
+
+	/* The FDE: length, CIE pointer, PC begin, PC range, augmentation
+	 * data, instructions.  64-bit DWARF is not used in .eh_frame. */
+	p = fde;
+	memcpy(&len, p, sizeof(len));
+	p += sizeof(len);
+	if (!len || len == 0xffffffff)
+		return 0;
+	end = p + len;
+	memcpy(&id, p, sizeof(id));
+	cie_p = p - id;
+	p += sizeof(id);
+
+	/* The CIE: length, ID, version, augmentation, code alignment,
+	 * data alignment, return address register, augmentation data,
+	 * initial instructions. */
+	memcpy(&len, cie_p, sizeof(len));
+	cie_p += sizeof(len);
+	if (!len || len == 0xffffffff)
+		return 0;
+	cie_end = cie_p + len;
+	cie_p += sizeof(id);
+	version = *cie_p++;
+	aug = (char const *)cie_p;
+	cie_p += strlen(aug) + 1;
+	cie.code_align = uleb128(&cie_p);
+	cie.data_align = sleb128(&cie_p);
+	cie.ra_reg = version == 1 ? *cie_p++ : uleb128(&cie_p);
+
+	fde_enc = DW_EH_PE_absptr;
+	if (aug[0] == 'z')
 	{
-#ifdef CONFIG_PRINTVARS
-		static int wantsvars = -1;
-		char const *env;
+		unsigned i;
+		uintptr_t ignore;
+		unsigned char const *data;
+
+		len = uleb128(&cie_p);
+		data = cie_p;
+		for (i = 1; aug[i]; i++)
+			if (aug[i] == 'R')
+				fde_enc = *data++;
+			else if (aug[i] == 'L')
+				data++;
+			else if (aug[i] == 'P')
+			{
+				unsigned enc = *data++;
 
-		if (wantsvars < 0)
-			wantsvars = (env = getenv("ARF_PRINTVARS"))
-				&& atoi(env) > 0;
-		if (wantsvars && fp != NULL)
-			for (i = 0; i < cs.nscopes; i++)
-				printvars(&cs.scopes[i], cs.dso, pc, fp);
-#endif /* CONFIG_PRINTVARS */
-		free(cs.scopes);
+				if (!read_encoded(&data, enc, NULL, &ignore))
+					return 0;
+			} else if (aug[i] != 'S' && aug[i] != 'B')
+				/* Can't interpret the rest. */
+				break;
+		cie_p += len;
+	} else if (aug[0])
+	{
+		FAIL("%p: unknown augmentation \"%s\"", fde, aug);
+		return 0;
 	}
-} /* bt0 */
-/* Engine }}} */
+	insns = cie_p;
 
-/* The driver: getting the return addresses {{{ */
-#ifdef CONFIG_FAST_UNWIND /* {{{ */
-/* Unwind the stack by examining the frame manually. */
+	/* Back to the FDE.  The range is encoded like the start,
+	 * but is not relative to anything. */
+	if (!read_encoded(&p, fde_enc, NULL, &start)
+			|| !read_encoded(&p, fde_enc & 0x0f, NULL, &range))
+		return 0;
+	if (pc < start || pc - start >= range)
+		/* $pc is in a hole between the FDEs. */
+		return 0;
+	if (aug[0] == 'z')
+	{
+		len = uleb128(&p);
+		p += len;
+	}
 
-#ifdef __arm__
-/* These are used by getlr() to examine instructions. */
-# undef R12
-# define PUSH			0xE92D0000
-# define FP			(1 << 11)
-# define R12			(1 << 12)
-# define SP			(1 << 13)
-# define LR			(1 << 14)
-# define PC			(1 << 15)
-#endif
+	/* Run the initial instructions, then the FDE's until $pc. */
+	memset(&initial, 0, sizeof(initial));
+	initial.cfa_reg = -1;
+	initial.ra = initial.fp = CFI_SAME;
+	if (!cfi_run(insns, cie_end, &cie, 0, (uintptr_t)-1, &initial, NULL))
+		return 0;
+	state = initial;
+	if (!cfi_run(p, end, &cie, start, pc, &state, &initial))
+		return 0;
 
-/* Extract the return address from the frame pointed to by $fp.
- * $prev_ssegp is used for state recording during unwinding and
- * should point to NULL on the first invocation. */
-static void const *const *getlr(void const *const *fp, void const **lrp,
-	void const **prev_ssegp)
+	/* Make a rule of it. */
+	if (state.cfa_reg == CFI_SP)
+		rule->cfa = CFI_CFA_SP;
+	else if (state.cfa_reg == CFI_FP)
+		rule->cfa = CFI_CFA_FP;
+	else
+		return 0;
+	if (state.ra != CFI_SAVED)
+		/* Undefined in the outermost frame. */
+		return 0;
+
+	rule->cfa_off = state.cfa_off;
+	rule->ra_off  = state.ra_off;
+	rule->fp      = state.fp >= 0 ? state.fp : CFI_LOST;
+	rule->fp_off  = state.fp_off;
+	return 1;
+} /* cfi_decode */
+
+/* Return the $rule to unwind the frame of $pc. */
+static void cfi_rule(void const *pc, struct cfi_rule_st *rule)
 {
-	void const *sseg;
-	void const *const *next;
+	void const *seen;
+	unsigned char const *fde;
+	struct cfi_find_st find;
+	struct cached_cfi_st *cached;
+
+	cached = &Cfi_rules[((uintptr_t)pc * GOLDEN_RATIO)
+		>> (8*sizeof(uintptr_t) - CFI_CACHE_BITS)];
+	if (__atomic_load_n(&cached->pc, __ATOMIC_ACQUIRE) == pc)
+	{	/* Check that it hasn't been overwritten while we copied. */
+		*rule = cached->rule;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&cached->pc, __ATOMIC_RELAXED) == pc)
+			return;
+	}
 
-	DEEPSHIT("FP=%p", fp);
-	if (fp == NULL)
-	{	/* Caller should have stopped unwinding. */
-		FAIL("%p: NULL", fp);
-		return NULL;
+	/* Decode it.  Failures are cached as well. */
+	find.pc = (uintptr_t)pc;
+	find.hdr = NULL;
+	dl_iterate_phdr(find_eh_frame_hdr, &find);
+	if (!find.hdr || !(fde = find_fde(find.hdr, (uintptr_t)pc))
+			|| !cfi_decode(fde, (uintptr_t)pc, rule))
+	{
+		memset(rule, 0, sizeof(*rule));
+		rule->cfa = CFI_STOP;
 	}
 
-#if defined(__arm__) /* {{{ */
-	if (addr_is(NULL, fp[0], NULL) != CODE)
-	{	/* *fp must be either lr or pc, we're probably in
-		 * a noreturn function like _dl_signal_error(). */
-		FAIL("%p: NOT CODE: %p", fp, fp[0]);
-		return NULL;
+	/* Cache it unless someone else is doing the same right now. */
+	seen = __atomic_load_n(&cached->pc, __ATOMIC_RELAXED);
+	if (seen != CFI_BUSY && __sync_bool_compare_and_swap(&cached->pc,
+			seen, CFI_BUSY))
+	{
+		cached->rule = *rule;
+		__atomic_store_n(&cached->pc, pc, __ATOMIC_RELEASE);
 	}
+} /* cfi_rule */
 
-	switch (addr_is(NULL, fp[-1], &sseg))
+/*
+ * Like backtrace(): store the return addresses of at most $size frames
+ * in $addrs, starting from our caller, and return how many were there.
+ * The frames are followed as long as they have call frame information
+ * and stay on the thread's stack, so unlike with getlr(), the program
+ * needn't have frame pointers.
+ */
+static int __attribute__((noinline)) cfi_backtrace(void **addrs, int size)
+{
+	int n;
+	void const *pc, *lo, *hi;
+	char const *sp, *fp, *cfa;
+	struct cfi_rule_st rule;
+
+	if (!stack_bounds(&lo, &hi))
+		return 0;
+	check_cfi_dlcloses();
+
+	/* Start from here. */
+#ifdef __x86_64__
+	__asm__ __volatile__(
+		"leaq 0(%%rip), %0\n\t"
+		"movq %%rsp, %1\n\t"
+		"movq %%rbp, %2"
+		: "=r" (pc), "=r" (sp), "=r" (fp));
+#else /* __aarch64__ */
+	__asm__ __volatile__(
+		"adr %0, .\n\t"
+		"mov %1, sp\n\t"
+		"mov %2, x29"
+		: "=r" (pc), "=r" (sp), "=r" (fp));
+#endif
+
+	for (n = 0; n < size; n++)
 	{
-	case STACK:
-	{	/* fp|sp, lr */
-		/* Verify that fp|sp is in the same segment as before.
-		 * This is used to detect clone() boundaries. */
-		if (!*prev_ssegp)
-			*prev_ssegp = sseg;
-		else if (*prev_ssegp != sseg)
+		void const *const *ra;
+
+		/* A return address may be the start of the function
+		 * following the caller if it called a noreturn one,
+		 * so look up the call instruction instead. */
+		cfi_rule(n ? (char const *)pc - 1 : pc, &rule);
+		if (rule.cfa == CFI_STOP)
+			break;
+		else if (rule.cfa == CFI_CFA_SP)
+			cfa = sp + rule.cfa_off;
+		else if (!fp)
+			break;
+		else
+			cfa = fp + rule.cfa_off;
+
+		/* The stack is supposed to grow down. */
+		ra = (void const *const *)(cfa + rule.ra_off);
+		if (cfa <= sp || (void const *)cfa > hi
+			|| (uintptr_t)cfa % sizeof(*ra)
+			|| (void const *)ra < (void const *)sp
+			|| (void const *)&ra[1] > hi)
 		{
-			FAIL("%p: DIFFERENT SSEG", fp);
-			return NULL;
+			FAIL("%p: CFA %p out of stack", pc, cfa);
+			break;
 		}
 
-		*lrp = fp[0];
-		if (fp[-1] != fp+1)
-			/* fp,     lr */
-			next = fp[-1];
-		else	/* fp, sp, lr */
-			next = fp[-2];
-		break;
+		if (rule.fp == CFI_SAVED)
+		{
+			char const *const *saved;
+
+			saved = (char const *const *)(cfa + rule.fp_off);
+			if ((void const *)saved < (void const *)sp
+				|| (void const *)&saved[1] > hi)
+				break;
+			fp = *saved;
+		} else if (rule.fp == CFI_LOST)
+			fp = NULL;
+
+		if (!(pc = *ra))
+			break;
+#ifdef __aarch64__
+		/* Strip the pointer authentication code. */
+		pc = (void const *)((uintptr_t)pc & 0x0000FFFFFFFFFFFFUL);
+#endif
+		sp = cfa;
+		addrs[n] = (void *)pc;
 	}
 
-	case CODE:
-	{	/* fp, [r12, sp], lr, pc */
-		unsigned insn, i;
+	return n;
+} /* cfi_backtrace */
+#endif /* CONFIG_CFI_UNWIND }}} */
 
-		*lrp = fp[-1];
+/* Asynchronous barf()ing: async_barf() {{{ */
+/* The thread printing what async_barf() captured. */
+static void *async_barfer(void *unused)
+{
+	sigset_t sigs;
+	unsigned reported;
 
-		/*
-		 * *fp points to pc.  If the registers were push:ed
-		 * *$pc must be a PUSH instruction.  Examine it to see
-		 * what registers were PUSH:ed to determine where the
-		 * $next fp is.
-		 */
-		insn = *(unsigned *)(fp[0]-8);
-		if ((insn & 0xFFFF0000) != PUSH)
-		{	/* $insn is not a PUSH instruction. */
-			FAIL("%p: NOT PUSH: *%p=0x%x", fp, fp[0]-8, insn);
-			return NULL;
-		} else if ((insn & (FP|LR|PC)) != (FP|LR|PC))
-		{	/* Either fp, lr or pc wasn't pushed. */
-			FAIL("%p: NOT EXPECTED PUSH: *%p=0x%x",
-				fp, fp[0]-8, insn);
-			return NULL;
+	/* Leave the signals to the program's threads. */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	reported = 0;
+	for (;;)
+	{
+		unsigned i, dropped;
+		struct async_barf_st *slot;
+
+		if (sem_wait(&Async_ready) < 0)
+			continue;
+
+		/* The slot has been reserved, but it may take a little
+		 * longer for its barf() to finish capturing, because
+		 * a later barf() can post $Async_ready earlier. */
+		slot = &Async[Async_head & (ASYNC_SLOTS-1)];
+		while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)
+				!= Async_head + 1)
+			sched_yield();
+
+		dropped = __atomic_load_n(&Async_dropped, __ATOMIC_RELAXED);
+		if (dropped != reported)
+		{
+			WARNING("%u backtraces dropped", dropped - reported);
+			reported = dropped;
 		}
 
-		i = -2;
-		if (insn & SP)
-			i--;
-		if (insn & R12)
-			i--;
-		next = fp[i];
-		break;
+		begin_output();
+		LOGIT("%s" NL, slot->why);
+		for (i = 0; i < slot->depth; i++)
+			bt0(i+1, slot->addrs[i], NULL);
+		flush_output();
+
+		/* Give the slot back to the producers. */
+		__atomic_store_n(&slot->seq, Async_head + ASYNC_SLOTS,
+			__ATOMIC_RELEASE);
+		__atomic_store_n(&Async_head, Async_head + 1,
+			__ATOMIC_RELEASE);
 	}
 
-	default:
-		if (fp[-1] != NULL)
-			FAIL("%p: OTHER: %p", fp, fp[-1]);
-		return NULL;
-	} /* switch what fp[-1] is */
-	/* }}} */
-#elif defined(__i386__) /* {{{ */
-	/* Assume ip, prev_bp (<- bp). */
-	if (!fp[0])
-	{	/* Reached the bottom. */
-		return NULL;
-	} else if (addr_is(NULL, fp[0], &sseg) != STACK)
-	{
-		FAIL("%p: NOT STACK: %p", fp, fp[0]);
-		return NULL;
-	} else if (!*prev_ssegp)
-	{
-		*prev_ssegp = sseg;
-	} else if (*prev_ssegp != sseg)
+	return NULL;
+} /* async_barfer */
+
+/* async_barfer() doesn't survive fork(), so the child barf()s itself. */
+static void async_forked(void)
+{
+	Async = NULL;
+} /* async_forked */
+
+/* Set up $Async if $ARF_ASYNC is set.  Called once. */
+static void async_init(void)
+{
+	unsigned i;
+	pthread_t thread;
+	pthread_attr_t attr;
+	char const *env;
+	struct async_barf_st *async;
+
+	if (!(env = getenv("ARF_ASYNC")) || atoi(env) <= 0)
+		return;
+
+	if (!(async = calloc(ASYNC_SLOTS, sizeof(*async))))
+		return;
+	for (i = 0; i < ASYNC_SLOTS; i++)
+		async[i].seq = i;
+	if (sem_init(&Async_ready, 0, 0) < 0)
 	{
-		FAIL("%p: DIFFERENT SSEG: %p != %p", fp, sseg, *prev_ssegp);
-		return NULL;
+		free(async);
+		return;
 	}
 
-	if (addr_is(NULL, fp[1], NULL) != CODE)
+	Async = async;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, async_barfer, NULL) != 0)
 	{
-		FAIL("%p: NOT CODE: %p", fp, fp[1]);
-		return NULL;
+		WARNING("couldn't start the thread, barf()ing synchronously");
+		Async = NULL;
+		sem_destroy(&Async_ready);
+		free(async);
 	} else
+		pthread_atfork(NULL, NULL, async_forked);
+	pthread_attr_destroy(&attr);
+} /* async_init */
+
+/*
+ * Format $why into a free slot of $Async and capture the return addresses
+ * of barf()'s caller and upwards the stack, then let async_barfer() have
+ * them.  Doesn't block: if all slots are taken the backtrace is dropped.
+ * We're between barf() and the backtrace, so skip our frame and barf()'s.
+ */
+static void __attribute__((noinline)) async_barf(char const *why,
+	va_list printf_args)
+{
+	unsigned long pos;
+	struct async_barf_st *slot;
+
+	/* Reserve $slot at $pos. */
+	pos = __atomic_load_n(&Async_tail, __ATOMIC_RELAXED);
+	for (;;)
 	{
-		next = fp[0];
-		*lrp = fp[1];
+		long diff;
+
+		slot = &Async[pos & (ASYNC_SLOTS-1)];
+		diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)
+			- pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&Async_tail,
+					&pos, pos + 1, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+		{	/* async_barfer() hasn't printed the slot yet. */
+			__atomic_add_fetch(&Async_dropped, 1,
+				__ATOMIC_RELAXED);
+			return;
+		} else	/* Someone else has taken it. */
+			pos = __atomic_load_n(&Async_tail, __ATOMIC_RELAXED);
 	}
-#endif /* __i386__ }}} */
 
-	/* Is $next valid after all? */
-	DEEPSHIT("NEXT=%p", next);
-	if (__builtin_expect(next == fp, 0))
-	{	/* Something fishy is going on. */
-		FAIL("%p: SAME FRAME", fp);
-		return NULL;
-	} else if (__builtin_expect(next < fp, 0))
-	{	/* The stack is supposed to _grow_ down. */
-		FAIL("%p: WRONG DIRECTION", fp);
-		return NULL;
-	} else
-		return next;
-} /* getlr */
-#endif /* CONFIG_FAST_UNWIND }}} */
+	if (why)
+		vsnprintf(slot->why, sizeof(slot->why), why, printf_args);
+	else
+		strcpy(slot->why, "backtrace:");
+
+	do
+	{
+#if defined(CONFIG_LIBUNWIND)
+		unsigned skip;
+		unw_word_t ip;
+		unw_context_t uc;
+		unw_cursor_t cursor;
+
+		unw_getcontext(&uc);
+		unw_init_local(&cursor, &uc);
+		slot->depth = 0;
+		for (skip = 1; slot->depth < ASYNC_DEPTH
+				&& unw_step(&cursor) > 0; )
+		{
+			unw_get_reg(&cursor, UNW_REG_IP, &ip);
+			if (skip)
+				skip--;
+			else
+				slot->addrs[slot->depth++] = (void const *)ip;
+		}
+#elif defined(CONFIG_FAST_UNWIND)
+		unsigned skip;
+		void const *sseg;
+		void const *const *fp, *lr;
+
+		__atomic_add_fetch(&Maps_gen, 1, __ATOMIC_RELAXED);
+		sseg = NULL;
+		fp = __builtin_frame_address(0);
+		slot->depth = 0;
+		for (skip = 1; slot->depth < ASYNC_DEPTH
+				&& (fp = getlr(fp, &lr, &sseg)) != NULL; )
+			if (skip)
+				skip--;
+			else
+				slot->addrs[slot->depth++] = lr;
+#else
+		int n;
+		void *addrs[2 + ASYNC_DEPTH];
+
+# ifdef CONFIG_CFI_UNWIND
+		n = cfi_backtrace(addrs, 2 + ASYNC_DEPTH);
+# else
+		n = backtrace(addrs, 2 + ASYNC_DEPTH);
+# endif
+		n = n > 2 ? n - 2 : 0;
+		memcpy(slot->addrs, &addrs[2], sizeof(addrs[0]) * n);
+		slot->depth = n;
+#endif
+	} while (0);
+
+	/* Publish the slot. */
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&Async_ready);
+} /* async_barf */
+/* Asynchronous barf()ing }}} */
 
 /* Interface functions */
 /* Find and process the frames one by one starting from the most recent. */
@@ -1873,7 +4590,20 @@ static /* barf() will be made available by init() */
 #endif
 void barf(char const *why, ...)
 {
+	/* Leave it to async_barfer() if $ARF_ASYNC. */
+	pthread_once(&Async_once, async_init);
+	if (Async)
+	{
+		va_list printf_args;
+
+		va_start(printf_args, why);
+		async_barf(why, printf_args);
+		va_end(printf_args);
+		return;
+	}
+
 	/* Print $why. */
+	begin_output();
 	if (why)
 	{
 		va_list printf_args;
@@ -1884,6 +4614,11 @@ void barf(char const *why, ...)
 	} else
 		LOGIT("backtrace:" NL);
 
+#ifdef CONFIG_FAST_UNWIND
+	/* Things may have been mapped since the last backtrace. */
+	__atomic_add_fetch(&Maps_gen, 1, __ATOMIC_RELAXED);
+#endif
+
 	do
 	{
 #if defined(CONFIG_LIBUNWIND) /* {{{ */
@@ -1917,7 +4652,7 @@ void barf(char const *why, ...)
 		for (i = 1; (fp = getlr(fp, &lr, &sseg)) != NULL; i++)
 			bt0(i, lr, fp);
 		/* }}} */
-#else		/* Use glibc's backtrace(). {{{ */
+#else		/* Use glibc's backtrace() or ours. {{{ */
 		int i, n;
 
 		/* Try to get the backtrace until we allocate big enough
@@ -1926,7 +4661,12 @@ void barf(char const *why, ...)
 		{
 			void *addrs[i];
 
-			if ((n = backtrace(addrs, i)) >= i)
+#ifdef CONFIG_CFI_UNWIND
+			n = cfi_backtrace(addrs, i);
+#else
+			n = backtrace(addrs, i);
+#endif
+			if (n >= i)
 				/* $addrs might be too small. */
 				continue;
 
@@ -1944,7 +4684,20 @@ void barf(char const *why, ...)
 	 * printed again when generating the next backtrace. */
 	seen(NULL);
 #endif
+
+	flush_output();
 } /* barf */
+
+/* Send the output of barf() to $sink. */
+#if CONFIG_LIBARF_EXTERNAL
+static /* arf_sink() will be made available by init() too */
+#endif
+void arf_sink(struct arf_sink_st *sink)
+{
+#ifndef CONFIG_GLIB
+	__atomic_store_n(&Sink, sink, __ATOMIC_RELEASE);
+#endif
+} /* arf_sink */
 /* Driver }}} */
 
 /* Constructors {{{ */
@@ -1966,6 +4719,8 @@ static void __attribute__((constructor)) init(void)
 	 */
 	sprintf(str, "%p", barf);
 	setenv("THE_REAL_BARF", str, 1);
+	sprintf(str, "%p", arf_sink);
+	setenv("THE_REAL_ARF_SINK", str, 1);
 #else /* CONFIG_LIBARF_EXTERNAL == 1 */
 	/*
 	 * This is defined in every CU:s that #include:s arf.h
@@ -1974,11 +4729,38 @@ static void __attribute__((constructor)) init(void)
 	 * but that's not the main use case.
 	 */
 	extern void (*the_real_barf)(char const *, ...);
+	/* Weak, because programs built with an older arf.h lack it. */
+	extern void (*the_real_arf_sink)(struct arf_sink_st *)
+		__attribute__((weak));
 
 	the_real_barf = barf;
+	if (&the_real_arf_sink)
+		the_real_arf_sink = arf_sink;
 #endif /* CONFIG_LIBARF_EXTERNAL == 1 */
 } /* init */
 #endif /* CONFIG_LIBARF_EXTERNAL > 0 */
+
+static void __attribute__((constructor)) init_lock(void)
+{
+	pthread_atfork(lock_for_fork, unlock_after_fork, unlock_after_fork);
+} /* init_lock */
+
+/* Give async_barfer() a chance to print the pending backtraces. */
+static void __attribute__((destructor)) fini(void)
+{
+	unsigned i;
+
+	if (!Async)
+		return;
+	for (i = 0; i < 100; i++)
+	{
+		if (__atomic_load_n(&Async_head, __ATOMIC_ACQUIRE)
+				== __atomic_load_n(&Async_tail,
+					__ATOMIC_RELAXED))
+			break;
+		usleep(10000);
+	}
+} /* fini */
 /* Constructors }}} */
 
 /* vim: set foldmethod=marker: */
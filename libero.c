@@ -68,6 +68,11 @@
  *                                How many bytes was the peak from the
  *                                allocations at the start of the period.
  *
+ *                         How much memory libero has mmap()ed for itself,
+ *                         not counted in the allocations above.
+ *                         vvvvvv
+ * metadata footprint:     188416 (51200 bytes in use)
+ *
  *                Which thread allocated this piece of memory.
  *                vvvvvvvvv    (Only shown if libero is thread-aware.)
  * ptr=0x806f020 (tid=12638), size=185, karma=171
@@ -97,10 +102,73 @@
  *      Don't report backtraces unless they appear with allocations with
  *      this many differing karmas.
  *   -- $LIBERO_DEPTH=<unsigned>: (./ero -depth)
- *      Limit how many frames are traced back and stored in $Backtraces.
+ *      Limit how many frames are traced back and stored in the records,
+ *      at most MAX_DEPTH.
+ *   -- $LIBERO_SAMPLE_BYTES=<unsigned>: (./ero -sample)
+ *      Only record every about $LIBERO_SAMPLE_BYTES:th allocated byte,
+ *      see "Sampling".
+ *   -- $LIBERO_FORMAT={text|binary|folded|pprof}: (./ero -format)
+ *      binary: Write the reports in <program>.<pid>.leaks.bin in the
+ *      format described in ero.h, to be converted to text by erodump.
+ *      folded: Write each report in <program>.<pid>.<n>.folded, with
+ *      a "<dso>`<function>;...;<dso>`<function> <bytes>" line for each
+ *      distinct stack having memory in use, outermost frame first,
+ *      for flame graph tools.
+ *      pprof: Write each report in <program>.<pid>.<n>.pb.gz as a heap
+ *      profile which pprof can read, see report_pprof().
+ *   -- $LIBERO_TRACE={0|1}: (./ero -trace)
+ *      Write the allocation events in <program>.<pid>.events instead
+ *      of keeping records and reporting, see ero.h.  The events are
+ *      written by a background thread in libero_mt.so, and when the
+ *      buffer is full in libero.so.  Sampling is turned off.
+ *   -- $LIBERO_TOP=<unsigned>: (./ero -top)
+ *      List this many allocation sites with the most memory in use
+ *      at the beginning of the reports, with how much they have
+ *      allocated and freed so far.  They are kept count of as the
+ *      program runs, so it's cheap, and it works in terse mode too.
+ *   -- $LIBERO_SNAPSHOT={0|1}: (./ero -snapshot)
+ *      Only keep the program's allocations waiting while the records
+ *      are copied for a report, not while it's being looked up and
+ *      written.  Costs a copy of the records per report, except with
+ *      the folded and pprof formats, which only need the aggregates.
+ *   -- $LIBERO_SOCKET=<path>: (./mtero -socket)
+ *      Listen on a UNIX socket at <path> for commands, one per line,
+ *      each answered with "ok" or "error: <why>" after its output:
+ *      "start", "stop": Start or stop accounting for new allocations.
+ *      What's freed meanwhile is still taken out of the records.
+ *      "report [<path>]": Report now, in <path> if it's given.
+ *      "depth <n>", "karma <n>": Set $LIBERO_DEPTH or
+ *      $LIBERO_KARMA_DEPTH for what follows.
+ *      "stats": Print the overall counters as "<name>: <value>" lines.
+ *      Only in libero_mt.so, which serves it in a background thread.
+ *   -- $LIBERO_HUGEPAGES={0|1}: (./ero -hugepages)
+ *      Ask for transparent huge pages for libero's own bookkeeping,
+ *      which is kept in 2 MiB slabs apart from the program's heap.
  * -- $LIBERO_TERSE={0|1}: see ./ero -terse
  * }}}
  *
+ * Sampling: {{{
+ * Recording the backtrace of every allocation is expensive.  In sampling
+ * mode only those allocations are recorded which the sampled bytes fall
+ * into.  The bytes to sample are chosen by a per-thread countdown drawn
+ * from an exponential distribution whose mean is $LIBERO_SAMPLE_BYTES,
+ * just like tcmalloc's heap profiler does.  Thus an allocation of $size
+ * bytes is sampled with 1 - exp(-$size / $LIBERO_SAMPLE_BYTES) probability,
+ * and the report scales the sampled allocations up by the reciprocal of
+ * that to get unbiased estimates.  The ptr= lines look like:
+ *
+ * ptr=0x806f020, size=4181, karma=3, sampled=185
+ *
+ * where size is the estimated number of bytes allocated in this place
+ * represented by this one sample of 185 bytes.  The "currently" number of
+ * allocations is an estimate too, and the "current allocation" is counted
+ * in the usable size of the chunks, as reported by malloc_usable_size(),
+ * because it's the only thing we can tell about an unsampled chunk when
+ * it's freed.  It's exact for the chunks allocated while profiling, but
+ * freeing the chunks allocated before decreases it too (down to 0),
+ * because we can't tell them from the unsampled ones.
+ * }}}
+ *
  * Ex-Author:  Leonid Moiseichuk <leonid.moiseichuk@nokia.com>
  * Ex-Contact: Eero Tamminen     <eero.tamminen@nokia.com>
  * }}}
@@ -110,14 +178,18 @@
 #define _GNU_SOURCE
 //#define _THREAD_SAFE
 //#define CONFIG_FAST_UNWIND
+//#define CONFIG_CFI_UNWIND
 
 /* Include files */
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include <malloc.h>
+#include <limits.h>
 #include <string.h>
+#include <math.h>
 #include <stdio.h>
 #include <time.h>
 #include <signal.h>
@@ -125,12 +197,16 @@
 #ifdef _THREAD_SAFE
 # include <pthread.h>
 # include <sys/syscall.h>
+# include <sys/socket.h>
+# include <sys/un.h>
 #endif
 
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "libarf.c"
+#include "ero.h"
 
 /* Standard definitions */
 /* The signal that makes us start accounting or reporting.
@@ -138,6 +214,10 @@
  * $LIBERO_SIGNAL to a signal number like 2. */
 #define LIBERO_SIGNAL               SIGPROF
 
+/* The most stack frames $LIBERO_DEPTH may ask for.  capture() keeps
+ * them on its stack. */
+#define MAX_DEPTH                   1024
+
 /* Macros {{{ */
 /* Returns the number of elements in an array. */
 #define CAPACITY(a)                 (sizeof(a) / sizeof((a)[0]))
@@ -149,35 +229,97 @@
 /* Mock pthreads with NOPs -- it's much faster. */
 #ifndef _THREAD_SAFE
 # define IF_THREAD_SAFE(...)        /* NOP */
-
-# define pthread_self()             1
-# define pthread_equal(a, b)        ((a) == (b))
+# define THREAD_LOCAL               /* NOP */
 
 # define pthread_mutex_lock(...)    /* NOP */
 # define pthread_mutex_unlock(...)  /* NOP */
 #else
 # define IF_THREAD_SAFE(...)        __VA_ARGS__
+# define THREAD_LOCAL               \
+   __thread __attribute__((tls_model("initial-exec")))
 # define gettid()                   (pid_t)syscall(SYS_gettid)
 #endif
+
+/*
+ * The accounting is split into 1 << SHARD_BITS independent shards
+ * by the hash of the pointers, so that threads allocating at the
+ * same time rarely need to wait for each other.
+ */
+#ifdef _THREAD_SAFE
+# define SHARD_BITS                 6
+#else
+# define SHARD_BITS                 0
+#endif
+#define NSHARDS                     (1u << SHARD_BITS)
+
+/* The number of buckets in $Stacks. */
+#define NSTACK_BUCKETS              (1u << 16)
+
+/* The number of events a thread can trace() before flush()ing. */
+#define RING_SIZE                   (1u << 13)
+
+/*
+ * Our metadata is allocated from SLAB_SIZE large mmap()ed slabs
+ * in multiples of SLAB_ALIGN bytes, see meta_alloc().  Allocations
+ * larger than SLAB_MAX are mmap()ed on their own.  SLAB_SIZE is
+ * the size of a huge page on x86 and aarch64.
+ */
+#define SLAB_SIZE                   (2u << 20)
+#define SLAB_ALIGN                  16
+#define SLAB_MAX                    4096
 /* }}} */
 
 /* Type definitions {{{ */
-/* Stores a complete backtrace or a part of it. */
-struct backtrace_st
-{
-   /* 
-    * $addrs:  The addresses got from backtrace(), lower elements being
-    *          closer to the original call site.  A NULL element marks
-    *          the end of the backtrace and all the remaining elements
-    *          are NULLs.  The array size was chosen so that a pageful
-    *          of backtrace_st:s doesn't waste space
-    *          (PAGE_SIZE % ((7+1) * 4) == 0).
-    * $next:   If not NULL points to the next part of the backtrace.
-    *          The last part's (farthest from the original call site)
-    *          is NULL.
+/* The aggregates of the allocations made in a stack_st. */
+struct site_st
+{
+   /*
+    * $live_count, $live_bytes: How many allocations made in the stack
+    *             are in use, and their size.
+    * $peak_bytes: The largest $live_bytes has ever been.
+    * $allocated, $freed: The total number of bytes allocated and freed
+    *             in the stack.  In sampling mode the sizes are
+    *             estimated like in dump().
+    * $alloc_count: The number of allocations recorded in the stack.
+    * $live_objects, $alloc_objects: $live_count and $alloc_count,
+    *             but estimated like the sizes in sampling mode.
+    */
+   unsigned live_count;
+   size_t live_bytes, peak_bytes;
+   size_t allocated, freed;
+   unsigned long alloc_count;
+   size_t live_objects, alloc_objects;
+};
+
+/* An interned backtrace.  All allocations made in the same call stack
+ * share the same stack_st, which lives until the end of the program. */
+struct stack_st
+{
+   /*
+    * $next:      The next stack_st in the same bucket of $Stacks.
+    * $fresh:     When tracing, the next stack_st in $New_stacks.
+    * $members:   In report(), the records allocated in this stack.
+    * $nmembers:  The length of $members.
+    * $id:        Unique number of this stack_st.
+    * $hash:      Of $addrs, to make lookups faster.
+    * $rank:      In report(), the position of this stack_st among
+    *             the top allocation sites plus one, or 0.
+    * $site:      The aggregates of the allocations made in this stack,
+    *             updated atomically from any shard.
+    * $reported:  $site as of the last snapshot(), which the reports
+    *             are made of.
+    * $depth:     The number of $addrs.
+    * $addrs:     The addresses got from backtrace(), lower elements
+    *             being closer to the original call site.
     */
-   void const *addrs[7];
-   struct backtrace_st *next;
+   struct stack_st *next, *fresh;
+   struct ero_st *members;
+   unsigned nmembers, rank;
+
+   struct site_st site, reported;
+
+   unsigned id, hash, depth;
+   void const *addrs[];
 };
 
 /* Represents a memory allocation. */
@@ -189,17 +331,142 @@ struct ero_st
     * $ptr:       Points to the allocted memory.
     * $size:      Requested size of the allocated memory
     *             (the reservation can be larger though).
-    * $karma:     Since how many report()s have this allocation
-    *             been around.  The larger the more likely it's leaked.
-    * $backtrace: Where was it allocated initially.
+    * $born:      The $Epoch it was allocated in.  Its karma, the
+    *             number of report()s it's been around since, is
+    *             derived from it by karma().  The larger the karma
+    *             the more likely it's leaked.
+    * $stack:     Where was it allocated initially.
+    * $next:      Links the ero_st:s in ->ero_pool, or in report()
+    *             the records being sorted and dumped.
     */
    IF_THREAD_SAFE(unsigned tid);
    size_t size;
    void const *ptr;
-   unsigned karma;
-   struct backtrace_st *backtrace;
+   unsigned born;
+   struct stack_st *stack;
    struct ero_st *next;
 };
+
+/* The accounting of the allocations whose pointer hashes to this shard. */
+struct shard_st
+{
+   /*
+    * These guards are used to make sure at most one thread can do
+    * accounting (recording a new allocation, reporting about allocations
+    * etc) in a shard at a time.
+    *
+    * $mutex:        For mallfuncs, between different threads.
+    * $spinlock:     For mallfuncs and report_all(), between all threads.
+    *                If its value is 1 then somebody is accounting in
+    *                the shard.
+    *
+    * For accounting:
+    *
+    * $memories:     Open-addressing hash table of the currently known
+    *                allocations keyed by their ->ptr, so collect() and
+    *                regarbage() can find a record without a linear scan.
+    *                Collisions are resolved by linear probing, NULL marks
+    *                an empty slot.  The table has 1 << $memories_bits
+    *                slots and it's grown before it gets more than 3/4 full.
+    * $nmemories:    The number of records in $memories.
+    * $ero_pool:     NULL-terminated list of unused ero_st:s.
+    *                Consumed and filled from the head.
+    * $nallocations: Number of new allocations (additions to the records)
+    *                since the last report().
+    */
+   IF_THREAD_SAFE(pthread_mutex_t mutex);
+   volatile sig_atomic_t spinlock;
+
+   struct ero_st **memories, *ero_pool;
+   unsigned memories_bits, nmemories, nallocations;
+};
+
+/* A thread's buffer of events when tracing. */
+struct ring_st
+{
+   /*
+    * $head:      The number of events the thread has trace()d.
+    * $tail:      The number of events flush() has written.
+    *             Only the thread writes $head and only flush() writes
+    *             $tail, so they don't need locking.
+    * $tid:       The thread which owns the ring.
+    * $state:     RING_USED, RING_ORPHAN if the thread has exited,
+    *             or RING_FREE if it has been flush()ed since then,
+    *             and new threads can take it.
+    * $next:      The next ring_st in $Rings.
+    * $events:    The buffer itself.
+    */
+   volatile unsigned head, tail;
+   IF_THREAD_SAFE(unsigned tid);
+   volatile int state;
+   struct ring_st *next;
+   struct eroevt_st events[RING_SIZE];
+};
+
+/* For ring_st::state */
+enum { RING_USED, RING_ORPHAN, RING_FREE };
+
+/* For $Format */
+enum { FORMAT_TEXT, FORMAT_BINARY, FORMAT_FOLDED, FORMAT_PPROF };
+
+/* Protocol buffer wire types */
+enum { PB_VARINT = 0, PB_BYTES = 2 };
+
+/* A line of report_folded(). */
+struct folded_st
+{
+   char *frames;
+   size_t bytes;
+};
+
+/* A string of report_pprof()'s string table. */
+struct pprof_str_st
+{
+   /*
+    * $hash:      Of $str, for pprof_st::strhash.
+    * $function:  The id of the Function named $str, or 0.
+    */
+   char *str;
+   unsigned hash, function;
+};
+
+/* The address range of a Mapping. */
+struct pprof_map_st
+{
+   uintptr_t start, limit;
+};
+
+/* A slot of pprof_st::lochash. */
+struct pprof_loc_st
+{
+   void const *pc;
+   unsigned id;
+};
+
+/* The state of report_pprof(). */
+struct pprof_st
+{
+   /*
+    * $profile:   The encoded Profile message, but its string table.
+    * $msg:       The message being encoded to be added to $profile.
+    * $strings:   The string table, $nstrings long, of $strings_size.
+    * $strhash:   Open-addressing hash table of the indexes of $strings
+    *             plus one, of $strhash_size, 0 marking an empty slot.
+    * $maps:      The pprof_map_st:s of the Mappings, their ids being
+    *             their index plus one.
+    * $lochash:   Open-addressing hash table of the ids of the Locations
+    *             by their address, of $lochash_size.
+    * $nlocations, $nfunctions: The last ids given out.
+    */
+   struct bufhead_st profile, msg;
+   struct pprof_str_st *strings;
+   unsigned nstrings, strings_size;
+   unsigned *strhash, strhash_size;
+   struct bufhead_st maps;
+   struct pprof_loc_st *lochash;
+   unsigned lochash_size;
+   unsigned nlocations, nfunctions;
+};
 /* }}} */
 
 /* Function prototypes {{{ */
@@ -215,44 +482,69 @@ extern void  __libc_free(void *);
 
 /* Private variables {{{ */
 /*
- * These guards are used to make sure at most one thread can do accounting
- * (recording a new allocation, reporting about allocations etc) at a time.
+ * $Shards:         The accounting, see shard_st.
+ * $Reporting:      Set by report_all() while it holds all $Shards,
+ *                  so that concurrent report requests are ignored.
+ * $Report_pending: Set by sighand() if it interrupted a critical section
+ *                  of its own thread, which will report_all() in leave(),
+ *                  or libc's allocator, which will in leave_libc().
+ * $Holding:        The shard the thread is entering or accounting in.
+ * $In_libc:        The thread is in a __libc_*() mallfunc.
+ * $Accounting:     Whether the thread is in a critical section.
+ *                  Used to recognize recursion.
+ */
+static struct shard_st Shards[NSHARDS] =
+{
+   IF_THREAD_SAFE([0 ... NSHARDS-1] = { .mutex = PTHREAD_MUTEX_INITIALIZER })
+};
+static volatile sig_atomic_t Reporting, Report_pending;
+static THREAD_LOCAL struct shard_st *Holding;
+static THREAD_LOCAL int Accounting;
+static THREAD_LOCAL volatile sig_atomic_t In_libc;
+
+/*
+ * $Stacks:       Hash table of all stack_st:s seen, NSTACK_BUCKETS
+ *                long NULL-terminated lists.  Shared by all $Shards,
+ *                and modified without locking.
+ * $NStacks:      The number of stack_st:s created, and the last ->id.
+ */
+static struct stack_st **Stacks;
+static unsigned NStacks;
+
+/*
+ * For metadata, see meta_alloc():
  *
- * $Mutex:     For mallfuncs, between different threads.
- * $Spinlock:  For mallfuncs and sighand(), between all threads.
- *    If its value is 1 then somebody is doing accounting.
- *    If the value is 2 then sighand() wants the current
- *       accounter to report() when finished.
- * $Executor:  Which thread is accounting at the moment.
- *             Used to recognize recursion.
+ * $Slab:            Where to carve the next allocation from,
+ *                   $Slab_left bytes are left there.
+ * $Slab_free:       NULL-terminated lists of freed allocations
+ *                   of (i+1) * SLAB_ALIGN bytes.
+ * $Slab_lock:       Protects all of the above.
+ * $Hugepages:       Whether to ask for transparent huge pages for slabs.
+ *                   Set by $LIBERO_HUGEPAGES.
+ * $Metadata_mapped: The number of bytes mmap()ed for metadata.
+ * $Metadata_used:   How many bytes of that are allocated.
  */
-IF_THREAD_SAFE(static pthread_mutex_t Mutex = PTHREAD_MUTEX_INITIALIZER);
-static volatile sig_atomic_t Spinlock;
-static pthread_t Executor;
+static char *Slab;
+static size_t Slab_left;
+static void *Slab_free[SLAB_MAX / SLAB_ALIGN];
+IF_THREAD_SAFE(static pthread_mutex_t Slab_lock = PTHREAD_MUTEX_INITIALIZER);
+static int Hugepages;
+static size_t Metadata_mapped, Metadata_used;
 
 /*
- * For accounting:
+ * Global counters, shared by all $Shards and updated atomically:
  *
- * $Memories:     NULL-terminated list of currently known allocations.
- *                New allocations are prepended to this list.
- * $NMemories:    The length of $Memories.
- * $Ero_pool:     NULL-terminated list of unused ero_st:s.
- *                Consumed and filled from the head.
- * $Backtraces:   Like $Ero_pool for backtrace_st:s.
- * $NAllocations: Number of new allocations (additions to the records)
- *                since the last report().
  * $Allocated:    Number of bytes currently in use (in theory)
  *                by the program.
  * $Peak:         The lasrgest $Allocated since the last report().
  */
-static struct backtrace_st *Backtraces;
-static struct ero_st *Memories, *Ero_pool;
-static unsigned NMemories, NAllocations;
 static int Allocated, Peak;
 
 /*
  * $Profiling:       Do account for memory allocations (except for memory we
  *                   allocate for ourselves).
+ * $Collecting:      Profiling has been started, so there may be records
+ *                   to collect() even if it's been stopped since.
  * $End_to_end:      Account for memory allocations during the lifecycle of
  *                   the program and report when it's finished.
  * $Profiling_since: When we started counting allocations; it is written
@@ -263,35 +555,223 @@ static int Allocated, Peak;
  *                   to appear with to consider reporting it.
  * $Summary_only:    Don't save any backtraces at all and don't log
  *                   information about individual allocations.
+ * $Sample_bytes:    The mean number of bytes between samples, or 0 to
+ *                   record every allocation.
+ * $Format:          FORMAT_TEXT, or FORMAT_BINARY to write the reports
+ *                   in the format of ero.h for erodump to symbolize
+ *                   offline, FORMAT_FOLDED for flame graphs, or
+ *                   FORMAT_PPROF for pprof.
+ *                   Set by $LIBERO_FORMAT.
+ * $Epoch:           The number of snapshot()s made so far.  Records are
+ *                   aged by advancing it, rather than each of them.
+ * $Reported_epoch:  The $Epoch of the snapshot() being report()ed.
+ * $Top_sites:       How many allocation sites to list in the reports
+ *                   by the bytes in use.  Set by $LIBERO_TOP.
  */
-static int Profiling, End_to_end;
+static int Profiling, Collecting, End_to_end;
 static struct timeval Profiling_since;
 static int Backtrace_depth = -1;
 static unsigned Karma_min_depth;
 static int Summary_only;
+static unsigned long Sample_bytes;
+static int Format;
+static unsigned Epoch, Reported_epoch;
+static unsigned Top_sites;
+
+/*
+ * In snapshot mode:
+ *
+ * $Snapshot:         Release the $Shards as soon as snapshot() has
+ *                    copied what report() needs, rather than keeping
+ *                    the program waiting until the report is written.
+ *                    Set by $LIBERO_SNAPSHOT.
+ * $Snapshot_records: The copies of the records of all $Shards,
+ *                    $NSnapshot_records of them, or NULL if report()
+ *                    doesn't need them or they couldn't be copied.
+ */
+static int Snapshot;
+static struct ero_st *Snapshot_records;
+static unsigned NSnapshot_records;
+
+/*
+ * $Report_path:   Where report_all() was asked to report, instead of
+ *                 report_fname()'s choice.
+ * $Control_fd:    The socket controller() accepts clients on,
+ *                 bound to $Control_addr by the process $Control_pid.
+ */
+static char const *Report_path;
+#ifdef _THREAD_SAFE
+static int Control_fd = -1;
+static struct sockaddr_un Control_addr;
+static pid_t Control_pid;
+#endif
+
+/*
+ * In sampling mode:
+ *
+ * $NUnsampled:        The number of allocations since the last report()
+ *                     which weren't recorded.
+ * $Sample_countdown:  How many bytes the thread needs to allocate before
+ *                     the next sample.  0 until the first allocation.
+ * $Sample_seed:       The state of the thread's random number generator.
+ */
+static unsigned NUnsampled;
+static THREAD_LOCAL long Sample_countdown;
+static THREAD_LOCAL uint64_t Sample_seed;
+
+/*
+ * In tracing mode:
+ *
+ * $Tracing:        Don't keep records, but trace() the events for
+ *                  erodump to replay them.  Set by $LIBERO_TRACE.
+ * $Rings:          All threads' ring_st:s.  Only ever prepended to.
+ * $Ring:           The thread's own ring_st.
+ * $Ring_key:       To tell when the thread exits and its $Ring
+ *                  can be reused.
+ * $New_stacks:     The stack_st:s intern()ed since the last flush(),
+ *                  linked by their ->fresh.
+ * $Marker_pending: sighand() was asked to report, and flush() should
+ *                  write it at $Marker_time, $Marker_tv.
+ * $Profiling_since_ns: $Profiling_since in now_ns() time.
+ * $Drain_lock:     Serializes flush()es.
+ * $Drain_wakeup:   Posted by push() to make drainer() flush() early
+ *                  when a ring is getting full.
+ * $Events_fd:      The events file flush() writes, -1 until it's opened.
+ */
+static int Tracing;
+static struct ring_st *Rings;
+static THREAD_LOCAL struct ring_st *Ring;
+IF_THREAD_SAFE(static pthread_key_t Ring_key);
+static struct stack_st *New_stacks;
+static volatile sig_atomic_t Marker_pending;
+static uint64_t Marker_time;
+static struct timeval Marker_tv;
+static uint64_t Profiling_since_ns;
+IF_THREAD_SAFE(static pthread_mutex_t Drain_lock = PTHREAD_MUTEX_INITIALIZER);
+IF_THREAD_SAFE(static sem_t Drain_wakeup);
+static int Events_fd = -1;
 /* Private variables }}} */
 
 /* Program code */
 /* Internal memory management {{{ */
-/* Creates a new pool of ero_st:s or backtrace_st:s and initializes it
+/*
+ * Returns $size bytes of zeroed memory mmap()ed for our own use,
+ * so that our metadata doesn't show up in the program's heap and
+ * doesn't change its layout.  Small allocations are carved from
+ * slabs, and they are recycled through per-size free lists.
+ * Called in mallfuncs context.
+ */
+static void *meta_alloc(size_t size)
+{
+   char *ptr;
+   void **freelist;
+
+   if (size > SLAB_MAX)
+   {  /* It gets its own mapping. */
+      size_t pagesize;
+
+      pagesize = sysconf(_SC_PAGESIZE);
+      size = (size + pagesize-1) & ~(pagesize-1);
+      ptr = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (ptr == MAP_FAILED)
+         return NULL;
+      __sync_add_and_fetch(&Metadata_mapped, size);
+      __sync_add_and_fetch(&Metadata_used, size);
+      return ptr;
+   }
+
+   size = (size + SLAB_ALIGN-1) & ~(SLAB_ALIGN-1);
+   freelist = &Slab_free[size/SLAB_ALIGN - 1];
+   pthread_mutex_lock(&Slab_lock);
+   if ((ptr = *freelist) != NULL)
+   {  /* Recycle. */
+      *freelist = *(void **)ptr;
+      memset(ptr, 0, size);
+   } else
+   {
+      if (Slab_left < size)
+      {  /* Start a new slab, the rest of the current one is wasted.
+          * With $Hugepages map twice as much as needed, so we can
+          * trim it to an aligned huge page. */
+         size_t len;
+
+         len = Hugepages ? 2*SLAB_SIZE : SLAB_SIZE;
+         ptr = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+         if (ptr == MAP_FAILED)
+         {
+            pthread_mutex_unlock(&Slab_lock);
+            return NULL;
+         }
+
+         if (Hugepages)
+         {
+            char *aligned;
+
+            aligned = (char *)(((uintptr_t)ptr + SLAB_SIZE-1)
+                               & ~(uintptr_t)(SLAB_SIZE-1));
+            if (aligned > ptr)
+               munmap(ptr, aligned - ptr);
+            munmap(aligned + SLAB_SIZE, ptr + len - (aligned + SLAB_SIZE));
+            madvise(aligned, SLAB_SIZE, MADV_HUGEPAGE);
+            ptr = aligned;
+         }
+
+         Slab = ptr;
+         Slab_left = SLAB_SIZE;
+         __sync_add_and_fetch(&Metadata_mapped, SLAB_SIZE);
+      }
+
+      ptr = Slab;
+      Slab += size;
+      Slab_left -= size;
+   }
+   pthread_mutex_unlock(&Slab_lock);
+
+   __sync_add_and_fetch(&Metadata_used, size);
+   return ptr;
+} /* meta_alloc */
+
+/* Release $ptr of $size bytes allocated by meta_alloc(). */
+static void meta_free(void *ptr, size_t size)
+{
+   void **freelist;
+
+   if (!ptr)
+      return;
+
+   if (size > SLAB_MAX)
+   {
+      size_t pagesize;
+
+      pagesize = sysconf(_SC_PAGESIZE);
+      size = (size + pagesize-1) & ~(pagesize-1);
+      munmap(ptr, size);
+      __sync_sub_and_fetch(&Metadata_mapped, size);
+      __sync_sub_and_fetch(&Metadata_used, size);
+      return;
+   }
+
+   size = (size + SLAB_ALIGN-1) & ~(SLAB_ALIGN-1);
+   freelist = &Slab_free[size/SLAB_ALIGN - 1];
+   pthread_mutex_lock(&Slab_lock);
+   *(void **)ptr = *freelist;
+   *freelist = ptr;
+   pthread_mutex_unlock(&Slab_lock);
+   __sync_sub_and_fetch(&Metadata_used, size);
+} /* meta_free */
+
+/* Creates a new pool of ero_st:s and initializes it
  * by creating the linked list. */
 static void *new_pool(size_t size1, size_t nextoff)
 {
    char *ptr;
-   unsigned pagesize, n, i;
-
-   /* We know very well our $pagesize, no need to make it complicated. */
-   pagesize = 4096;
-   n = pagesize / size1;
-#if 1
-   /* It's perfectly okay to call malloc() in mallfuncs context,
-    * they are protected against reentrancy. */
-   ptr = malloc(size1 * n);
-#else
-   /* Slower but completely invisible to malloc(). */
-   ptr = mmap(NULL, pagesize, PROT_READ|PROT_WRITE, MAP_PRIVATE, -1, 0);
-#endif
-   if (!ptr)
+   unsigned n, i;
+
+   /* As many as fit in a slab allocation. */
+   n = SLAB_MAX / size1;
+   if (!(ptr = meta_alloc(size1 * n)))
       return NULL;
 
    /* Initialize the new linked list. */
@@ -306,52 +786,201 @@ static struct ero_st *new_ero_pool(void)
 {
    return new_pool(sizeof(struct ero_st), offsetof(struct ero_st, next));
 } /* new_ero_pool */
+/* Internal memory management }}} */
 
-static struct backtrace_st *new_backtraces(void)
+/* Pointer index {{{ */
+/* Returns the shard which accounts for $ptr.  It's decided by the top
+ * bits of the hash, the rest is left for home_of(). */
+static struct shard_st *shard_of(void const *ptr)
 {
-   return new_pool(sizeof(struct backtrace_st),
-      offsetof(struct backtrace_st, next));
-} /* new_backtraces */
-/* Internal memory management }}} */
+#if SHARD_BITS > 0
+   return &Shards[((uintptr_t)ptr * GOLDEN_RATIO)
+      >> (sizeof(uintptr_t)*8 - SHARD_BITS)];
+#else
+   return &Shards[0];
+#endif
+} /* shard_of */
 
-/* Sorting {{{ */
-static int compare_backtraces(
-   struct backtrace_st const *bt1, struct backtrace_st const *bt2)
+/* Returns the slot of $sh->memories where the search for $ptr starts. */
+static unsigned home_of(struct shard_st const *sh, void const *ptr)
 {
-   /* Compare the backtraces part by part. */
-   for (;;)
+   return (((uintptr_t)ptr * GOLDEN_RATIO) << SHARD_BITS)
+      >> (sizeof(uintptr_t)*8 - sh->memories_bits);
+} /* home_of */
+
+/* Returns the slot of $sh->memories which holds the record of $ptr,
+ * or the empty slot where it should be inserted. */
+static unsigned slot_of(struct shard_st const *sh, void const *ptr)
+{
+   unsigned i, mask;
+
+   mask = (1u << sh->memories_bits) - 1;
+   for (i = home_of(sh, ptr);
+         sh->memories[i] && sh->memories[i]->ptr != ptr;
+         i = (i+1) & mask)
+      ;
+   return i;
+} /* slot_of */
+
+/* Double the size of $sh->memories or allocate it in the first place.
+ * The initial size is some pools' worth of ero_st:s. */
+static int grow_memories(struct shard_st *sh)
+{
+   struct ero_st **old;
+   unsigned bits, oldsize, i;
+
+   if (sh->memories)
+      bits = sh->memories_bits + 1;
+   else
+      for (bits = 1; (1u << bits) < 4 * SLAB_MAX/sizeof(struct ero_st);
+           bits++)
+         ;
+
+   old = sh->memories;
+   oldsize = old ? 1u << sh->memories_bits : 0;
+   if (!(sh->memories = meta_alloc(sizeof(*sh->memories) << bits)))
    {
-      int cmp;
+      sh->memories = old;
+      return 0;
+   }
+   sh->memories_bits = bits;
+
+   /* Rehash the records. */
+   for (i = 0; i < oldsize; i++)
+      if (old[i])
+         sh->memories[slot_of(sh, old[i]->ptr)] = old[i];
+   meta_free(old, sizeof(*old) * oldsize);
 
-      if (!bt1 && !bt2)
-         return  0;
-      else if (!bt1)
-         return -1;
-      else if (!bt2)
-         return  1;
+   return 1;
+} /* grow_memories */
 
-      cmp = memcmp(bt1->addrs, bt2->addrs, sizeof(bt1->addrs));
-      if (cmp != 0)
-         return cmp;
+/* Ensure that $sh->memories can take one more record,
+ * growing it if it's getting crowded. */
+static int make_room(struct shard_st *sh)
+{
+   if ((sh->nmemories+1) * 4 <= (sh->memories ? 3u << sh->memories_bits : 0))
+      return 1;
+   if (grow_memories(sh))
+      return 1;
+
+   /* Keep at least one empty slot for slot_of(). */
+   return sh->nmemories+1 < 1u << sh->memories_bits;
+} /* make_room */
+
+/* Remove the record in the $i:th slot of $sh->memories.  The records
+ * after it in the same cluster are shifted back so that slot_of() can
+ * still find them without tombstones. */
+static void unindex(struct shard_st *sh, unsigned i)
+{
+   unsigned j, home, mask;
 
-      bt1 = bt1->next;
-      bt2 = bt2->next;
+   mask = (1u << sh->memories_bits) - 1;
+   for (j = (i+1) & mask; sh->memories[j]; j = (j+1) & mask)
+   {
+      /* Can $sh->memories[j] be moved to the hole at $i?
+       * Only if its $home is not cyclically in ($i, $j]. */
+      home = home_of(sh, sh->memories[j]->ptr);
+      if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+         continue;
+      sh->memories[i] = sh->memories[j];
+      i = j;
    }
+   sh->memories[i] = NULL;
+} /* unindex */
+/* Pointer index }}} */
 
-   return 0;
-} /* compare_backtraces */
+/* Interned stacks {{{ */
+/* Returns the hash of a backtrace. */
+static unsigned hash_stack(void *const *addrs, unsigned depth)
+{
+   uintptr_t hash;
+   unsigned i;
 
-static int compare(struct ero_st const *mem1, struct ero_st const *mem2)
+   hash = depth;
+   for (i = 0; i < depth; i++)
+      hash = (hash ^ (uintptr_t)addrs[i]) * GOLDEN_RATIO;
+   return hash >> (sizeof(hash)*8 - sizeof(unsigned)*8);
+} /* hash_stack */
+
+/*
+ * Return the stack_st of the $depth long backtrace $addrs, creating it
+ * if it's new.  Called in mallfuncs context from any shard concurrently,
+ * so $Stacks is only ever modified by atomically prepending to a bucket.
+ * Others may only add stack_st:s to the bucket in the meantime, so if
+ * that fails it's enough to look at the new ones before retrying.
+ */
+static struct stack_st *intern(void *const *addrs, unsigned depth)
 {
-   int cmp;
+   unsigned hash;
+   struct stack_st *stack, *head, *seen, *st, **bucket;
+
+   if (!depth)
+      return NULL;
+
+   /* Allocate $Stacks if we're the first ones here. */
+   if (!Stacks)
+   {
+      struct stack_st **buckets;
+
+      if (!(buckets = meta_alloc(sizeof(*buckets) * NSTACK_BUCKETS)))
+         return NULL;
+      if (!__sync_bool_compare_and_swap(&Stacks, NULL, buckets))
+         meta_free(buckets, sizeof(*buckets) * NSTACK_BUCKETS);
+   }
+
+   hash = hash_stack(addrs, depth);
+   bucket = &Stacks[hash % NSTACK_BUCKETS];
+   stack = seen = NULL;
+   for (;;)
+   {
+      head = *bucket;
+      for (st = head; st != seen; st = st->next)
+         if (st->hash == hash && st->depth == depth
+               && !memcmp(st->addrs, addrs, sizeof(*addrs) * depth))
+         {
+            if (stack)
+               meta_free(stack, sizeof(*stack) + sizeof(*addrs) * depth);
+            return st;
+         }
+
+      if (!stack)
+      {
+         if (!(stack = meta_alloc(sizeof(*stack) + sizeof(*addrs) * depth)))
+            return NULL;
+         stack->members = NULL;
+         stack->nmembers = 0;
+         stack->id = __sync_add_and_fetch(&NStacks, 1);
+         stack->hash = hash;
+         stack->depth = depth;
+         memcpy(stack->addrs, addrs, sizeof(*addrs) * depth);
+      }
 
-   /* If the backtraces are the same let the higher karma win. */
-   cmp = compare_backtraces(mem1->backtrace, mem2->backtrace);
-   if (cmp != 0)
-      return cmp;
-   if (mem1->karma > mem2->karma)
+      stack->next = head;
+      if (!__sync_bool_compare_and_swap(bucket, head, stack))
+      {
+         seen = head;
+         continue;
+      }
+
+      /* Let flush() know about it. */
+      if (Tracing)
+         do
+            stack->fresh = New_stacks;
+         while (!__sync_bool_compare_and_swap(&New_stacks,
+                  stack->fresh, stack));
+      return stack;
+   } /* for */
+} /* intern */
+/* Interned stacks }}} */
+
+/* Sorting {{{ */
+/* Let the higher karma, the earlier birth win.  All records being
+ * sorted share the same stack, see report(). */
+static int compare(struct ero_st const *mem1, struct ero_st const *mem2)
+{
+   if (mem1->born < mem2->born)
       return -1;
-   else if (mem1->karma < mem2->karma)
+   else if (mem1->born > mem2->born)
       return  1;
    else
       return 0;
@@ -453,381 +1082,1775 @@ static struct ero_st *sort(struct ero_st *list, unsigned nlist)
 /* Sorting }}} */
 
 /* Accounting {{{ */
-/* Add $ptr to the records.  Called in mallfuncs context. */
-static void *garbage(void *ptr, size_t size, int intracall)
+/* Add $delta to $Allocated and keep $Peak up to date.  $Allocated
+ * is not let below 0, see account_usable(). */
+static void account(int delta)
 {
-   struct ero_st *mem;
-   unsigned i, top, bottom;
+   int prev, now, peak;
 
-   if (!ptr)
-      /* malloc() failed, don't record. */
-      return NULL;
+   do
+   {
+      prev = Allocated;
+      now = prev + delta > 0 ? prev + delta : 0;
+   } while (!__sync_bool_compare_and_swap(&Allocated, prev, now));
+   while ((peak = Peak) < now
+         && !__sync_bool_compare_and_swap(&Peak, peak, now))
+      ;
+} /* account */
+
+/* Add $delta to $Allocated unless in sampling mode,
+ * where it's accounted for by account_usable(). */
+static void account_record(int delta)
+{
+   if (!Sample_bytes)
+      account(delta);
+} /* account_record */
+
+/* In sampling mode $Allocated is the sum of the usable size of all
+ * chunks, sampled or not.  Account for $ptr being allocated or freed
+ * according to $sign.  We can't tell whether a chunk being freed was
+ * allocated while profiling, so those allocated before are subtracted
+ * too, and $Allocated can be less than it should be, but account()
+ * keeps it from going negative. */
+static void account_usable(void *ptr, int sign)
+{
+   if (Sample_bytes && ptr)
+      account(sign * (int)malloc_usable_size(ptr));
+} /* account_usable */
+
+/* Returns the number of bytes to allocate until the next sample.
+ * It's exponentially distributed, so the samples make a Poisson
+ * process in the allocated bytes. */
+static long sample_interval(void)
+{
+   double u;
+
+   /* Get a uniform random $u in [0, 1) with xorshift64*. */
+   if (!Sample_seed)
+      Sample_seed = ((uintptr_t)&Sample_seed ^ time(NULL)) | 1;
+   Sample_seed ^= Sample_seed >> 12;
+   Sample_seed ^= Sample_seed << 25;
+   Sample_seed ^= Sample_seed >> 27;
+   u = ((Sample_seed * 2685821657736338717ULL) >> 11)
+      * (1.0 / (1ULL << 53));
+
+   return 1 + (long)(-log(1.0 - u) * Sample_bytes);
+} /* sample_interval */
+
+/* Decide whether the new allocation of $size bytes at $ptr is to be
+ * recorded.  In sampling mode the others are only counted here. */
+static int sample(void *ptr, size_t size)
+{
+   if (!ptr || !Profiling || Accounting)
+      return 0;
+   if (!Sample_bytes)
+      return 1;
 
-   /* Update the counters whether we can make a record or not. */
-   NAllocations++;
-   Allocated += size;
-   if (Peak < Allocated)
-      Peak = Allocated;
+   account_usable(ptr, +1);
+   if (!Sample_countdown)
+      Sample_countdown = sample_interval();
+   if ((Sample_countdown -= size) > 0)
+   {
+      __sync_add_and_fetch(&NUnsampled, 1);
+      return 0;
+   }
 
-   /* We are permitted to clobber errno because our caller
-    * is going to return with success. */
-   if (!Ero_pool && !(Ero_pool = new_ero_pool()))
-      return ptr;
+   Sample_countdown = sample_interval();
+   return 1;
+} /* sample */
 
-   mem = Ero_pool;
-   Ero_pool = Ero_pool->next;
-   mem->next = Memories;
-   Memories = mem;
-   NMemories++;
+/* How many allocations of $size bytes does a sample represent? */
+static double sample_weight(size_t size)
+{
+   double p;
 
-   mem->ptr = ptr;
-   mem->size = size;
-   mem->karma = 0;
-   IF_THREAD_SAFE(mem->tid = gettid());
+   p = -expm1(-(double)size / Sample_bytes);
+   return p > 0 ? 1 / p : 1;
+} /* sample_weight */
 
-   mem->backtrace = NULL;
-   if (!Backtrace_depth)
-      goto skip_backtrace;
-   if (!Backtraces && !(Backtraces = new_backtraces()))
-      goto skip_backtrace;
-   mem->backtrace = Backtraces;
+/* Let addr_is() reread the maps when it meets an address which was
+ * unmapped before, like on a new thread's stack or one that's grown.
+ * Only getlr() cares. */
+#ifdef CONFIG_FAST_UNWIND
+# define renew_maps()      __atomic_add_fetch(&Maps_gen, 1, __ATOMIC_RELAXED)
+#else
+# define renew_maps()      /* NOP */
+#endif
 
-   /* We're called through fun() -> malloc() -> garbage(),
-    * ignore the top two frames.  The bottom two frames
-    * are below main(), ignore them too. */
-   top = 2;
-   if (intracall)
-      /* An accountant function called another hook, ignore that too. */
-      top++;
+/* Intern the backtrace of the current allocation.  Returns NULL if
+ * we don't care about backtraces.  Called in mallfuncs context. */
+static __attribute__((noinline)) struct stack_st *capture(void)
+{
+   unsigned i, top, bottom;
+   int max_depth;
+#ifdef CONFIG_FAST_UNWIND
+   static THREAD_LOCAL int seen_stack;
+#endif
+
+   /* It may be changed through the control socket meanwhile. */
+   if (!(max_depth = Backtrace_depth))
+      return NULL;
 
+   /* We're called through fun() -> malloc() -> garbage() or trace()
+    * -> capture(), ignore the top three frames.  The bottom frames
+    * are below main(), ignore them too. */
+   top = 3;
 #ifndef CONFIG_FAST_UNWIND
+   bottom = 2;
+#else
+   /* getlr() starts with our caller, and arf leaves less junk
+    * at the bottom than backtrace().  On x86-64 and aarch64 it
+    * stops at main(), because libc has no frame pointers. */
+   top--;
+# if defined(__x86_64__) || defined(__aarch64__)
+   bottom = 0;
+# else
+   bottom = 1;
+# endif
+
+   /* The stack of a new thread may not be in the maps yet. */
+   if (!seen_stack)
+   {
+      renew_maps();
+      seen_stack = 1;
+   }
+#endif
+
    /* Try getting the backtrace until $addrs is large enough.
     * Start with a large buffer to get away with as few retries
     * as possible. */
-   bottom = 2;
-   for (i = Backtrace_depth > 0 ? top+Backtrace_depth : 100; ; i += 100)
+   for (i = max_depth > 0 ? top+max_depth : 100; ; i += 100)
    {
+      int complete;
       unsigned depth;
       void *addrs[i];
-      struct backtrace_st *next;
 
-      if ((depth = backtrace(addrs, i)) >= i && Backtrace_depth < 0)
+#if defined(CONFIG_CFI_UNWIND)
+      depth = cfi_backtrace(addrs, i);
+      complete = depth < i;
+#elif !defined(CONFIG_FAST_UNWIND)
+      depth = backtrace(addrs, i);
+      complete = depth < i;
+#else
+      void const *sseg;
+      void const *const *fp;
+
+      sseg = NULL;
+      fp = __builtin_frame_address(0);
+      for (depth = 0; depth < i; depth++)
+         if (!(fp = getlr(fp, (void const **)&addrs[depth], &sseg)))
+            break;
+      complete = !fp;
+#endif
+
+      if (!complete && max_depth < 0)
          /* $addrs was too small. */
          continue;
 
       if (depth > top)
       {  /* Ignore $top frames. */
          depth -= top;
-         if (top+depth < i && depth > bottom)
+         if (complete && depth > bottom)
             /* If we got the full backtrace also ignore
              * the $bottom frames. */
             depth -= bottom;
       } else /* Don't ignore anyhing. */
          top = 0;
 
-      /* Add the backtrace to $mem.  If #depth is larger than the CAPACITY
-       * of backtrace_st chain up more. */
-      for (;;)
-      {
-         int more;
-         unsigned n;
-
-         n = CAPACITY(Backtraces->addrs);
-         more = n < depth;
-         if (n > depth)
-            n = depth;
-
-         memcpy(Backtraces->addrs, &addrs[top], sizeof(addrs[0]) * n);
-         if (!more)
-         {
-            /* NULL-pad the unused $addrs, so compare_backtraces() won't
-             * tell apart identical backtraces because of garbage. */
-            memset(&Backtraces->addrs[n], 0,
-               sizeof(Backtraces->addrs[0]) * (CAPACITY(Backtraces->addrs)-n));
-            break;
-         }
-
-         if (!Backtraces->next && !(Backtraces->next = new_backtraces()))
-            /* The bottom of the backtrace will be lost. */
-            break;
-         Backtraces = Backtraces->next;
-         top   += n;
-         depth -= n;
-      } /* for */
-      next = Backtraces->next;
-      Backtraces->next = NULL;
-      Backtraces = next;
-
-      break;
+      return intern(&addrs[top], depth);
    } /* for */
-#else /* CONFIG_FAST_UNWIND */
-   /* We need to be able to store at least $top addresses.
-    * If not, ignoring top/bottom frames may break. */
-   ASSERT(CAPACITY(Backtraces->addrs) >= 3);
-
-   /* arf leaves less junk at the bottom than backtrace(). */
-   bottom = 1;
+} /* capture */
 
-   do
-   {
-      unsigned depth;
-      void const *sseg;
-		void const *const *fp, *lr;
-      struct backtrace_st *prev, *next;
+/* Returns how many bytes an allocation of $size stands for. */
+static size_t site_size(size_t size)
+{
+   return Sample_bytes ? size * sample_weight(size) + 0.5 : size;
+} /* site_size */
 
-      /* We don't know beforehand the depth of the backtrace,
-       * so store the addresses in $Backtraces as we unwind
-       * the stack iteratively. */
-      prev = NULL;
-      sseg = NULL;
-		fp = __builtin_frame_address(0);
-		for (i = depth = 0; ; i++, depth++)
-		{
-         if (!(fp = getlr(fp, &lr, &sseg))
-            || (Backtrace_depth > 0 && depth >= Backtrace_depth))
-         {  /* End of backtrace, ignore the bottom frames if we can. */
-            if (!fp && !top && depth > bottom)
-            {
-               if (i <= bottom)
-               {  /* The addresses in $Backtraces are all ignored,
-                   * discard the whole page. */
-                  Backtraces = prev;
-                  i += CAPACITY(Backtraces->addrs) - bottom;
-               } else
-                  i -= bottom;
-            }
-
-            /* Zero out the unused slots (which can be 0). */
-            memset(&Backtraces->addrs[i], 0,
-               sizeof(Backtraces->addrs[0])
-                  * (CAPACITY(Backtraces->addrs)-i));
-            break;
-         }
+/* Returns how many allocations one of $size bytes stands for. */
+static size_t site_objects(size_t size)
+{
+   return Sample_bytes ? sample_weight(size) + 0.5 : 1;
+} /* site_objects */
 
-         if (depth == top)
-            /* Time to ignore $top. */
-            i = depth = top = 0;
-         else if (i >= CAPACITY(Backtraces->addrs))
-         {  /* $Backtraces is full, get a new page. */
-            if (!Backtraces->next && !(Backtraces->next = new_backtraces()))
-               break;
-            prev = Backtraces;
-            Backtraces = Backtraces->next;
-            i = 0;
-         }
+/* Add an allocation of $size bytes to the aggregates of $stack. */
+static void site_alloc(struct stack_st *stack, size_t size)
+{
+   size_t live, peak, objects;
 
-         Backtraces->addrs[i] = lr;
-		} /* for */
+   if (!stack)
+      return;
 
-      /* NULL-terminate $mem->backtaces and dequeue the tail
-       * from $Backtraces. */
-      next = Backtraces->next;
-      Backtraces->next = NULL;
-      Backtraces = next;
-   } while (0);
-#endif /* CONFIG_FAST_UNWIND */
+   objects = site_objects(size);
+   size = site_size(size);
+   __sync_add_and_fetch(&stack->site.live_count, 1);
+   __sync_add_and_fetch(&stack->site.alloc_count, 1);
+   __sync_add_and_fetch(&stack->site.live_objects, objects);
+   __sync_add_and_fetch(&stack->site.alloc_objects, objects);
+   __sync_add_and_fetch(&stack->site.allocated, size);
+   live = __sync_add_and_fetch(&stack->site.live_bytes, size);
+   while ((peak = stack->site.peak_bytes) < live
+          && !__sync_bool_compare_and_swap(&stack->site.peak_bytes,
+                                           peak, live))
+      ;
+} /* site_alloc */
+
+/* Remove an allocation of $size bytes from the aggregates of $stack. */
+static void site_free(struct stack_st *stack, size_t size)
+{
+   if (!stack)
+      return;
 
-skip_backtrace:
-   return ptr;
-} /* garbage */
+   __sync_sub_and_fetch(&stack->site.live_objects, site_objects(size));
+   size = site_size(size);
+   __sync_sub_and_fetch(&stack->site.live_count, 1);
+   __sync_sub_and_fetch(&stack->site.live_bytes, size);
+   __sync_add_and_fetch(&stack->site.freed, size);
+} /* site_free */
 
-/* Change $ptr's records.  Called in mallfuncs context. */
-static void *regarbage(void *ptr, void *newptr, size_t size)
+/* Add $ptr to the records of $sh, its shard.
+ * Called in mallfuncs context. */
+static void *garbage(struct shard_st *sh, void *ptr, size_t size)
 {
-   struct ero_st *prev, *mem;
+   struct ero_st *mem;
+   unsigned i;
 
-   if (!newptr)
+   if (!ptr)
+      /* malloc() failed, don't record. */
       return NULL;
 
-   /* Adjust the ->size of $ptr's $mem if we alredy keep a record of it. */
-   for (prev = NULL, mem = Memories; mem; prev = mem, mem = mem->next)
-      if (mem->ptr == ptr)
-      {
-         NAllocations++;
-         Allocated += size - mem->size;
-         if (Peak < Allocated)
-            Peak = Allocated;
-
-         mem->ptr = newptr;
-         mem->size = size;
+   /* Update the counters whether we can make a record or not. */
+   sh->nallocations++;
+   account_record(size);
 
-         /* Try to keep the head of $Memories hot and move $mem there. */
-         if (prev)
-         {
-            prev->next = mem->next;
-            mem->next = Memories;
-            Memories = mem;
-         }
+   /* We are permitted to clobber errno because our caller
+    * is going to return with success. */
+   if (!make_room(sh))
+      return ptr;
 
-         return newptr;
-      }
+   i = slot_of(sh, ptr);
+   if ((mem = sh->memories[i]) != NULL)
+   {  /* We missed that $ptr was freed.  Reuse its stale record. */
+      account_record(-mem->size);
+      site_free(mem->stack, mem->size);
+   } else if (!sh->ero_pool && !(sh->ero_pool = new_ero_pool()))
+      return ptr;
+   else
+   {
+      mem = sh->ero_pool;
+      sh->ero_pool = mem->next;
+      sh->memories[i] = mem;
+      sh->nmemories++;
+   }
+
+   mem->ptr = ptr;
+   mem->size = size;
+   mem->born = Epoch;
+   IF_THREAD_SAFE(mem->tid = gettid());
+   mem->stack = capture();
+   site_alloc(mem->stack, size);
+
+   return ptr;
+} /* garbage */
+
+/* Take $ptr's record out of $sh, its shard, so that regarbage() can
+ * file it in $newptr's shard.  Until then it's not accounted for
+ * in $Allocated either.  Called in mallfuncs context. */
+static struct ero_st *unrecord(struct shard_st *sh, void const *ptr)
+{
+   unsigned i;
+   struct ero_st *mem;
+
+   if (!sh->memories || !(mem = sh->memories[i = slot_of(sh, ptr)]))
+      return NULL;
+   unindex(sh, i);
+   sh->nmemories--;
+   account_record(-mem->size);
+   site_free(mem->stack, mem->size);
+
+   return mem;
+} /* unrecord */
+
+/* File $mem, the unrecord()ed record of a realloc()ed pointer
+ * in $sh, the shard of $newptr.  Called in mallfuncs context. */
+static void *regarbage(struct shard_st *sh, struct ero_st *mem,
+   void *newptr, size_t size)
+{
+   unsigned i;
+   struct ero_st *stale;
+
+   /* Adjust the ->size of $mem. */
+   sh->nallocations++;
+   account_record(size);
+   mem->ptr = newptr;
+   mem->size = size;
+   site_alloc(mem->stack, size);
+
+   /* Make room for $mem in $sh->memories.  If we can't, drop it. */
+   if (!make_room(sh))
+   {
+      account_record(-mem->size);
+      site_free(mem->stack, mem->size);
+      mem->next = sh->ero_pool;
+      sh->ero_pool = mem;
+      return newptr;
+   }
 
-   /* Haven't seen $ptr yet. */
-   return garbage(newptr, size, 1);
+   i = slot_of(sh, newptr);
+   if ((stale = sh->memories[i]) != NULL)
+   {  /* Like in garbage(). */
+      account_record(-stale->size);
+      site_free(stale->stack, stale->size);
+      stale->next = sh->ero_pool;
+      sh->ero_pool = stale;
+   } else
+      sh->nmemories++;
+   sh->memories[i] = mem;
+
+   return newptr;
 } /* regarbage */
 
-/* Delete $ptr's record.  Called in mallfuncs context. */
-static void collect(void const *ptr)
+/* Delete $ptr's record from $sh, its shard.
+ * Called in mallfuncs context. */
+static void collect(struct shard_st *sh, void const *ptr)
+{
+   struct ero_st *mem;
+
+   /* Find $ptr in $sh->memories and remove it. */
+   if (!(mem = unrecord(sh, ptr)))
+      return;
+
+   /* Add $mem to $sh->ero_pool. */
+   mem->next = sh->ero_pool;
+   sh->ero_pool = mem;
+} /* collect */
+
+/* Returns how many report()s $mem has been around before this one. */
+static unsigned karma(struct ero_st const *mem)
+{
+   return Reported_epoch - mem->born;
+} /* karma */
+
+/* Print the backtrace of $depth $addrs onto $out.  bt0() logs onto
+ * stderr unless it's buffering, so buffer it and write it there. */
+static void print_backtrace(FILE *out,
+   void const *const *addrs, unsigned depth)
+{
+   unsigned i;
+
+   begin_output();
+   for (i = 0; i < depth; i++)
+      bt0(i+1, addrs[i], NULL);
+   fflush(out);
+   write_output(fileno(out));
+} /* print_backtrace */
+
+/* Dump the $nlist records of $list, all allocated in $stack,
+ * and the $stack itself. */
+static void dump(FILE *out, struct stack_st const *stack,
+   struct ero_st *list, unsigned nlist)
 {
-   struct ero_st *prev, *mem;
+   unsigned karmas;
+   struct ero_st *mem, *prev;
 
-   /* Find $ptr in $Memories. */
-   for (mem = Memories, prev = NULL; mem; prev = mem, mem = mem->next)
+   /* It makes little sense to sort without backtraces. */
+   if (stack)
+      list = sort(list, nlist);
+
+   karmas = 0;
+   for (prev = NULL, mem = list; mem; prev = mem, mem = mem->next)
    {
-      if (mem->ptr == ptr)
-      {
-         struct backtrace_st *bt;
+#ifdef _THREAD_SAFE
+      fprintf(out, "ptr=%p (tid=%u), ", mem->ptr, mem->tid);
+#else
+      fprintf(out, "ptr=%p, ", mem->ptr);
+#endif
+      if (!Sample_bytes)
+         fprintf(out, "size=%zu, karma=%u\n",
+            mem->size, karma(mem));
+      else
+         fprintf(out, "size=%.0f, karma=%u, sampled=%zu\n",
+            mem->size * sample_weight(mem->size), karma(mem),
+            mem->size);
+
+      /* Count with how many different karmas have we seen
+       * the same backtrace. */
+      if (!prev || prev->born != mem->born)
+         karmas++;
+   }
 
-         /* Remove $mem from $Memories and add to $Ero_pool. */
-         if (prev)
-            prev->next = mem->next;
-         else
-            Memories = mem->next;
-         NMemories--;
-         Allocated -= mem->size;
-
-         if (mem->backtrace)
-         {  /* Return the backtrace segments to $Backtraces. */
-            for (bt = mem->backtrace; bt->next; bt = bt->next)
-               ;
-            bt->next = Backtraces;
-            Backtraces = mem->backtrace;
-         }
+   /* Dump the backtrace. */
+   if (stack && karmas >= Karma_min_depth)
+      print_backtrace(out, stack->addrs, stack->depth);
+} /* dump */
 
-         mem->next = Ero_pool;
-         Ero_pool = mem;
+/* Chain up $mem to the $members of its stack, or to $unknownp
+ * if it doesn't have one. */
+static void gather1(struct ero_st *mem,
+   struct ero_st **unknownp, unsigned *nunknownp)
+{
+   if (mem->stack)
+   {
+      mem->next = mem->stack->members;
+      mem->stack->members = mem;
+      mem->stack->nmembers++;
+   } else
+   {
+      mem->next = *unknownp;
+      *unknownp = mem;
+      (*nunknownp)++;
+   }
+} /* gather1 */
 
-         return;
-      }
+/* Chain up the records of all $Shards, or their $Snapshot_records,
+ * allocated in the same stack to its $members.  Returns those without
+ * a backtrace in $unknownp. */
+static void gather(struct ero_st **unknownp, unsigned *nunknownp)
+{
+   unsigned i;
+
+   *unknownp = NULL;
+   *nunknownp = 0;
+   if (Snapshot_records)
+   {
+      for (i = 0; i < NSnapshot_records; i++)
+         gather1(&Snapshot_records[i], unknownp, nunknownp);
+      return;
    }
-} /* collect */
 
-/* Report on the $Memories currently in use.
- * Can be called either in mallfuncs or signal context,
- * or from the library destructor. */
-static void report(void)
+   for (i = 0; i < NSHARDS; i++)
+   {
+      unsigned o;
+      struct ero_st *mem;
+      struct shard_st *sh;
+
+      sh = &Shards[i];
+      if (!sh->memories)
+         continue;
+      for (o = 0; o < 1u << sh->memories_bits; o++)
+         if ((mem = sh->memories[o]) != NULL)
+            gather1(mem, unknownp, nunknownp);
+   } /* for all $Shards */
+} /* gather */
+
+/* Fill $tops with the at most $Top_sites stack_st:s which have
+ * the most bytes in use, in descending order, and set their ->rank.
+ * Returns how many there are. */
+static unsigned rank_sites(struct stack_st **tops)
 {
-   static unsigned nreports;
-   static int previous;
-   struct tm tm;
-   struct timeval now;
-   char buf[64];
+   unsigned i, o, n;
+   struct stack_st *stack;
+
+   n = 0;
+   for (i = 0; Stacks && i < NSTACK_BUCKETS; i++)
+      for (stack = Stacks[i]; stack; stack = stack->next)
+      {
+         if (!stack->reported.live_bytes)
+            continue;
+         if (n == Top_sites && tops[n-1]->reported.live_bytes
+               >= stack->reported.live_bytes)
+            continue;
+
+         /* Insert $stack in its place, dropping the last one if full. */
+         for (o = n < Top_sites ? n++ : n-1;
+              o > 0 && tops[o-1]->reported.live_bytes
+                  < stack->reported.live_bytes; o--)
+            tops[o] = tops[o-1];
+         tops[o] = stack;
+      }
+
+   for (i = 0; i < n; i++)
+      tops[i]->rank = i+1;
+   return n;
+} /* rank_sites */
+
+/* Returns the file name to report() in, with the $suffix, unless
+ * report_all() was given a $Report_path.  Get it right even after
+ * a fork(). */
+static char const *report_fname(char const *suffix)
+{
+   static char buf[64];
    char const *prg;
-   int saved_errno;
-   FILE *saved_stderr;
-   struct ero_st *mem;
 
-   saved_errno = errno;
-   saved_stderr = stderr;
+   if (Report_path)
+      return Report_path;
 
-   /* Construct the output file name.  Get it right even after a fork(). */
    if (!(prg = strrchr(program_invocation_short_name, '/')))
       prg = program_invocation_short_name;
    else
       prg++;
-   snprintf(buf, sizeof(buf), "%s.%u.leaks", prg, getpid());
-
-   /* bt1() will only log onto stderr. */
-   if (!(stderr = fopen(buf, "a")))
-      goto out;
+   snprintf(buf, sizeof(buf), "%s.%u.%s", prg, getpid(), suffix);
+   return buf;
+} /* report_fname */
+
+/* Write the report of $hdr and the $hdr->nsites top allocation
+ * sites of $tops in text. */
+static void report_text(struct erobin_header_st const *hdr,
+   struct stack_st *const *tops)
+{
+   struct tm tm;
+   time_t t;
+   FILE *out;
+   struct ero_st *unknown;
+   unsigned nunknown, i;
+
+   /* Use a FILE of our own rather than swapping $stderr, which
+    * the program may be writing concurrently. */
+   if (!(out = fopen(report_fname("leaks"), "a")))
+      return;
 
    /* Overall statistics */
-   if (!nreports)
+   if (hdr->nreport == 1)
    {
-      localtime_r(&Profiling_since.tv_sec, &tm);
-      fprintf(stderr,
+      t = hdr->since_sec;
+      localtime_r(&t, &tm);
+      fprintf(out,
          "started profiling on:\t" "%.2u:%.2u:%.2u.%.6lu %.2u/%.2u/%.2u\n",
-         tm.tm_hour, tm.tm_min, tm.tm_sec, Profiling_since.tv_usec,
+         tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned long)hdr->since_usec,
          tm.tm_mday, 1+tm.tm_mon, tm.tm_year % 100);
    }
 
-   gettimeofday(&now, NULL);
-   localtime_r(&now.tv_sec, &tm);
-   fprintf(stderr,
+   t = hdr->now_sec;
+   localtime_r(&t, &tm);
+   fprintf(out,
       "report %u created on:\t"  "%.2u:%.2u:%.2u.%.6lu %.2u/%.2u/%.2u\n",
-      ++nreports,
-      tm.tm_hour, tm.tm_min, tm.tm_sec, now.tv_usec,
+      hdr->nreport,
+      tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned long)hdr->now_usec,
       tm.tm_mday, 1+tm.tm_mon, tm.tm_year % 100);
-   fprintf(stderr,
-      "number of allocations:\t" "%u (currently %u)\n",
-      NAllocations, NMemories);
-   fprintf(stderr,
+   if (!Sample_bytes)
+      fprintf(out,
+         "number of allocations:\t" "%u (currently %u)\n",
+         hdr->nallocations, hdr->nmemories);
+   else
+   {
+      fprintf(out,
+         "number of allocations:\t" "%u (currently %u)\n",
+         hdr->nallocations, hdr->nestimated);
+      fprintf(out,
+         "sampled allocations:\t"   "%u (currently %u, every %lu bytes)\n",
+         hdr->nsampled, hdr->nmemories, Sample_bytes);
+   }
+   fprintf(out,
       "current allocation:\t"    "%d (delta=%+d bytes)\n",
-      Allocated, Allocated-previous);
-   fprintf(stderr,
+      (int)hdr->allocated, (int)(hdr->allocated-hdr->previous));
+   fprintf(out,
       "peak allocation:\t"       "%d (%d bytes since the start of period)\n",
-      Peak, Peak-previous);
-   fputs("\n", stderr);
+      (int)hdr->peak, (int)(hdr->peak-hdr->previous));
+   fprintf(out,
+      "metadata footprint:\t"    "%lu (%lu bytes in use)\n",
+      (unsigned long)hdr->metadata_mapped,
+      (unsigned long)hdr->metadata_used);
+   fputs("\n", out);
+
+   /* Where most of the memory is, even if we're terse. */
+   if (hdr->nsites)
+   {
+      fprintf(out, "top %u allocation sites:\n", hdr->nsites);
+      for (i = 0; i < hdr->nsites; i++)
+      {
+         fprintf(out,
+            "site=%u, live=%zu (%u allocations), peak=%zu, "
+            "allocated=%zu, freed=%zu\n",
+            i+1, tops[i]->reported.live_bytes,
+            tops[i]->reported.live_count, tops[i]->reported.peak_bytes,
+            tops[i]->reported.allocated, tops[i]->reported.freed);
+         print_backtrace(out, tops[i]->addrs, tops[i]->depth);
+      }
+      fputs("\n", out);
+   }
 
-   NAllocations = 0;
-   Peak = previous = Allocated;
    if (Summary_only)
       goto done;
 
-   /* Dump all $Memories.
-    * It makes little sense to sort without backtraces. */
-   if (Backtrace_depth)
-      Memories = sort(Memories, NMemories);
-   for (mem = Memories; mem; mem = mem->next)
+   /* Dump the records stack by stack. */
+   gather(&unknown, &nunknown);
+   if (unknown)
+      dump(out, NULL, unknown, nunknown);
+   for (i = 0; Stacks && i < NSTACK_BUCKETS; i++)
+   {
+      struct stack_st *stack;
+
+      for (stack = Stacks[i]; stack; stack = stack->next)
+         if (stack->members)
+         {
+            dump(out, stack, stack->members, stack->nmembers);
+            stack->members = NULL;
+            stack->nmembers = 0;
+         }
+   }
+done:
+   fputs("-------------------------------------------------"
+         "--------------------------\n", out);
+
+   fclose(out);
+} /* report_text */
+
+/* Append $size bytes of $data to $bin. */
+static int binadd(struct bufhead_st *bin, void const *data, size_t size)
+{
+   char *p;
+
+   if (!(p = enlarge(bin, size)))
+      return 0;
+   memcpy(p, data, size);
+   bin->n += size;
+   return 1;
+} /* binadd */
+
+/* dl_iterate_phdr() callback to add the build ID of an object to $bin. */
+static int add_build_id(struct dl_phdr_info *info, size_t size, void *bin)
+{
+   unsigned i;
+   char hex[2*EROBIN_MAX_BUILD_ID + 1];
+
+   for (i = 0; i < info->dlpi_phnum; i++)
    {
-      unsigned karmas;
-      struct ero_st const *prev;
-      struct backtrace_st const *bt;
-
-      /* Chain up identical call sites. */
-      karmas = 0;
-      prev = NULL;
-      for (;;)
+      void const *notes;
+
+      if (info->dlpi_phdr[i].p_type != PT_NOTE)
+         continue;
+      notes = (void const *)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+      if (erobin_build_id(hex, notes, info->dlpi_phdr[i].p_memsz))
       {
-#ifdef _THREAD_SAFE
-         fprintf(stderr, "ptr=%p (tid=%u), size=%zu, karma=%u\n",
-            mem->ptr, mem->tid, mem->size, mem->karma++);
-#else
-         fprintf(stderr, "ptr=%p, size=%zu, karma=%u\n",
-            mem->ptr, mem->size, mem->karma++);
-#endif
+         addfmt(bin, "%p %s\n", notes, hex);
+         break;
+      }
+   }
+
+   return 0;
+} /* add_build_id */
 
-         /* Count with how many different karmas have we seen
-          * the same backtrace. */
-         if (!prev || prev->karma != mem->karma)
-            karmas++;
+/* dl_iterate_phdr() callback to add up the number of objects loaded
+ * and unloaded so far in $changes. */
+static int count_dl_changes(struct dl_phdr_info *info, size_t size,
+   void *changes)
+{
+   if (size >= offsetof(struct dl_phdr_info, dlpi_subs)
+         + sizeof(info->dlpi_subs))
+      *(unsigned long long *)changes = info->dlpi_adds + info->dlpi_subs;
+   return 1;
+} /* count_dl_changes */
 
-         /* Is the next backtrace the same as $mem's? */
-         if (!mem->next
-               || compare_backtraces(mem->backtrace, mem->next->backtrace))
-            break;
+/*
+ * Append /proc/self/maps to $bin, which erodump needs to tell which
+ * objects the addresses of the stacks belong to, and the build IDs,
+ * so it can tell if the objects it finds are the same as the program
+ * used.  Returns their lengths in $lmapsp and $lbuildidsp.
+ */
+static void add_maps(struct bufhead_st *bin,
+   size_t *lmapsp, size_t *lbuildidsp)
+{
+   size_t at;
+   char *p;
+   int fd;
 
-         prev = mem;
-         mem = mem->next;
-      } /* for */
+   at = bin->n;
+   if ((fd = open("/proc/self/maps", O_RDONLY)) >= 0)
+   {
+      ssize_t n;
 
-      /* Dump the backtrace. */
-      if (karmas >= Karma_min_depth)
+      while ((p = enlarge(bin, 4096)) != NULL
+             && (n = read(fd, p, 4096)) > 0)
+         bin->n += n;
+      close(fd);
+   }
+   *lmapsp = bin->n - at;
+
+   at = bin->n;
+   dl_iterate_phdr(add_build_id, bin);
+   *lbuildidsp = bin->n - at;
+} /* add_maps */
+
+/* Write the report of $hdr and the $hdr->nsites top allocation sites
+ * of $tops in the binary format of ero.h with as few write()s as
+ * possible.  Nothing is looked up in the debug information. */
+static void report_binary(struct erobin_header_st const *hdr,
+   struct stack_st *const *tops)
+{
+   static struct bufhead_st bin;
+   struct erobin_header_st *out;
+   struct erobin_record_st rec;
+   struct erobin_site_st site;
+   struct ero_st *unknown, *mem;
+   struct stack_st *stack;
+   unsigned nunknown, nstacks, nrecords, i;
+   uint32_t indexes[hdr->nsites + 1];
+   size_t at, lmaps, lbuildids;
+   int fd;
+
+   /* $bin is a byte array, but not a string. */
+   bin.size1 = sizeof(char);
+   bin.n = 0;
+   nstacks = nrecords = 0;
+   lmaps = lbuildids = 0;
+   if (!binadd(&bin, hdr, sizeof(*hdr)))
+      return;
+   if (Summary_only && !hdr->nsites)
+      goto write;
+
+   /* Add the stacks which have allocations or are among the $tops. */
+   unknown = NULL;
+   if (!Summary_only)
+      gather(&unknown, &nunknown);
+   for (i = 0; Stacks && i < NSTACK_BUCKETS; i++)
+      for (stack = Stacks[i]; stack; stack = stack->next)
       {
-         unsigned i, o;
+         struct erobin_stack_st st;
+         unsigned o;
 
-         for (i = 1, o = 0, bt = mem->backtrace; bt && bt->addrs[o]; i++)
+         if (!stack->members && !stack->rank)
+            continue;
+
+         nstacks++;
+         memset(&st, 0, sizeof(st));
+         st.depth = stack->depth;
+         binadd(&bin, &st, sizeof(st));
+         for (o = 0; o < stack->depth; o++)
          {
-            bt0(i, bt->addrs[o++], NULL);
-            if (o >= CAPACITY(bt->addrs))
-            {
-               bt = bt->next;
-               o = 0;
-            }
+            uint64_t addr;
+
+            addr = (uintptr_t)stack->addrs[o];
+            binadd(&bin, &addr, sizeof(addr));
          }
-      } /* if */
-   } /* for */
-done:
-   fputs("-------------------------------------------------"
-         "--------------------------\n", stderr);
+      }
+
+   /* Add the records in the same order, those without a stack first. */
+   memset(&rec, 0, sizeof(rec));
+   for (mem = unknown; mem; mem = mem->next)
+   {
+      rec.ptr   = (uintptr_t)mem->ptr;
+      rec.size  = mem->size;
+      rec.karma = karma(mem);
+      IF_THREAD_SAFE(rec.tid = mem->tid);
+      binadd(&bin, &rec, sizeof(rec));
+      nrecords++;
+   }
+   rec.stack = 0;
+   for (i = 0; Stacks && i < NSTACK_BUCKETS; i++)
+      for (stack = Stacks[i]; stack; stack = stack->next)
+      {
+         if (!stack->members && !stack->rank)
+            continue;
+
+         rec.stack++;
+         if (stack->rank)
+            indexes[stack->rank-1] = rec.stack;
+         for (mem = stack->members; mem; mem = mem->next)
+         {
+            rec.ptr   = (uintptr_t)mem->ptr;
+            rec.size  = mem->size;
+            rec.karma = karma(mem);
+            IF_THREAD_SAFE(rec.tid = mem->tid);
+            binadd(&bin, &rec, sizeof(rec));
+            nrecords++;
+         }
+         stack->members = NULL;
+         stack->nmembers = 0;
+      }
+
+   /* Add the top allocation sites. */
+   memset(&site, 0, sizeof(site));
+   for (i = 0; i < hdr->nsites; i++)
+   {
+      site.stack      = indexes[i];
+      site.live_count = tops[i]->reported.live_count;
+      site.live_bytes = tops[i]->reported.live_bytes;
+      site.peak_bytes = tops[i]->reported.peak_bytes;
+      site.allocated  = tops[i]->reported.allocated;
+      site.freed      = tops[i]->reported.freed;
+      binadd(&bin, &site, sizeof(site));
+   }
+
+   add_maps(&bin, &lmaps, &lbuildids);
+
+write:
+   /* Pad the report to 8 bytes and finish the header. */
+   while (bin.n % 8)
+      binadd(&bin, "", 1);
+   out = (struct erobin_header_st *)bin.buf;
+   out->size      = bin.n;
+   out->nstacks   = nstacks;
+   out->nrecords  = nrecords;
+   out->lmaps     = lmaps;
+   out->lbuildids = lbuildids;
+
+   if ((fd = open(report_fname("leaks.bin"),
+                  O_WRONLY|O_CREAT|O_APPEND, 0666)) < 0)
+      return;
+   for (at = 0; at < bin.n; )
+   {
+      ssize_t n;
+
+      if ((n = write(fd, &bin.buf[at], bin.n - at)) > 0)
+         at += n;
+      else if (n < 0 && errno != EINTR)
+         break;
+   }
+   close(fd);
+} /* report_binary */
+
+/* Append the frame of $pc to $buf like "<dso>`<function>". */
+static int fold_frame(struct bufhead_st *buf, void const *pc)
+{
+   struct callsite_st cs;
+
+   bt1_cached(&cs, pc);
+   if (!addfmt(buf, "%s`", cs.dso && cs.dso->fname
+         ? cs.dso->fname : "[unknown]"))
+      return 0;
+   else if (cs.cls && cs.funame)
+      return addfmt(buf, "%s::%s", cs.cls, cs.funame);
+   else if (cs.funame || cs.cls)
+      return addfmt(buf, "%s", cs.funame ? cs.funame : cs.cls);
+   else
+      return addfmt(buf, "%p", pc);
+} /* fold_frame */
+
+/* qsort() comparator of folded_st:s by their ->frames. */
+static int cmp_folded(void const *lhs, void const *rhs)
+{
+   return strcmp(((struct folded_st const *)lhs)->frames,
+                 ((struct folded_st const *)rhs)->frames);
+} /* cmp_folded */
+
+/*
+ * Write the stacks with memory in use in <program>.<pid>.<n>.folded
+ * in the collapsed format of flame graph tools.  Different stacks can
+ * look the same once symbolized (calls from different lines of the same
+ * function), so the lines are sorted and merged to make them unique.
+ */
+static void report_folded(struct erobin_header_st const *hdr)
+{
+   FILE *st;
+   char suffix[32];
+   unsigned nlines, nstacks, i, o;
+   struct stack_st *stack;
+   struct folded_st *lines;
+   struct bufhead_st buf;
+
+   /* New stacks may be intern()ed meanwhile if we're reporting
+    * a snapshot, but they have nothing $reported. */
+   nstacks = NStacks;
+   if (!Stacks || !(lines = malloc(sizeof(*lines) * (nstacks + 1))))
+      return;
+
+   /* Symbolize the stacks, the outermost frame first. */
+   nlines = 0;
+   memset(&buf, 0, sizeof(buf));
+   check_dl_subs();
+   for (i = 0; i < NSTACK_BUCKETS; i++)
+      for (stack = Stacks[i]; stack; stack = stack->next)
+      {
+         if (!stack->reported.live_bytes || nlines > nstacks)
+            continue;
+
+         buf.n = 0;
+         for (o = stack->depth; o > 0; o--)
+            if (!fold_frame(&buf, stack->addrs[o-1])
+                  || (o > 1 && !addfmt(&buf, ";")))
+               break;
+         if (o > 0 || !(lines[nlines].frames = strdup(buf.buf)))
+            continue;
+         lines[nlines++].bytes = stack->reported.live_bytes;
+      }
+   free(buf.buf);
+
+   snprintf(suffix, sizeof(suffix), "%u.folded", hdr->nreport);
+   if ((st = fopen(report_fname(suffix), "w")) != NULL)
+   {
+      qsort(lines, nlines, sizeof(*lines), cmp_folded);
+      for (i = 0; i < nlines; i = o)
+      {
+         size_t bytes;
+
+         bytes = lines[i].bytes;
+         for (o = i+1; o < nlines
+               && !strcmp(lines[i].frames, lines[o].frames); o++)
+            bytes += lines[o].bytes;
+         fprintf(st, "%s %zu\n", lines[i].frames, bytes);
+      }
+      fclose(st);
+   }
+
+   for (i = 0; i < nlines; i++)
+      free(lines[i].frames);
+   free(lines);
+} /* report_folded */
+
+/* Append $value to $pb as a protocol buffer varint. */
+static int pb_varint(struct bufhead_st *pb, uint64_t value)
+{
+   uint8_t buf[10];
+   unsigned n;
+
+   n = 0;
+   do
+   {
+      buf[n] = value & 0x7f;
+      if (value >>= 7)
+         buf[n] |= 0x80;
+      n++;
+   } while (value);
+
+   return binadd(pb, buf, n);
+} /* pb_varint */
+
+/* Append the varint $field of $value to $pb, unless it's the default. */
+static int pb_uint(struct bufhead_st *pb, unsigned field, uint64_t value)
+{
+   return !value
+      || (pb_varint(pb, field << 3 | PB_VARINT) && pb_varint(pb, value));
+} /* pb_uint */
+
+/* Append the length-delimited $field of the $size bytes of $data
+ * to $pb. */
+static int pb_bytes(struct bufhead_st *pb, unsigned field,
+   void const *data, size_t size)
+{
+   return pb_varint(pb, field << 3 | PB_BYTES) && pb_varint(pb, size)
+      && (!size || binadd(pb, data, size));
+} /* pb_bytes */
+
+/* Append $msg to $pb as its $field, and empty $msg. */
+static int pb_msg(struct bufhead_st *pb, unsigned field,
+   struct bufhead_st *msg)
+{
+   int ok;
+
+   ok = pb_bytes(pb, field, msg->buf, msg->n);
+   msg->n = 0;
+   return ok;
+} /* pb_msg */
+
+/* Returns the index of the $len long $str in the string table of $pp,
+ * adding it if it's new, or 0 ("") if it can't. */
+static unsigned pprof_str(struct pprof_st *pp, char const *str, size_t len)
+{
+   unsigned hash, slot, i;
+
+   /* Keep $pp->strhash at most half full. */
+   if (2 * (pp->nstrings + 1) > pp->strhash_size)
+   {
+      unsigned *newhash, newsize;
+
+      newsize = pp->strhash_size ? 2 * pp->strhash_size : 1024;
+      if (!(newhash = calloc(newsize, sizeof(*newhash))))
+         return 0;
+      for (i = 0; i < pp->nstrings; i++)
+      {
+         slot = pp->strings[i].hash & (newsize-1);
+         while (newhash[slot])
+            slot = (slot+1) & (newsize-1);
+         newhash[slot] = i+1;
+      }
+      free(pp->strhash);
+      pp->strhash = newhash;
+      pp->strhash_size = newsize;
+   }
+
+   hash = len;
+   for (i = 0; i < len; i++)
+      hash = (hash ^ (unsigned char)str[i]) * GOLDEN_RATIO;
+   for (slot = hash & (pp->strhash_size-1); (i = pp->strhash[slot]) != 0;
+        slot = (slot+1) & (pp->strhash_size-1))
+   {
+      struct pprof_str_st const *s = &pp->strings[i-1];
+
+      if (s->hash == hash && !strncmp(s->str, str, len) && !s->str[len])
+         return i-1;
+   }
+
+   if (pp->nstrings >= pp->strings_size)
+   {
+      struct pprof_str_st *newstrings;
+      unsigned newsize;
+
+      newsize = pp->strings_size ? 2 * pp->strings_size : 1024;
+      if (!(newstrings = realloc(pp->strings,
+                                 sizeof(*newstrings) * newsize)))
+         return 0;
+      pp->strings = newstrings;
+      pp->strings_size = newsize;
+   }
+
+   i = pp->nstrings;
+   if (!(pp->strings[i].str = strndup(str, len)))
+      return 0;
+   pp->strings[i].hash = hash;
+   pp->strings[i].function = 0;
+   pp->strhash[slot] = ++pp->nstrings;
+   return i;
+} /* pprof_str */
+
+/* Like pprof_str() for a NUL-terminated $str. */
+static unsigned pprof_cstr(struct pprof_st *pp, char const *str)
+{
+   return pprof_str(pp, str, strlen(str));
+} /* pprof_cstr */
+
+/* dl_iterate_phdr() callback to add a Mapping of each executable
+ * segment of the loaded objects to the profile of $pp. */
+static int add_mapping(struct dl_phdr_info *info, size_t size, void *pp)
+{
+   unsigned i;
+   char const *fname;
+   char hex[2*EROBIN_MAX_BUILD_ID + 1], exe[PATH_MAX];
+   struct pprof_st *const p = pp;
+   struct pprof_map_st *map;
+
+   /* The main program has no name. */
+   fname = info->dlpi_name;
+   if (!fname[0])
+   {
+      ssize_t n;
+
+      if ((n = readlink("/proc/self/exe", exe, sizeof(exe)-1)) < 0)
+         n = 0;
+      exe[n] = '\0';
+      fname = exe;
+   }
+
+   hex[0] = '\0';
+   for (i = 0; i < info->dlpi_phnum; i++)
+      if (info->dlpi_phdr[i].p_type == PT_NOTE
+          && erobin_build_id(hex,
+               (void const *)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr),
+               info->dlpi_phdr[i].p_memsz))
+         break;
+
+   for (i = 0; i < info->dlpi_phnum; i++)
+   {
+      ElfW(Phdr) const *phdr = &info->dlpi_phdr[i];
+
+      if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X))
+         continue;
+      if (!(map = enlarge(&p->maps, 1)))
+         break;
+      map->start = info->dlpi_addr + phdr->p_vaddr;
+      map->limit = map->start + phdr->p_memsz;
+      p->maps.n++;
+
+      pb_uint(&p->msg, 1, p->maps.n);
+      pb_uint(&p->msg, 2, map->start);
+      pb_uint(&p->msg, 3, map->limit);
+      pb_uint(&p->msg, 4, phdr->p_offset);
+      pb_uint(&p->msg, 5, pprof_cstr(p, fname));
+      pb_uint(&p->msg, 6, pprof_cstr(p, hex));
+      pb_uint(&p->msg, 7, 1);
+      pb_uint(&p->msg, 8, 1);
+      pb_uint(&p->msg, 9, 1);
+      pb_msg(&p->profile, 3, &p->msg);
+   }
+
+   return 0;
+} /* add_mapping */
+
+/* Returns the id of the Function of $cs in the profile of $pp, adding it
+ * if it's new, or 0 if $cs has no function.  The function is looked up
+ * by its name, and its file is taken from $cs->location. */
+static unsigned pprof_function(struct pprof_st *pp,
+   struct callsite_st const *cs, char const *file, size_t lfile)
+{
+   unsigned name;
+   struct bufhead_st buf;
+
+   if (cs->cls && cs->funame)
+   {
+      memset(&buf, 0, sizeof(buf));
+      name = addfmt(&buf, "%s::%s", cs->cls, cs->funame)
+         ? pprof_str(pp, buf.buf, buf.n) : 0;
+      free(buf.buf);
+   } else if (cs->funame || cs->cls)
+   {
+      char const *funame = cs->funame ? cs->funame : cs->cls;
+
+      name = pprof_cstr(pp, funame);
+   } else
+      return 0;
+
+   /* 0 is "", which couldn't be added. */
+   if (!name)
+      return 0;
+   if (pp->strings[name].function)
+      return pp->strings[name].function;
+
+   pp->strings[name].function = ++pp->nfunctions;
+   pb_uint(&pp->msg, 1, pp->nfunctions);
+   pb_uint(&pp->msg, 2, name);
+   pb_uint(&pp->msg, 3, name);
+   pb_uint(&pp->msg, 4, pprof_str(pp, file, lfile));
+   pb_msg(&pp->profile, 5, &pp->msg);
+   return pp->nfunctions;
+} /* pprof_function */
+
+/* Returns the id of the Location of $pc in the profile of $pp,
+ * adding it if it's new. */
+static unsigned pprof_location(struct pprof_st *pp, void const *pc)
+{
+   unsigned slot, mapping, function, i;
+   char const *file, *colon;
+   size_t lfile;
+   int lineno;
+   struct callsite_st cs;
+   struct pprof_map_st const *maps;
+
+   for (slot = ((uintptr_t)pc * GOLDEN_RATIO) & (pp->lochash_size-1);
+        pp->lochash[slot].pc;
+        slot = (slot+1) & (pp->lochash_size-1))
+      if (pp->lochash[slot].pc == pc)
+         return pp->lochash[slot].id;
+   pp->lochash[slot].pc = pc;
+   pp->lochash[slot].id = ++pp->nlocations;
+
+   mapping = 0;
+   maps = (struct pprof_map_st const *)pp->maps.buf;
+   for (i = 0; i < pp->maps.n; i++)
+      if (maps[i].start <= (uintptr_t)pc && (uintptr_t)pc < maps[i].limit)
+      {
+         mapping = i+1;
+         break;
+      }
+
+   /* $cs.location is "[<cufile>] [<header>[:<lineno>]]". */
+   bt1_cached(&cs, pc);
+   file = "";
+   lfile = 0;
+   lineno = 0;
+   if (cs.location)
+   {
+      if (!(file = strrchr(cs.location, ' ')))
+         file = cs.location;
+      else
+         file++;
+      lfile = strlen(file);
+      if ((colon = strrchr(file, ':')) != NULL
+            && strspn(colon+1, "0123456789") == strlen(colon+1))
+      {
+         lineno = atoi(colon+1);
+         lfile = colon - file;
+      }
+   }
+   function = pprof_function(pp, &cs, file, lfile);
+
+   pb_uint(&pp->msg, 1, pp->nlocations);
+   pb_uint(&pp->msg, 2, mapping);
+   pb_uint(&pp->msg, 3, (uintptr_t)pc);
+   if (function)
+   {
+      struct bufhead_st line;
+
+      memset(&line, 0, sizeof(line));
+      line.size1 = sizeof(char);
+      pb_uint(&line, 1, function);
+      pb_uint(&line, 2, lineno);
+      pb_msg(&pp->msg, 4, &line);
+      free(line.buf);
+   }
+   pb_msg(&pp->profile, 4, &pp->msg);
+
+   return pp->nlocations;
+} /* pprof_location */
+
+/* Write $size bytes of $data in $fd compressed with gzip.
+ * The data is stored in uncompressed deflate blocks, so no compressor
+ * is needed, yet any gzip reader can read it. */
+static int write_gzip(int fd, void const *data, size_t size)
+{
+   uint32_t crc, total;
+   uint8_t hdr[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+   uint8_t trailer[8];
+
+   if (!write_all(fd, hdr, sizeof(hdr)))
+      return 0;
+
+   crc = crc32(data, size);
+   total = size;
+   do
+   {
+      size_t n;
+      uint8_t block[5];
+
+      n = size < 0xffff ? size : 0xffff;
+      block[0] = n == size;
+      block[1] = n & 0xff;
+      block[2] = n >> 8;
+      block[3] = ~n & 0xff;
+      block[4] = ~n >> 8;
+      if (!write_all(fd, block, sizeof(block)) || !write_all(fd, data, n))
+         return 0;
+      data = (char const *)data + n;
+      size -= n;
+   } while (size > 0);
+
+   trailer[0] = crc;
+   trailer[1] = crc >> 8;
+   trailer[2] = crc >> 16;
+   trailer[3] = crc >> 24;
+   trailer[4] = total;
+   trailer[5] = total >> 8;
+   trailer[6] = total >> 16;
+   trailer[7] = total >> 24;
+   return write_all(fd, trailer, sizeof(trailer));
+} /* write_gzip */
+
+/*
+ * Write the stacks as a pprof heap profile in <program>.<pid>.<n>.pb.gz:
+ * a gzip-compressed protocol buffer of profile.proto, with the inuse_space,
+ * inuse_objects, alloc_space and alloc_objects of each stack, and the
+ * functions and lines of the addresses looked up by libarf.  In sampling
+ * mode both the sizes and the number of objects are estimated like in
+ * dump().
+ */
+static void report_pprof(struct erobin_header_st const *hdr)
+{
+   static char const *const types[][2] =
+   {
+      { "inuse_space",   "bytes" },
+      { "inuse_objects", "count" },
+      { "alloc_space",   "bytes" },
+      { "alloc_objects", "count" },
+   };
+   int fd;
+   char suffix[32];
+   unsigned nframes, i, o;
+   struct stack_st *stack;
+   struct pprof_st pp;
+   struct bufhead_st values;
+
+   memset(&pp, 0, sizeof(pp));
+   memset(&values, 0, sizeof(values));
+   pp.profile.size1 = pp.msg.size1 = values.size1 = sizeof(char);
+   pp.maps.size1 = sizeof(struct pprof_map_st);
+
+   /* The first string must be "". */
+   pprof_str(&pp, "", 0);
+   for (i = 0; i < CAPACITY(types); i++)
+   {
+      pb_uint(&pp.msg, 1, pprof_cstr(&pp, types[i][0]));
+      pb_uint(&pp.msg, 2, pprof_cstr(&pp, types[i][1]));
+      pb_msg(&pp.profile, 1, &pp.msg);
+   }
+   dl_iterate_phdr(add_mapping, &pp);
+
+   /* Make $pp.lochash large enough for all addresses. */
+   nframes = 0;
+   for (i = 0; Stacks && i < NSTACK_BUCKETS; i++)
+      for (stack = Stacks[i]; stack; stack = stack->next)
+         if (stack->reported.alloc_count)
+            nframes += stack->depth;
+   for (pp.lochash_size = 1024; pp.lochash_size < 2 * nframes; )
+      pp.lochash_size *= 2;
+   if (!(pp.lochash = calloc(pp.lochash_size, sizeof(*pp.lochash))))
+      goto out;
+
+   check_dl_subs();
+   for (i = 0; Stacks && i < NSTACK_BUCKETS; i++)
+      for (stack = Stacks[i]; stack; stack = stack->next)
+      {
+         if (!stack->reported.alloc_count)
+            continue;
+
+         for (o = 0; o < stack->depth; o++)
+            pb_varint(&values, pprof_location(&pp, stack->addrs[o]));
+         pb_msg(&pp.msg, 1, &values);
+
+         pb_varint(&values, stack->reported.live_bytes);
+         pb_varint(&values, stack->reported.live_objects);
+         pb_varint(&values, stack->reported.allocated);
+         pb_varint(&values, stack->reported.alloc_objects);
+         pb_msg(&pp.msg, 2, &values);
+
+         pb_msg(&pp.profile, 2, &pp.msg);
+      }
+
+   pb_uint(&pp.profile, 9,
+      hdr->now_sec * 1000000000ull + hdr->now_usec * 1000);
+   pb_uint(&pp.profile, 10,
+      ((int64_t)hdr->now_sec - (int64_t)hdr->since_sec) * 1000000000
+         + ((int64_t)hdr->now_usec - (int64_t)hdr->since_usec) * 1000);
+   pb_uint(&pp.msg, 1, pprof_cstr(&pp, "space"));
+   pb_uint(&pp.msg, 2, pprof_cstr(&pp, "bytes"));
+   pb_msg(&pp.profile, 11, &pp.msg);
+   pb_uint(&pp.profile, 12, Sample_bytes);
+   pb_uint(&pp.profile, 14, pprof_cstr(&pp, "inuse_space"));
+
+   /* No more strings after this. */
+   for (i = 0; i < pp.nstrings; i++)
+      pb_bytes(&pp.profile, 6,
+         pp.strings[i].str, strlen(pp.strings[i].str));
+
+   snprintf(suffix, sizeof(suffix), "%u.pb.gz", hdr->nreport);
+   if ((fd = open(report_fname(suffix),
+                  O_WRONLY|O_CREAT|O_TRUNC, 0666)) >= 0)
+   {
+      write_gzip(fd, pp.profile.buf, pp.profile.n);
+      close(fd);
+   }
 
-   fclose(stderr);
 out:
-   stderr = saved_stderr;
+   for (i = 0; i < pp.nstrings; i++)
+      free(pp.strings[i].str);
+   free(pp.strings);
+   free(pp.strhash);
+   free(pp.lochash);
+   free(pp.maps.buf);
+   free(pp.msg.buf);
+   free(pp.profile.buf);
+   free(values.buf);
+} /* report_pprof */
+
+/*
+ * Collect the overall statistics of the next report() in $hdr, the top
+ * allocation sites in $tops, and the aggregates of the stacks in their
+ * $reported.  In snapshot mode copy the records too if the report()
+ * needs them.  Called by report_all() with all $Shards held.  Returns
+ * whether the $Shards can be released before report()ing.
+ */
+static int snapshot(struct erobin_header_st *hdr, struct stack_st **tops)
+{
+   static unsigned nreports;
+   static int previous;
+   struct timeval now;
+   struct stack_st *stack;
+   unsigned i;
+
+   /* Collect the overall statistics. */
+   memset(hdr, 0, sizeof(*hdr));
+   memcpy(hdr->magic, EROBIN_MAGIC, sizeof(hdr->magic));
+   hdr->nreport = ++nreports;
+   hdr->pid = getpid();
+   IF_THREAD_SAFE(hdr->flags |= EROBIN_THREADED);
+   if (Summary_only)
+      hdr->flags |= EROBIN_SUMMARY_ONLY;
+   hdr->karma_min_depth = Karma_min_depth;
+
+   gettimeofday(&now, NULL);
+   hdr->since_sec  = Profiling_since.tv_sec;
+   hdr->since_usec = Profiling_since.tv_usec;
+   hdr->now_sec    = now.tv_sec;
+   hdr->now_usec   = now.tv_usec;
+
+   for (i = 0; i < NSHARDS; i++)
+   {
+      hdr->nallocations += Shards[i].nallocations;
+      hdr->nmemories    += Shards[i].nmemories;
+      Shards[i].nallocations = 0;
+   }
+
+   if (Sample_bytes)
+   {  /* Estimate how many chunks are in use from the samples. */
+      double estimate;
+
+      estimate = 0;
+      for (i = 0; i < NSHARDS; i++)
+      {
+         unsigned o;
+         struct ero_st const *mem;
+
+         if (Shards[i].memories)
+            for (o = 0; o < 1u << Shards[i].memories_bits; o++)
+               if ((mem = Shards[i].memories[o]) != NULL)
+                  estimate += sample_weight(mem->size);
+      }
+
+      hdr->sample_bytes = Sample_bytes;
+      hdr->nsampled     = hdr->nallocations;
+      hdr->nallocations += NUnsampled;
+      hdr->nestimated   = estimate + 0.5;
+      NUnsampled = 0;
+   }
+
+   hdr->allocated = Allocated;
+   hdr->previous  = previous;
+   hdr->peak      = Peak;
+   Peak = previous = Allocated;
+   hdr->metadata_mapped = Metadata_mapped;
+   hdr->metadata_used   = Metadata_used;
+
+   /* The aggregates keep changing in snapshot mode while we report(). */
+   for (i = 0; Stacks && i < NSTACK_BUCKETS; i++)
+      for (stack = Stacks[i]; stack; stack = stack->next)
+         stack->reported = stack->site;
+   hdr->nsites = Top_sites ? rank_sites(tops) : 0;
+
+   /* Age all records at once, even if they weren't dumped. */
+   Reported_epoch = Epoch++;
+   renew_maps();
+
+   if (!Snapshot)
+      return 0;
+   if (Summary_only
+         || (Format != FORMAT_TEXT && Format != FORMAT_BINARY))
+      /* Only the aggregates are reported. */
+      return 1;
+
+   /* The records may be freed as soon as we release the $Shards. */
+   if (!(Snapshot_records = malloc(sizeof(*Snapshot_records)
+                                   * (hdr->nmemories + 1))))
+      return 0;
+   NSnapshot_records = 0;
+   for (i = 0; i < NSHARDS; i++)
+   {
+      unsigned o;
+      struct ero_st const *mem;
+
+      if (Shards[i].memories)
+         for (o = 0; o < 1u << Shards[i].memories_bits; o++)
+            if ((mem = Shards[i].memories[o]) != NULL)
+               Snapshot_records[NSnapshot_records++] = *mem;
+   }
+
+   return 1;
+} /* snapshot */
+
+/* Report on the allocations as of the last snapshot().  Called by
+ * report_all() with all $Shards held, except in snapshot mode. */
+static void report(struct erobin_header_st const *hdr,
+   struct stack_st *const *tops)
+{
+   int saved_errno;
+   unsigned i;
+
+   saved_errno = errno;
+
+   if (Format == FORMAT_BINARY)
+      report_binary(hdr, tops);
+   else if (Format == FORMAT_FOLDED)
+      report_folded(hdr);
+   else if (Format == FORMAT_PPROF)
+      report_pprof(hdr);
+   else
+      report_text(hdr, tops);
+   for (i = 0; i < hdr->nsites; i++)
+      tops[i]->rank = 0;
+
+   free(Snapshot_records);
+   Snapshot_records = NULL;
+
    errno = saved_errno;
 } /* report */
 /* Accounting }}} */
 
+/* Tracing {{{ */
+/* Returns the current time in nanoseconds for the events. */
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+} /* now_ns */
+
+#ifdef _THREAD_SAFE
+/* Called when a thread exits to let flush() recycle its $ring. */
+static void ring_died(void *ring)
+{
+   ((struct ring_st *)ring)->state = RING_ORPHAN;
+} /* ring_died */
+#endif
+
+/* Returns a ring_st for the thread, reusing an orphaned one if possible.
+ * Called in mallfuncs context. */
+static struct ring_st *new_ring(void)
+{
+   struct ring_st *ring;
+
+   for (ring = Rings; ring; ring = ring->next)
+      if (ring->state == RING_FREE
+          && __sync_bool_compare_and_swap(&ring->state, RING_FREE, RING_USED))
+         goto out;
+
+   /* It's mmap()ed on its own, so we'll only touch
+    * as much of it as we need. */
+   if (!(ring = meta_alloc(sizeof(*ring))))
+      return NULL;
+   do
+      ring->next = Rings;
+   while (!__sync_bool_compare_and_swap(&Rings, ring->next, ring));
+
+out:
+   IF_THREAD_SAFE(ring->tid = gettid());
+   IF_THREAD_SAFE(pthread_setspecific(Ring_key, ring));
+   return ring;
+} /* new_ring */
+
+/* Write everything trace()d since the last time to the events file.
+ * Called with $Accounting set, so our own allocations are not traced. */
+static void flush(void)
+{
+   static struct bufhead_st buf;
+   static unsigned long long dl_changes;
+   unsigned long long changes;
+   struct eroevt_st ev;
+   struct stack_st *stack;
+   struct ring_st *ring;
+   size_t at;
+
+   pthread_mutex_lock(&Drain_lock);
+   buf.size1 = sizeof(char);
+   buf.n = 0;
+   memset(&ev, 0, sizeof(ev));
+
+   if (__sync_bool_compare_and_swap(&Marker_pending, 1, 0))
+   {
+      ev.type = EROEVT_REPORT;
+      ev.time = Marker_time;
+      ev.ptr  = Marker_tv.tv_sec;
+      ev.size = Marker_tv.tv_usec;
+      binadd(&buf, &ev, sizeof(ev));
+   }
+
+   /* The stacks the events may refer to. */
+   for (stack = __sync_lock_test_and_set(&New_stacks, NULL); stack;
+        stack = stack->fresh)
+   {
+      unsigned i;
+      struct erobin_stack_st st;
+
+      ev.type  = EROEVT_STACK;
+      ev.stack = stack->id;
+      binadd(&buf, &ev, sizeof(ev));
+
+      memset(&st, 0, sizeof(st));
+      st.depth = stack->depth;
+      binadd(&buf, &st, sizeof(st));
+      for (i = 0; i < stack->depth; i++)
+      {
+         uint64_t addr;
+
+         addr = (uintptr_t)stack->addrs[i];
+         binadd(&buf, &addr, sizeof(addr));
+      }
+   }
+
+   /* Take the events of all threads.  Only advance $ring->tail when
+    * they are copied, so the thread won't overwrite them before. */
+   for (ring = Rings; ring; ring = ring->next)
+   {
+      unsigned head, tail;
+
+      head = ring->head;
+      __sync_synchronize();
+      for (tail = ring->tail; tail != head; tail++)
+         binadd(&buf, &ring->events[tail % RING_SIZE],
+                sizeof(ring->events[0]));
+      __sync_synchronize();
+      ring->tail = tail;
+
+      if (ring->state == RING_ORPHAN && ring->head == ring->tail)
+         ring->state = RING_FREE;
+   }
+
+   if (!buf.n)
+      goto out;
+
+   /* Has anything been loaded or unloaded since the last time? */
+   changes = 0;
+   dl_iterate_phdr(count_dl_changes, &changes);
+   if (Events_fd < 0 || changes != dl_changes)
+   {
+      size_t lmaps, lbuildids;
+
+      at = buf.n;
+      ev.type = EROEVT_MAPS;
+      ev.time = now_ns();
+      binadd(&buf, &ev, sizeof(ev));
+      add_maps(&buf, &lmaps, &lbuildids);
+      while (buf.n % 8)
+         binadd(&buf, "", 1);
+      ((struct eroevt_st *)&buf.buf[at])->ptr  = lmaps;
+      ((struct eroevt_st *)&buf.buf[at])->size = lbuildids;
+      dl_changes = changes;
+   }
+
+   if (Events_fd < 0)
+   {  /* Start the file. */
+      struct eroevt_header_st hdr;
+
+      if ((Events_fd = open(report_fname("events"),
+                     O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+         goto out;
+
+      memset(&hdr, 0, sizeof(hdr));
+      memcpy(hdr.magic, EROEVT_MAGIC, sizeof(hdr.magic));
+      hdr.pid = getpid();
+      IF_THREAD_SAFE(hdr.flags |= EROBIN_THREADED);
+      if (Summary_only)
+         hdr.flags |= EROBIN_SUMMARY_ONLY;
+      hdr.karma_min_depth = Karma_min_depth;
+      hdr.since_sec  = Profiling_since.tv_sec;
+      hdr.since_usec = Profiling_since.tv_usec;
+      hdr.since_time = Profiling_since_ns;
+      if (write(Events_fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+      {
+         close(Events_fd);
+         Events_fd = -1;
+         goto out;
+      }
+   }
+
+   for (at = 0; at < buf.n; )
+   {
+      ssize_t n;
+
+      if ((n = write(Events_fd, &buf.buf[at], buf.n - at)) > 0)
+         at += n;
+      else if (n < 0 && errno != EINTR)
+         break;
+   }
+
+out:
+   pthread_mutex_unlock(&Drain_lock);
+} /* flush */
+
+/* Add $ev to the thread's ring, flush()ing it ourselves if it's full.
+ * Wake up drainer() when it's half full, so it rarely comes to that.
+ * Called in mallfuncs context. */
+static void push(struct eroevt_st *ev)
+{
+   struct ring_st *ring;
+
+   if (!(ring = Ring) && !(ring = Ring = new_ring()))
+      return;
+
+   while (ring->head - ring->tail >= RING_SIZE)
+      flush();
+
+   IF_THREAD_SAFE(ev->tid = ring->tid);
+   ring->events[ring->head % RING_SIZE] = *ev;
+   __sync_synchronize();
+   ring->head++;
+
+#ifdef _THREAD_SAFE
+   if (ring->head - ring->tail == RING_SIZE / 2)
+      sem_post(&Drain_wakeup);
+#endif
+} /* push */
+
+/* Record an event of $type about $ptr of $size bytes in the thread's
+ * ring instead of accounting for it.  Called from mallfuncs. */
+static void trace(unsigned type, void const *ptr, size_t size)
+{
+   struct eroevt_st ev;
+   struct stack_st *stack;
+
+   if (!ptr || Accounting)
+      return;
+   /* Keep telling erodump about frees while we're stopped,
+    * or it would think what was allocated before is leaking. */
+   if (!Profiling && !(Collecting && type == EROEVT_FREE))
+      return;
+   Accounting = 1;
+
+   memset(&ev, 0, sizeof(ev));
+   ev.type = type;
+   ev.time = now_ns();
+   ev.ptr  = (uintptr_t)ptr;
+   ev.size = size;
+   if (type == EROEVT_MALLOC || type == EROEVT_REALLOC_TO)
+      if ((stack = capture()) != NULL)
+         ev.stack = stack->id;
+   push(&ev);
+
+   Accounting = 0;
+} /* trace */
+
+/* Ask flush() to write a report marker with the current time. */
+static void mark(void)
+{
+   Marker_time = now_ns();
+   gettimeofday(&Marker_tv, NULL);
+   __sync_synchronize();
+   Marker_pending = 1;
+   renew_maps();
+} /* mark */
+
+#ifdef _THREAD_SAFE
+/* The thread which writes the events of the others periodically,
+ * or when push() wakes it up. */
+static void *drainer(void *unused)
+{
+   /* Don't trace our own allocations. */
+   Accounting = 1;
+   for (;;)
+   {
+      struct timespec ts;
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      if ((ts.tv_nsec += 100000000) >= 1000000000)
+      {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000;
+      }
+      sem_timedwait(&Drain_wakeup, &ts);
+      flush();
+   }
+
+   return NULL;
+} /* drainer */
+
+/* Start drainer() in the background. */
+static void start_drainer(void)
+{
+   pthread_t thread;
+
+   if (!pthread_create(&thread, NULL, drainer, NULL))
+      pthread_detach(thread);
+} /* start_drainer */
+#endif
+
+/* Keep fork() from catching flush() in the middle. */
+static void lock_for_fork_trace(void)
+{
+   pthread_mutex_lock(&Drain_lock);
+} /* lock_for_fork_trace */
+
+/* In the parent after fork(). */
+static void unlock_after_fork_trace(void)
+{
+   pthread_mutex_unlock(&Drain_lock);
+} /* unlock_after_fork_trace */
+
+/*
+ * The child after fork() starts its own events file.  The events in the
+ * rings are the parent's, and the other threads are gone, so their rings
+ * can be reused.  All the stacks are new to the new file, and it needs
+ * its own drainer().
+ */
+static void forked_trace(void)
+{
+   unsigned i;
+   struct ring_st *ring;
+   struct stack_st *stack;
+
+   if (Events_fd >= 0)
+      close(Events_fd);
+   Events_fd = -1;
+   Marker_pending = 0;
+
+   for (ring = Rings; ring; ring = ring->next)
+   {
+      ring->tail = ring->head;
+      if (ring != Ring)
+         ring->state = RING_FREE;
+   }
+
+   New_stacks = NULL;
+   for (i = 0; Stacks && i < NSTACK_BUCKETS; i++)
+      for (stack = Stacks[i]; stack; stack = stack->next)
+      {
+         stack->fresh = New_stacks;
+         New_stacks = stack;
+      }
+
+   pthread_mutex_unlock(&Drain_lock);
+#ifdef _THREAD_SAFE
+   sem_init(&Drain_wakeup, 0, 0);
+   start_drainer();
+#endif
+} /* forked_trace */
+/* Tracing }}} */
+
 /* Concurrency and reentrancy {{{ */
 #ifdef __arm__
 /* Based on kernel code.
@@ -853,154 +2876,500 @@ char __sync_bool_compare_and_swap_4(volatile int *ptr, int old, int new)
 } /* __sync_bool_compare_and_swap_4 */
 #endif /* __arm__ */
 
-/* Enter a critical section. */
-static void enter(void)
+/* Release all $Shards taken by report_all(). */
+static void release_all(void)
 {
-   pthread_mutex_lock(&Mutex);
-   while (!__sync_bool_compare_and_swap(&Spinlock, 0, 1))
-      /* sighand() is accounting. */
+   unsigned i;
+
+   for (i = 0; i < NSHARDS; i++)
+      __sync_lock_release(&Shards[i].spinlock);
+} /* release_all */
+
+/*
+ * Take all $Shards and report(), in $fname if it's not NULL.  Can be
+ * called either in mallfuncs or signal context, or from the library
+ * destructor, but not while the thread is $Holding a shard.  In snapshot
+ * mode the $Shards are only held while taking the snapshot().  Returns
+ * whether it has reported.
+ */
+static int report_all(char const *fname)
+{
+   unsigned i;
+   int accounting, released;
+   struct erobin_header_st hdr;
+   struct stack_st *tops[Top_sites + 1];
+
+   if (!__sync_bool_compare_and_swap(&Reporting, 0, 1))
+      /* A report() is already underway, ignore this request. */
+      return 0;
+   Report_path = fname;
+
+   /* Nobody holds a shard while waiting for another, so we'll get
+    * all of them eventually. */
+   for (i = 0; i < NSHARDS; i++)
+      while (!__sync_bool_compare_and_swap(&Shards[i].spinlock, 0, 1))
+         /* A mallfunc is accounting in this shard. */
+         sched_yield();
+
+   /* Critical section */
+   accounting = Accounting;
+   Accounting = 1;
+   if ((released = snapshot(&hdr, tops)) != 0)
+      /* Let the mallfuncs go on while we report(), which can take
+       * long.  Our own allocations are still not accounted for. */
+      release_all();
+   report(&hdr, tops);
+   Accounting = accounting;
+   /* Critical section */
+
+   if (!released)
+      release_all();
+   Report_path = NULL;
+   __sync_lock_release(&Reporting);
+   return 1;
+} /* report_all */
+
+/* Enter the critical section of $ptr's shard unconditionally
+ * and return the shard. */
+static struct shard_st *lock_shard(void const *ptr)
+{
+   struct shard_st *sh;
+
+   sh = shard_of(ptr);
+   pthread_mutex_lock(&sh->mutex);
+   Holding = sh;
+   while (!__sync_bool_compare_and_swap(&sh->spinlock, 0, 1))
+      /* report_all() is accounting. */
       sched_yield();
+   Accounting = 1;
+
+   return sh;
+} /* lock_shard */
+
+/* Enter the critical section of $ptr's shard and return the shard,
+ * or return NULL if the allocation shouldn't be accounted for. */
+static struct shard_st *enter(void const *ptr)
+{
+   if (!ptr || !Collecting || Accounting)
+      /*
+       * NULL is never accounted for.
+       * Called by the same thread in critical section,
+       * just do the work without accounting.
+       * We're in trouble if !Profiling yet but during
+       * they sighand() interrupts us twice and starts
+       * accounting.
+       */
+      return NULL;
+   return lock_shard(ptr);
 } /* enter */
 
-/* Leave the critical section. */
-static void leave(void)
+/* Leave the critical section of $sh. */
+static void leave(struct shard_st *sh)
 {
-   if (!__sync_bool_compare_and_swap(&Spinlock, 1, 0))
-   {
-      /* sighand() interrupted us and queued a report(). */
-      /* Critical section */
-      Executor = pthread_self();
-      report();
-      Executor = 0;
-      /* Critical section */
+   Accounting = 0;
+   __sync_lock_release(&sh->spinlock);
+   Holding = NULL;
+   pthread_mutex_unlock(&sh->mutex);
 
-      /* I think it doesn't matter if it's reordered. */
-      Spinlock = 0;
-   }
-   pthread_mutex_unlock(&Mutex);
+   if (Report_pending
+         && __sync_bool_compare_and_swap(&Report_pending, 1, 0))
+      /* sighand() interrupted us and queued a report(). */
+      report_all(NULL);
 } /* leave */
 
-#define WRAP_MALLFUNC(ifmulti, ifsingle)                       \
+/* Do $ifaccounting in the critical section of $ptr's shard $sh
+ * unless we're not profiling. */
+#define WRAP_MALLFUNC(ptr, ifaccounting)                       \
 do                                                             \
 {                                                              \
-   if (!Profiling || pthread_equal(Executor, pthread_self()))  \
-   {                                                           \
-      /* Called by the same thread in critical section, */     \
-      /* just do the work without accounting.           */     \
-      /* We're in trouble if !Profiling yet but during  */     \
-      /* they sighand() interrupts us twice and starts  */     \
-      /* accounting.                                    */     \
-      ifsingle;                                                \
-   } else                                                      \
-   {                                                           \
-      enter();                                                 \
+   struct shard_st *sh;                                        \
                                                                \
+   if ((sh = enter(ptr)) != NULL)                              \
+   {                                                           \
       /* Critical section */                                   \
-      Executor = pthread_self();                               \
-      ifmulti;                                                 \
-      Executor = 0;                                            \
+      ifaccounting;                                            \
       /* Critical section */                                   \
-                                                               \
-      leave();                                                 \
+      leave(sh);                                               \
    }                                                           \
 } while (0)
 
+/* Account for the new allocation of $size bytes at $ptr in mallfuncs,
+ * or trace() it. */
+#define GARBAGE(ptr, size)                                     \
+do                                                             \
+{                                                              \
+   if (Tracing)                                                \
+      trace(EROEVT_MALLOC, ptr, size);                         \
+   else if (sample(ptr, size))                                 \
+      WRAP_MALLFUNC(ptr, garbage(sh, ptr, size));              \
+} while (0)
+
+/* Make the mallfuncs start accounting. */
+static void start_profiling(void)
+{
+   gettimeofday(&Profiling_since, NULL);
+   Profiling_since_ns = now_ns();
+   Profiling = Collecting = 1;
+} /* start_profiling */
+
 static void sighand(int unused)
 {
    /* Instruct mallfuncs to start accounting if they haven't. */
    if (!Profiling)
    {  /* No tricky things, the program can be in any state. */
-      gettimeofday(&Profiling_since, NULL);
-      Profiling = 1;
+      start_profiling();
       return;
    }
 
-   if (Spinlock == 2)
-      /* A report() is already underway, ignore this request. */
+   if (Tracing)
+   {  /* erodump will make the report. */
+      mark();
+#ifndef _THREAD_SAFE
+      /* There's no drainer(), flush() ourselves
+       * unless we interrupted trace() or libc. */
+      if (!Accounting && !In_libc)
+      {
+         Accounting = 1;
+         flush();
+         Accounting = 0;
+      }
+#endif
       return;
-
-   while (!__sync_bool_compare_and_swap(&Spinlock, 0, 1))
-   {
-      /* A mallfunc (this thread's or another's) or another
-       * thread's sighand() is in critical secion. */
-      if (__sync_bool_compare_and_swap(&Spinlock, 1, 2))
-         /* A mallfunc will make a report() for us.
-          * If our concurrent is a sighand() we will silently
-          * ignore this report(), which is a Good Thing. */
-         return;
-      sched_yield();
    }
 
-   /* Critical section */
-   Executor = pthread_self();
-   report();
-   Executor = 0;
-   /* Critical section */
+   if (Holding || In_libc)
+   {  /* We interrupted a mallfunc of this thread, which would
+       * deadlock report_all(), or libc's allocator, which can't
+       * be reentered.  Let it report when it leave()s. */
+      Report_pending = 1;
+      return;
+   }
 
-   Spinlock = 0;
+   report_all(NULL);
 } /* sighand */
 /* Concurrancy and reentrancy }}} */
 
+#ifdef _THREAD_SAFE
+/* Control socket {{{ */
+/* Write the summary counters on $fd. */
+static void stats(int fd)
+{
+   unsigned i, nmemories, nallocations;
+
+   /* These are read without locking, so they're only approximations
+    * while the program is allocating. */
+   nmemories = nallocations = 0;
+   for (i = 0; i < NSHARDS; i++)
+   {
+      nmemories    += Shards[i].nmemories;
+      nallocations += Shards[i].nallocations;
+   }
+
+   dprintf(fd, "profiling: %d\n",          Profiling);
+   dprintf(fd, "allocated: %d\n",          Allocated);
+   dprintf(fd, "peak: %d\n",               Peak);
+   dprintf(fd, "records: %u\n",            nmemories);
+   dprintf(fd, "new allocations: %u\n",    nallocations);
+   if (Sample_bytes)
+      dprintf(fd, "unsampled: %u\n",       NUnsampled);
+   dprintf(fd, "stacks: %u\n",             NStacks);
+   dprintf(fd, "reports: %u\n",            Epoch);
+   dprintf(fd, "metadata: %zu (%zu in use)\n",
+      Metadata_mapped, Metadata_used);
+   dprintf(fd, "depth: %d\n",              Backtrace_depth);
+   dprintf(fd, "karma: %u\n",              Karma_min_depth);
+} /* stats */
+
+/* Execute the commands read from the client connected on $fd,
+ * one per line, and answer each with "ok" or "error: <why>". */
+static void serve(int fd)
+{
+   FILE *in;
+   char line[PATH_MAX + 32];
+
+   if (!(in = fdopen(fd, "r")))
+   {
+      close(fd);
+      return;
+   }
+
+   while (fgets(line, sizeof(line), in))
+   {
+      char *cmd, *arg;
+      char const *err;
+
+      /* Split $line to $cmd and $arg. */
+      cmd = &line[strspn(line, " \t")];
+      cmd[strcspn(cmd, "\r\n")] = '\0';
+      arg = &cmd[strcspn(cmd, " \t")];
+      if (*arg)
+      {
+         *arg++ = '\0';
+         arg += strspn(arg, " \t");
+      }
+
+      err = NULL;
+      if (!*cmd)
+         continue;
+      else if (!strcmp(cmd, "start"))
+      {
+         if (!Profiling)
+            start_profiling();
+      } else if (!strcmp(cmd, "stop"))
+         Profiling = 0;
+      else if (!strcmp(cmd, "report"))
+      {
+         if (!Tracing)
+         {
+            if (!report_all(*arg ? arg : NULL))
+               err = "already reporting";
+         } else if (*arg)
+            err = "can't report in a file while tracing";
+         else
+            mark();
+      } else if (!strcmp(cmd, "depth"))
+      {
+         long depth;
+         char *end;
+
+         depth = strtol(arg, &end, 10);
+         if (!*arg || *end)
+            err = "depth what?";
+         else if (depth < -1 || depth > MAX_DEPTH)
+            err = "depth out of range";
+         else
+            Backtrace_depth = depth;
+      } else if (!strcmp(cmd, "karma"))
+      {
+         unsigned long karma;
+         char *end;
+
+         karma = strtoul(arg, &end, 10);
+         if (!*arg || *end || karma > UINT_MAX)
+            err = "karma what?";
+         else
+            Karma_min_depth = karma;
+      } else if (!strcmp(cmd, "stats"))
+         stats(fd);
+      else
+         err = "unknown command";
+
+      if (err)
+         dprintf(fd, "error: %s\n", err);
+      else
+         dprintf(fd, "ok\n");
+   } /* until the client hangs up */
+
+   fclose(in);
+} /* serve */
+
+/* Accept the clients of $Control_fd one after the other. */
+static void *controller(void *unused)
+{
+   int fd;
+   sigset_t sigs;
+
+   /* Don't let signals interrupt us, and don't account for
+    * our own allocations. */
+   sigfillset(&sigs);
+   pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+   Accounting = 1;
+
+   while ((fd = accept(Control_fd, NULL, NULL)) >= 0 || errno == EINTR)
+      if (fd >= 0)
+         serve(fd);
+
+   return NULL;
+} /* controller */
+
+/* Listen on $path for controller() in a new thread. */
+static void listen_control(char const *path)
+{
+   int ret;
+   mode_t mask;
+   pthread_t thread;
+
+   if (strlen(path) >= sizeof(Control_addr.sun_path))
+      return;
+   Control_addr.sun_family = AF_UNIX;
+   strcpy(Control_addr.sun_path, path);
+
+   if ((Control_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+      return;
+   unlink(path);
+
+   /* Only let our user connect, "report" can write any file
+    * we can.  We're called early enough that changing the umask
+    * briefly won't bother the other threads. */
+   mask = umask(0177);
+   ret = bind(Control_fd, (struct sockaddr const *)&Control_addr,
+              sizeof(Control_addr));
+   umask(mask);
+   if (ret < 0 || listen(Control_fd, 4) < 0
+         || pthread_create(&thread, NULL, controller, NULL) != 0)
+   {
+      close(Control_fd);
+      Control_fd = -1;
+      return;
+   }
+
+   pthread_detach(thread);
+   Control_pid = getpid();
+} /* listen_control */
+/* Control socket }}} */
+#endif /* _THREAD_SAFE */
+
 /* ero's mallfuncs {{{ */
-/* Override libc's functions.  Using malloc hooks would be nicer,
- * but the it's impossible to chain up in a thread-safe manner. */
+/* Call before a __libc_*() mallfunc, so that sighand() won't
+ * report_all() in the middle of it. */
+static void enter_libc(void)
+{
+   In_libc = 1;
+} /* enter_libc */
+
+/* Call after the __libc_*() mallfunc, and make the report sighand()
+ * has put off unless leave() will. */
+static void leave_libc(void)
+{
+   In_libc = 0;
+   if (Report_pending && !Holding && !Accounting
+         && __sync_bool_compare_and_swap(&Report_pending, 1, 0))
+      report_all(NULL);
+} /* leave_libc */
+
+/*
+ * Override libc's functions.  Using malloc hooks would be nicer,
+ * but the it's impossible to chain up in a thread-safe manner.
+ * We only know which shard to account in once we have the pointer,
+ * so new memory is allocated before entering the critical section.
+ * It's safe because nobody else knows about it until we return.
+ * On the contrary, freed memory must be collect()ed before it's
+ * returned to libc, which may give it to another thread right away.
+ */
 void *malloc(size_t size)
 {
    void *ptr;
-   WRAP_MALLFUNC(
-      { ptr = garbage(__libc_malloc(size), size, 0); },
-      { ptr =         __libc_malloc(size); });
+
+   enter_libc();
+   ptr = __libc_malloc(size);
+   leave_libc();
+   GARBAGE(ptr, size);
    return ptr;
 } /* malloc */
 
 void *calloc(size_t n, size_t size1)
 {
    void *ptr;
-   WRAP_MALLFUNC(
-      { ptr = garbage(__libc_calloc(n, size1), size1*n, 0); },
-      { ptr =         __libc_calloc(n, size1); });
+
+   enter_libc();
+   ptr = __libc_calloc(n, size1);
+   leave_libc();
+   GARBAGE(ptr, size1*n);
    return ptr;
 } /* calloc */
 
 void *memalign(size_t boundary, size_t size)
 {
    void *ptr;
-   WRAP_MALLFUNC(
-      { ptr = garbage(__libc_memalign(boundary, size), size, 0); },
-      { ptr =         __libc_memalign(boundary, size); });
+
+   enter_libc();
+   ptr = __libc_memalign(boundary, size);
+   leave_libc();
+   GARBAGE(ptr, size);
    return ptr;
 } /* memalign */
 
 void *valloc(size_t size)
 {
    void *ptr;
-   WRAP_MALLFUNC(
-      { ptr = garbage(__libc_valloc(size), size, 0); },
-      { ptr =         __libc_valloc(size); });
+
+   enter_libc();
+   ptr = __libc_valloc(size);
+   leave_libc();
+   GARBAGE(ptr, size);
    return ptr;
 } /* valloc */
 
 void *pvalloc(size_t size)
 {
    void *ptr;
-   WRAP_MALLFUNC(
-      { ptr = garbage(__libc_pvalloc(size), size, 0); },
-      { ptr =         __libc_pvalloc(size); });
+
+   enter_libc();
+   ptr = __libc_pvalloc(size);
+   leave_libc();
+   GARBAGE(ptr, size);
    return ptr;
 } /* pvalloc */
 
 void *realloc(void *ptr, size_t size)
 {
-   if (ptr && size)
+   if (ptr && size && Tracing)
+   {  /* Let erodump know which thread's realloc() freed $ptr
+       * in case $newptr ends up in another thread's ring. */
+      void *newptr;
+
+      if (!Profiling)
+      {  /* Forget $ptr rather than follow it as a new allocation. */
+         trace(EROEVT_FREE, ptr, 0);
+         enter_libc();
+         ptr = __libc_realloc(ptr, size);
+         leave_libc();
+         return ptr;
+      }
+
+      trace(EROEVT_REALLOC_FROM, ptr, 0);
+      enter_libc();
+      newptr = __libc_realloc(ptr, size);
+      leave_libc();
+      if (newptr)
+         trace(EROEVT_REALLOC_TO, newptr, size);
+      else
+         trace(EROEVT_REALLOC_FAILED, ptr, 0);
+      ptr = newptr;
+   } else if (ptr && size)
    {
-      WRAP_MALLFUNC(
-         { ptr = regarbage(ptr, __libc_realloc(ptr, size), size); },
-         { ptr =                __libc_realloc(ptr, size); });
+      void *newptr;
+      struct ero_st *mem;
+      struct shard_st *sh;
+
+      if (!(sh = enter(ptr)))
+      {
+         enter_libc();
+         ptr = __libc_realloc(ptr, size);
+         leave_libc();
+         return ptr;
+      }
+
+      /* Take $ptr's record out of its shard before libc may hand out
+       * $ptr again, then file it in $newptr's shard. */
+      /* Critical section, $Holding keeps sighand() off. */
+      account_usable(ptr, -1);
+      if ((newptr = __libc_realloc(ptr, size)) != NULL)
+         mem = unrecord(sh, ptr);
+      else
+      {  /* $ptr is left intact. */
+         account_usable(ptr, +1);
+         mem = NULL;
+      }
+      /* Critical section */
+      leave(sh);
+
+      if (mem)
+      {  /* $mem is ours now, don't let enter() refuse it. */
+         account_usable(newptr, +1);
+         sh = lock_shard(newptr);
+         regarbage(sh, mem, newptr, size);
+         leave(sh);
+      } else if (sample(newptr, size))
+         /* Haven't seen $ptr yet or it wasn't sampled. */
+         WRAP_MALLFUNC(newptr, garbage(sh, newptr, size));
+      ptr = newptr;
    } else if (!ptr)
    {  /* Using malloc() would show up in the backtrace. */
-      WRAP_MALLFUNC(
-         { ptr = garbage(__libc_malloc(size), size, 0); },
-         { ptr =         __libc_malloc(size); });
+      enter_libc();
+      ptr = __libc_malloc(size);
+      leave_libc();
+      GARBAGE(ptr, size);
    } else /* !size */
    {
       free(ptr);
@@ -1012,9 +3381,13 @@ void *realloc(void *ptr, size_t size)
 
 void free(void *ptr)
 {
-   WRAP_MALLFUNC(
-      { __libc_free(ptr);  collect(ptr); },
-      { __libc_free(ptr); });
+   if (Tracing)
+      trace(EROEVT_FREE, ptr, 0);
+   else
+      WRAP_MALLFUNC(ptr, { account_usable(ptr, -1); collect(sh, ptr); });
+   enter_libc();
+   __libc_free(ptr);
+   leave_libc();
 } /* free */
 
 void cfree(void *ptr)
@@ -1032,15 +3405,54 @@ void ero_init(void)
 
    Profiling = End_to_end = (env = getenv("LIBERO_START"))
       && (*env == '1' || *env == 'y' || *env == 'Y');
+   if (Profiling)
+   {
+      gettimeofday(&Profiling_since, NULL);
+      Profiling_since_ns = now_ns();
+      Collecting = 1;
+   }
 
    if ((env = getenv("LIBERO_DEPTH")) != NULL)
       Backtrace_depth = atoi(env);
+   if (Backtrace_depth > MAX_DEPTH)
+      Backtrace_depth = MAX_DEPTH;
    if ((env = getenv("LIBERO_KARMA_DEPTH")))
       Karma_min_depth = atoi(env);
    if ((env = getenv("LIBERO_TERSE")) != NULL)
       Summary_only = atoi(env);
-   if (Summary_only)
+   if ((env = getenv("LIBERO_TOP")) != NULL)
+      Top_sites = atoi(env);
+   if ((env = getenv("LIBERO_SNAPSHOT")) != NULL)
+      Snapshot = atoi(env);
+#ifdef _THREAD_SAFE
+   if ((env = getenv("LIBERO_SOCKET")) != NULL && *env)
+   {  /* Don't let the programs we start take over the socket. */
+      listen_control(env);
+      unsetenv("LIBERO_SOCKET");
+   }
+#endif
+   if (Summary_only && !Top_sites)
       Backtrace_depth = 0;
+   if ((env = getenv("LIBERO_SAMPLE_BYTES")) != NULL)
+      Sample_bytes = strtoul(env, NULL, 0);
+   if ((env = getenv("LIBERO_HUGEPAGES")) != NULL)
+      Hugepages = atoi(env);
+   if ((env = getenv("LIBERO_FORMAT")) != NULL)
+      Format = !strcmp(env, "binary") ? FORMAT_BINARY
+         : !strcmp(env, "folded") ? FORMAT_FOLDED
+         : !strcmp(env, "pprof")  ? FORMAT_PPROF : FORMAT_TEXT;
+
+   if ((env = getenv("LIBERO_TRACE")) != NULL && (Tracing = atoi(env)))
+   {  /* erodump does all the accounting. */
+#ifdef _THREAD_SAFE
+      pthread_key_create(&Ring_key, ring_died);
+      sem_init(&Drain_wakeup, 0, 0);
+      start_drainer();
+#endif
+      pthread_atfork(lock_for_fork_trace, unlock_after_fork_trace,
+                     forked_trace);
+      Sample_bytes = 0;
+   }
 
    if ((env = getenv("LIBERO_TICK")) != NULL)
    {
@@ -1066,10 +3478,26 @@ void ero_init(void)
 static __attribute__((destructor))
 void ero_done(void)
 {
+   if (Tracing)
+   {  /* Write out what's left. */
+      Profiling = Collecting = 0;
+      if (End_to_end)
+         mark();
+      Accounting = 1;
+      flush();
+      return;
+   }
+
+#ifdef _THREAD_SAFE
+   /* Don't leave the socket behind, unless it's not ours. */
+   if (Control_fd >= 0 && Control_pid == getpid())
+      unlink(Control_addr.sun_path);
+#endif
+
    if (End_to_end)
    {
-      Profiling = 0;
-      report();
+      Profiling = Collecting = 0;
+      report_all(NULL);
    }
 } /* ero_done */
 /* Constructors }}} */
@@ -0,0 +1,731 @@
+/*
+ * libprof.c -- a sampling CPU profiler based on libarf {{{
+ *
+ * When preloaded into a program libprof arms a timer in every thread
+ * which measures the thread's CPU time, and sends it SIGPROF at every
+ * 1/$LIBPROF_HZ seconds of it.  The signal handler captures the stack
+ * of the interrupted code into the thread's own ring buffer without
+ * locks or allocations.  A background thread drains the rings into
+ * a histogram of the stacks, and at exit (or on $LIBPROF_SIGNAL) it is
+ * written to <program>.<pid>.prof, the stacks sorted by the number of
+ * times they were sampled, symbolized by libarf.  The hottest paths
+ * are at the top.
+ *
+ * The report goes like: {{{
+ * ---------------------------------------------------------------------------
+ * report 1 created on:    14:02:11.104530 17/10/26
+ * samples:                1512 (100 Hz per thread, 4 threads)
+ * dropped samples:        0
+ *
+ * samples=803 (53.1%)
+ *    1. testero_mt testero.c:78  roulette()
+ *    2. testero_mt testero.c:17  foo()
+ *    3. testero_mt testero.c:106 zetork()
+ * samples=412 (27.2%)
+ *    1. libc.so.6                [0x7f0c2d4a1b2c]
+ *    2. testero_mt testero.c:52  roulette()
+ *    3. testero_mt testero.c:106 zetork()
+ * ...
+ * }}}
+ *
+ * Unwinding: {{{
+ * With CONFIG_FAST_UNWIND on x86-64 and aarch64 the frame pointers are
+ * followed from the interrupted context, which is safe in a signal
+ * handler, but only sees through code compiled with frame pointers.
+ * Otherwise backtrace() is used, which understands the signal frame and
+ * code without frame pointers, but it's not quite async-signal-safe.
+ * It's called once at startup so it won't need to load libgcc from the
+ * signal handler.
+ * }}}
+ *
+ * Environment: {{{
+ *   -- $LIBPROF_HZ=<unsigned>: (./prof -hz)
+ *      How many times to sample a thread per second of its CPU time.
+ *      The default is 100.
+ *   -- $LIBPROF_DEPTH=<unsigned>: (./prof -depth)
+ *      At most how many frames to capture, up to MAX_DEPTH.
+ *   -- $LIBPROF_SIGNAL=<signal-number>: (./prof -signal)
+ *      Write a report when receiving this signal besides at exit.
+ *      The reports are cumulative.
+ * }}}
+ * }}}
+ */
+
+/* Configuration */
+#define _GNU_SOURCE
+//#define CONFIG_FAST_UNWIND
+
+/* Include files */
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "libarf.c"
+
+/* Standard definitions */
+/* The defaults of $LIBPROF_HZ and $LIBPROF_DEPTH. */
+#define DFLT_HZ                     100
+#define DFLT_DEPTH                  64
+
+/* The most frames we capture. */
+#define MAX_DEPTH                   256
+
+/* How many frames of the signal handler backtrace() may see
+ * above the interrupted one. */
+#define HANDLER_FRAMES              4
+
+/* The number of words in a thread's ring_st. */
+#define RING_WORDS                  (1u << 15)
+
+/* The number of buckets in $Stacks. */
+#define NSTACK_BUCKETS              (1u << 12)
+
+/* Macros */
+#define gettid()                    (pid_t)syscall(SYS_gettid)
+
+/* The PC where the thread was interrupted in the ucontext_t $ctx. */
+#if defined(__x86_64__)
+# define CONTEXT_PC(ctx)            ((void *)(ctx)->uc_mcontext.gregs[REG_RIP])
+#elif defined(__aarch64__)
+# define CONTEXT_PC(ctx)            ((void *)(ctx)->uc_mcontext.pc)
+#endif
+
+/* Follow the frame pointers from the signal context? */
+#if defined(CONFIG_FAST_UNWIND) \
+   && (defined(__x86_64__) || defined(__aarch64__))
+# define UNWIND_CONTEXT
+#endif
+
+/* Type definitions {{{ */
+/* The profiling state of a thread. */
+struct thread_st
+{
+   /*
+    * $next:      The next thread_st in $Threads.
+    * $timer:     Which sends SIGPROF to the thread.
+    * $dead:      The thread has exited, drain() may recycle it.
+    * $head, $tail: The positions in $ring where sample() writes
+    *             the next sample and where drain() reads the next one.
+    *             They only increase.
+    * $dropped:   How many samples sample() had to drop, because
+    *             $ring was full.
+    * $ring:      The samples, each being the number of frames
+    *             followed by their return addresses.
+    */
+   struct thread_st *next;
+   timer_t timer;
+   int dead;
+   unsigned long head, tail;
+   unsigned long dropped;
+   uintptr_t ring[RING_WORDS];
+};
+
+/* A distinct stack the program was found in. */
+struct stack_st
+{
+   struct stack_st *next;
+   unsigned long count;
+   unsigned hash, depth;
+   void *addrs[0];
+};
+
+/* A line of report(): the stacks which bt0() prints the same. */
+struct merged_st
+{
+   /*
+    * $stack:     One of the stacks, to print.
+    * $count:     The samples of all of them.
+    * $key:       Made of what bt0() prints of each frame of $stack.
+    */
+   struct stack_st const *stack;
+   unsigned long count;
+   uintptr_t key;
+};
+
+/* What pthread_create() passes to start(). */
+struct start_st
+{
+   void *(*fun)(void *);
+   void *arg;
+};
+/* }}} */
+
+/* Private variables {{{ */
+/*
+ * $Hz, $Depth:     $LIBPROF_HZ and $LIBPROF_DEPTH.
+ * $Sampling:       Whether sample() should record anything.
+ *                  Cleared at exit and in fork()ed children.
+ * $Threads:        The thread_st:s of all threads which have been
+ *                  sampled, protected by $Threads_lock.
+ * $Thread:         The thread's own thread_st.
+ * $Thread_key:     To tell when the thread exits.
+ * $Real_pthread_create: The one we're overriding.
+ */
+static unsigned Hz = DFLT_HZ, Depth = DFLT_DEPTH;
+static volatile sig_atomic_t Sampling;
+static struct thread_st *Threads;
+static pthread_mutex_t Threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct thread_st *Thread;
+static pthread_key_t Thread_key;
+static int (*Real_pthread_create)(pthread_t *, pthread_attr_t const *,
+   void *(*)(void *), void *);
+
+/*
+ * $Stacks:         The histogram: a hash table of NSTACK_BUCKETS lists
+ *                  of the stacks drain() has found in the rings.
+ * $NStacks, $NSamples, $NDropped: The number of the distinct stacks,
+ *                  all samples, and the dropped ones.
+ * $Drain_lock:     Serializes drain()s and report()s, as the rings
+ *                  can only have one reader.
+ * $Report_pending: Set by sighand() to have drainer() report().
+ * $NReports:       The number of report()s made so far.
+ */
+static struct stack_st *Stacks[NSTACK_BUCKETS];
+static unsigned NStacks;
+static unsigned long NSamples, NDropped;
+static pthread_mutex_t Drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t Report_pending;
+static unsigned NReports;
+/* Private variables }}} */
+
+/* Program code */
+/* Sampling {{{ */
+/* Capture the stack of $ctx in $addrs of MAX_DEPTH + HANDLER_FRAMES.
+ * Returns its depth. */
+static __attribute__((noinline))
+unsigned unwind(void **addrs, ucontext_t const *ctx)
+{
+#ifdef UNWIND_CONTEXT
+   unsigned depth;
+   void const *sseg;
+   void const *const *fp;
+
+   /* Start from where the thread was interrupted. */
+   addrs[0] = CONTEXT_PC(ctx);
+# ifdef __x86_64__
+   fp = (void const *const *)ctx->uc_mcontext.gregs[REG_RBP];
+# else /* __aarch64__ */
+   fp = (void const *const *)ctx->uc_mcontext.regs[29];
+# endif
+
+   sseg = NULL;
+   for (depth = 1; depth < Depth; depth++)
+      if (!(fp = getlr(fp, (void const **)&addrs[depth], &sseg)))
+         break;
+   return depth;
+#else /* ! UNWIND_CONTEXT */
+   int depth, top;
+
+   depth = backtrace(addrs, Depth + HANDLER_FRAMES);
+# ifdef CONTEXT_PC
+   /* Skip ourselves, sample() and the signal trampoline, however
+    * many frames they are, up to where the thread was interrupted. */
+   for (top = 0; top < depth; top++)
+      if (addrs[top] == CONTEXT_PC(ctx))
+         break;
+   if (top >= depth)
+   {  /* backtrace() couldn't see through the signal frame. */
+      addrs[0] = CONTEXT_PC(ctx);
+      return 1;
+   }
+# else
+   /* Skip ourselves and the signal trampoline. */
+   top = 2;
+# endif
+
+   if (depth <= top)
+      return 0;
+   depth -= top;
+   if (depth > Depth)
+      depth = Depth;
+   memmove(addrs, &addrs[top], sizeof(*addrs) * depth);
+   return depth;
+#endif
+} /* unwind */
+
+/* The SIGPROF handler: capture the stack into the thread's ring. */
+static void sample(int signum, siginfo_t *si, void *ctx)
+{
+   int saved_errno;
+   unsigned depth, i;
+   unsigned long head;
+   struct thread_st *thread;
+   void *addrs[MAX_DEPTH + HANDLER_FRAMES];
+
+   if (!Sampling || !(thread = Thread))
+      return;
+
+   saved_errno = errno;
+   if (!(depth = unwind(addrs, ctx)))
+      goto out;
+
+   /* Is there room for $depth and the $addrs? */
+   head = thread->head;
+   if (head + 1 + depth
+         - __atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE) > RING_WORDS)
+   {
+      __atomic_add_fetch(&thread->dropped, 1, __ATOMIC_RELAXED);
+      goto out;
+   }
+
+   thread->ring[head++ % RING_WORDS] = depth;
+   for (i = 0; i < depth; i++)
+      thread->ring[head++ % RING_WORDS] = (uintptr_t)addrs[i];
+   __atomic_store_n(&thread->head, head, __ATOMIC_RELEASE);
+
+out:
+   errno = saved_errno;
+} /* sample */
+
+/* Called when a thread exits to let drain() recycle its thread_st. */
+static void thread_died(void *thread)
+{
+   timer_delete(((struct thread_st *)thread)->timer);
+   __atomic_store_n(&((struct thread_st *)thread)->dead, 1,
+      __ATOMIC_RELEASE);
+} /* thread_died */
+
+/* Start sampling the calling thread. */
+static void start_sampling(void)
+{
+   struct sigevent sev;
+   struct itimerspec its;
+   struct thread_st *thread;
+#ifdef UNWIND_CONTEXT
+   void const *lo, *hi;
+
+   /* Let getlr() know the thread's stack before sample() needs it,
+    * it can't find it out in a signal handler. */
+   stack_bounds(&lo, &hi);
+#endif
+
+   /* Recycle the thread_st of an exited thread if we can.  drain()
+    * has made sure its ring is empty. */
+   pthread_mutex_lock(&Threads_lock);
+   for (thread = Threads; thread; thread = thread->next)
+      if (thread->dead && thread->head == thread->tail)
+         break;
+   if (thread)
+      thread->dead = 0;
+   pthread_mutex_unlock(&Threads_lock);
+
+   if (!thread)
+   {  /* The ring is only touched as far as it's used. */
+      thread = mmap(NULL, sizeof(*thread), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (thread == MAP_FAILED)
+         return;
+
+      pthread_mutex_lock(&Threads_lock);
+      thread->next = Threads;
+      Threads = thread;
+      pthread_mutex_unlock(&Threads_lock);
+   }
+
+   memset(&sev, 0, sizeof(sev));
+   sev.sigev_notify = SIGEV_THREAD_ID;
+   sev.sigev_signo = SIGPROF;
+   sev._sigev_un._tid = gettid();
+   if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &thread->timer) < 0)
+   {
+      thread->dead = 1;
+      return;
+   }
+
+   /* tv_nsec must be less than a second, and a zero interval would
+    * disarm the timer. */
+   its.it_interval.tv_sec  = 1 / Hz;
+   its.it_interval.tv_nsec = 1000000000 / Hz % 1000000000;
+   if (!its.it_interval.tv_sec && !its.it_interval.tv_nsec)
+      its.it_interval.tv_nsec = 1;
+   its.it_value = its.it_interval;
+   if (timer_settime(thread->timer, 0, &its, NULL) < 0)
+   {
+      timer_delete(thread->timer);
+      thread->dead = 1;
+      return;
+   }
+
+   pthread_setspecific(Thread_key, thread);
+   Thread = thread;
+} /* start_sampling */
+
+/* The start routine of the threads created by the program. */
+static void *start(void *arg)
+{
+   struct start_st st;
+
+   st = *(struct start_st *)arg;
+   free(arg);
+
+   start_sampling();
+   return st.fun(st.arg);
+} /* start */
+
+/* Make the new threads start_sampling(). */
+int pthread_create(pthread_t *thread, pthread_attr_t const *attr,
+   void *(*fun)(void *), void *arg)
+{
+   struct start_st *st;
+   int ret;
+
+   if (!Real_pthread_create)
+      Real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+   if (!Real_pthread_create)
+      return EAGAIN;
+   if (!(st = malloc(sizeof(*st))))
+      return Real_pthread_create(thread, attr, fun, arg);
+
+   st->fun = fun;
+   st->arg = arg;
+   if ((ret = Real_pthread_create(thread, attr, start, st)) != 0)
+      free(st);
+   return ret;
+} /* pthread_create */
+/* Sampling }}} */
+
+/* Aggregation {{{ */
+/* Returns the hash of a backtrace. */
+static unsigned hash_stack(void *const *addrs, unsigned depth)
+{
+   uintptr_t hash;
+   unsigned i;
+
+   hash = depth;
+   for (i = 0; i < depth; i++)
+      hash = (hash ^ (uintptr_t)addrs[i]) * GOLDEN_RATIO;
+   return hash >> (sizeof(hash)*8 - sizeof(unsigned)*8);
+} /* hash_stack */
+
+/* Count one more sample of the $depth long backtrace $addrs. */
+static void count(void *const *addrs, unsigned depth)
+{
+   unsigned hash;
+   struct stack_st *stack, **bucket;
+
+   NSamples++;
+   hash = hash_stack(addrs, depth);
+   bucket = &Stacks[hash % NSTACK_BUCKETS];
+   for (stack = *bucket; stack; stack = stack->next)
+      if (stack->hash == hash && stack->depth == depth
+            && !memcmp(stack->addrs, addrs, sizeof(*addrs) * depth))
+      {
+         stack->count++;
+         return;
+      }
+
+   if (!(stack = malloc(sizeof(*stack) + sizeof(*addrs) * depth)))
+   {
+      NDropped++;
+      return;
+   }
+   stack->count = 1;
+   stack->hash = hash;
+   stack->depth = depth;
+   memcpy(stack->addrs, addrs, sizeof(*addrs) * depth);
+   stack->next = *bucket;
+   *bucket = stack;
+   NStacks++;
+} /* count */
+
+/* Move the samples from the rings of $Threads to $Stacks.
+ * Called with $Drain_lock held. */
+static void drain(void)
+{
+   struct thread_st *thread;
+
+   pthread_mutex_lock(&Threads_lock);
+   for (thread = Threads; thread; thread = thread->next)
+   {
+      unsigned long head, tail;
+
+      head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+      for (tail = thread->tail; tail < head; )
+      {
+         unsigned depth, i;
+         void *addrs[MAX_DEPTH];
+
+         depth = thread->ring[tail++ % RING_WORDS];
+         for (i = 0; i < depth; i++)
+            addrs[i] = (void *)thread->ring[tail++ % RING_WORDS];
+         count(addrs, depth);
+      }
+      __atomic_store_n(&thread->tail, tail, __ATOMIC_RELEASE);
+
+      NDropped += __atomic_exchange_n(&thread->dropped, 0,
+         __ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(&Threads_lock);
+} /* drain */
+
+/* qsort() comparator of merged_st:s by their count, descending. */
+static int cmp_stacks(void const *lhs, void const *rhs)
+{
+   struct merged_st const *l = lhs;
+   struct merged_st const *r = rhs;
+
+   if (l->count > r->count)
+      return -1;
+   else if (l->count < r->count)
+      return +1;
+   else
+      return 0;
+} /* cmp_stacks */
+
+/* qsort() comparator of merged_st:s by their $key. */
+static int cmp_keys(void const *lhs, void const *rhs)
+{
+   struct merged_st const *l = lhs;
+   struct merged_st const *r = rhs;
+
+   if (l->key < r->key)
+      return -1;
+   else if (l->key > r->key)
+      return +1;
+   else
+      return 0;
+} /* cmp_keys */
+
+/* Mix the string $str into $key. */
+static uintptr_t mix_string(uintptr_t key, char const *str)
+{
+   if (!str)
+      return (key ^ 1) * GOLDEN_RATIO;
+   do
+      key = (key ^ (unsigned char)*str) * GOLDEN_RATIO;
+   while (*str++);
+   return key;
+} /* mix_string */
+
+/* Return the key of the $depth frames at $addrs, which is the same
+ * for stacks printed the same, even if their PCs are different. */
+static uintptr_t stack_key(void *const *addrs, unsigned depth)
+{
+   unsigned i;
+   uintptr_t key;
+   struct callsite_st cs;
+
+   key = depth;
+   for (i = 0; i < depth; i++)
+   {
+      bt1_cached(&cs, addrs[i]);
+      if (!cs.funame && !cs.cls)
+      {  /* bt0() prints the PC itself. */
+         key = (key ^ (uintptr_t)addrs[i]) * GOLDEN_RATIO;
+         continue;
+      }
+
+      key = (key ^ (uintptr_t)cs.dso) * GOLDEN_RATIO;
+      key = mix_string(key, cs.location);
+      key = mix_string(key, cs.cls);
+      key = mix_string(key, cs.funame);
+   }
+
+   return key;
+} /* stack_key */
+
+/* Returns the file name to report() in.  Get it right even after
+ * a fork(). */
+static char const *report_fname(void)
+{
+   static char buf[64];
+   char const *prg;
+
+   if (!(prg = strrchr(program_invocation_short_name, '/')))
+      prg = program_invocation_short_name;
+   else
+      prg++;
+   snprintf(buf, sizeof(buf), "%s.%u.prof", prg, getpid());
+   return buf;
+} /* report_fname */
+
+/* Write the histogram in the report file, the most frequent stacks
+ * first.  Called with $Drain_lock held. */
+static void report(void)
+{
+   struct tm tm;
+   time_t t;
+   FILE *out;
+   struct merged_st *stacks;
+   struct stack_st *stack;
+   unsigned nthreads, n, i, o;
+   struct thread_st *thread;
+
+   drain();
+
+   /* Take a snapshot of $Stacks.  They're kept by PC, but they're
+    * printed by function and line, so merge those which would look
+    * the same, then sort them. */
+   if (!(stacks = malloc(sizeof(*stacks) * (NStacks ? NStacks : 1))))
+      return;
+   check_dl_subs();
+   for (n = i = 0; i < NSTACK_BUCKETS; i++)
+      for (stack = Stacks[i]; stack; stack = stack->next, n++)
+      {
+         stacks[n].stack = stack;
+         stacks[n].count = stack->count;
+         stacks[n].key = stack_key(stack->addrs, stack->depth);
+      }
+   qsort(stacks, n, sizeof(*stacks), cmp_keys);
+   for (o = i = 0; i < n; i++)
+      if (o > 0 && stacks[o-1].key == stacks[i].key)
+         stacks[o-1].count += stacks[i].count;
+      else
+         stacks[o++] = stacks[i];
+   n = o;
+   qsort(stacks, n, sizeof(*stacks), cmp_stacks);
+
+   pthread_mutex_lock(&Threads_lock);
+   for (nthreads = 0, thread = Threads; thread; thread = thread->next)
+      nthreads++;
+   pthread_mutex_unlock(&Threads_lock);
+
+   /* Use a FILE of our own rather than swapping $stderr, which
+    * the program may be writing concurrently. */
+   if (!(out = fopen(report_fname(), "a")))
+      goto out;
+
+   t = time(NULL);
+   localtime_r(&t, &tm);
+   fprintf(out,
+      "report %u created on:\t"  "%.2u:%.2u:%.2u %.2u/%.2u/%.2u\n",
+      ++NReports, tm.tm_hour, tm.tm_min, tm.tm_sec,
+      tm.tm_mday, 1+tm.tm_mon, tm.tm_year % 100);
+   fprintf(out,
+      "samples:\t\t"             "%lu (%u Hz per thread, %u threads)\n",
+      NSamples, Hz, nthreads);
+   fprintf(out,
+      "dropped samples:\t"       "%lu\n", NDropped);
+   fputs("\n", out);
+
+   for (i = 0; i < n; i++)
+   {
+      fprintf(out, "samples=%lu (%.1f%%)\n", stacks[i].count,
+         100.0 * stacks[i].count / NSamples);
+
+      /* bt0() logs onto stderr unless it's buffering. */
+      begin_output();
+      for (o = 0; o < stacks[i].stack->depth; o++)
+         bt0(o+1, stacks[i].stack->addrs[o], NULL);
+      fflush(out);
+      write_output(fileno(out));
+   }
+
+   fputs("-------------------------------------------------"
+         "--------------------------\n", out);
+   fclose(out);
+out:
+   free(stacks);
+} /* report */
+
+/* Periodically drain() the rings before they fill up,
+ * and report() when asked to. */
+static void *drainer(void *unused)
+{
+   sigset_t sigs;
+
+   /* Don't let signals interrupt us. */
+   sigfillset(&sigs);
+   pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+   for (;;)
+   {
+      usleep(100000);
+      pthread_mutex_lock(&Drain_lock);
+      if (Report_pending)
+      {
+         Report_pending = 0;
+         report();
+      } else
+         drain();
+      pthread_mutex_unlock(&Drain_lock);
+   }
+
+   return NULL;
+} /* drainer */
+
+/* The $LIBPROF_SIGNAL handler. */
+static void sighand(int unused)
+{
+   Report_pending = 1;
+} /* sighand */
+
+/* fork()ed children don't inherit the timers or drainer(),
+ * and they shouldn't report the parent's samples. */
+static void forked(void)
+{
+   Sampling = 0;
+} /* forked */
+/* Aggregation }}} */
+
+/* Constructors {{{ */
+/* Start sampling the main thread and drainer(). */
+static __attribute__((constructor))
+void prof_init(void)
+{
+   char const *env;
+   pthread_t thread;
+   struct sigaction sa;
+
+   if ((env = getenv("LIBPROF_HZ")) != NULL && atoi(env) > 0)
+      Hz = atoi(env);
+   if ((env = getenv("LIBPROF_DEPTH")) != NULL && atoi(env) > 0)
+      Depth = atoi(env) < MAX_DEPTH ? atoi(env) : MAX_DEPTH;
+
+#ifndef UNWIND_CONTEXT
+   {  /* Let backtrace() load what it needs now. */
+      void *addrs[1];
+
+      backtrace(addrs, 1);
+   }
+#endif
+
+   if (!Real_pthread_create)
+      Real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+   if (!Real_pthread_create)
+      return;
+   pthread_key_create(&Thread_key, thread_died);
+   pthread_atfork(NULL, NULL, forked);
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_sigaction = sample;
+   sa.sa_flags = SA_SIGINFO | SA_RESTART;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGPROF, &sa, NULL);
+   if ((env = getenv("LIBPROF_SIGNAL")) != NULL)
+      signal(atoi(env), sighand);
+
+   if (!Real_pthread_create(&thread, NULL, drainer, NULL))
+      pthread_detach(thread);
+
+   Sampling = 1;
+   start_sampling();
+} /* prof_init */
+
+/* Make the final report(). */
+static __attribute__((destructor))
+void prof_done(void)
+{
+   if (!Sampling)
+      return;
+   Sampling = 0;
+
+   pthread_mutex_lock(&Drain_lock);
+   report();
+   pthread_mutex_unlock(&Drain_lock);
+} /* prof_done */
+/* Constructors }}} */
+
+/* vim: set et ts=3 sw=3 foldmethod=marker: */
+/* End of libprof.c */
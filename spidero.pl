@@ -568,6 +568,7 @@ my ($opt_graph_memo, $opt_graph_calloc, $opt_graph_numa);
 my ($opt_graph_bloat, $opt_graph_baro, $opt_graph_spider);
 my ($opt_trendy, $opt_summary, $opt_cat);
 my (@all_tasks, @tasks, @rounds);
+my $in_sites;
 
 Getopt::Long::Configure(qw(bundling no_ignore_case no_getopt_compat));
 exit 1 unless GetOptions(
@@ -652,8 +653,12 @@ while (<>)
 		!@opt_rounds || @rounds
 			or close(ARGV);
 	} elsif (defined $Round)
-	{
-		$_->process($line) foreach @tasks;
+	{	# Only --cat is interested in the top allocation sites,
+		# don't let the others take their frames for records'.
+		$in_sites = 1 if /^top \d+ allocation sites:$/;
+		$in_sites = 0 if /^$/;
+		$_->process($line) foreach $in_sites
+			? grep($_->isa('Spidero::Cat'), @tasks) : @tasks;
 	}
 } continue
 {
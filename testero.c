@@ -142,7 +142,7 @@ int main(int argc, char const *argv[])
 		unsigned *idp;
 
 		idp = malloc(sizeof(*idp));
-		*idp = id;
+		*idp = i;
 		pthread_create(&tids[i], NULL, zetork, idp);
 	}
 	for (i = 0; i < n; i++)